@@ -6,32 +6,158 @@
 #include <regex>
 #include <limits> // Numeric limits
 #include <sstream> // String stream
+#include <cstdio> // rename, remove
+#include <cstdint> // Fixed-width integers
+#include <filesystem> // resize_file
+#include <algorithm>
+#include <unordered_map> // Hash indexes
+#include <unordered_set>
+#include <map> // Ordered search terms
+#include <list> // LRU of the loaded interaction histories
+#include <charconv> // Number formatting for the table renderer
+#include <chrono> // Benchmark timing
+#include <thread>
+#include <mutex>
+#include <shared_mutex> // Server mode: concurrent readers, one writer
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory> // unique_ptr
+#include <string_view>
+#include <cctype>
+#include <cstring> // memcpy, memcmp
+#include <array>
+#ifndef _WIN32
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close
+#include <sys/socket.h> // server mode
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <csignal>
+#endif
 
 using namespace std;   
 
-// Class to hold interaction data
+// Class to hold interaction data in packed form: the interaction type is an
+// ID interned by the CRM, and the date a day number (see parseDayNumber)
 class Interaction {
 public:
-    string type;
-    string date;
+    uint32_t type;
+    int32_t date;
 
-    Interaction(string type, string date) : type(type), date(date) {}
+    Interaction() : type(0), date(0) {}
+    Interaction(uint32_t type, int32_t date) : type(type), date(date) {}
 };
 
-// Class to hold customer data
+// Arena for the customers' text fields. Values are copied into large blocks
+// that never move, so the views handed out stay valid until the pool is
+// cleared. Names repeat a lot and are interned: each distinct one is stored once.
+class StringPool {
+public:
+    static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+    StringPool() : cursor(nullptr), available(0), used(0) {}
+
+    // Copy of a value in the pool
+    string_view store(string_view value) {
+        if (value.empty()) {
+            return string_view();
+        }
+        if (value.size() > available) {
+            available = max(BLOCK_SIZE, value.size());
+            blocks.emplace_back(new char[available]);
+            cursor = blocks.back().get();
+        }
+        memcpy(cursor, value.data(), value.size());
+        string_view stored(cursor, value.size());
+        cursor += value.size();
+        available -= value.size();
+        used += value.size();
+        return stored;
+    }
+
+    // Shared copy of a value that repeats
+    string_view intern(string_view value) {
+        auto it = interned.find(value);
+        if (it != interned.end()) {
+            return *it;
+        }
+        string_view stored = store(value);
+        interned.insert(stored);
+        return stored;
+    }
+
+    // Copy of a whole buffer in a block of its own (the snapshot's string heap)
+    const char* storeBlock(const char* data, size_t size) {
+        blocks.emplace_back(new char[size]);
+        memcpy(blocks.back().get(), data, size);
+        used += size;
+        return blocks.back().get();
+    }
+
+    // Take over the blocks of another pool; its values keep their addresses
+    void adopt(StringPool& other) {
+        for (auto& block : other.blocks) {
+            blocks.push_back(move(block));
+        }
+        interned.insert(other.interned.begin(), other.interned.end());
+        used += other.used;
+        other.clear();
+    }
+
+    void clear() {
+        blocks.clear();
+        interned.clear();
+        cursor = nullptr;
+        available = 0;
+        used = 0;
+    }
+
+    // Bytes stored
+    size_t size() const {
+        return used;
+    }
+
+private:
+    vector<unique_ptr<char[]>> blocks;
+    unordered_set<string_view> interned;
+    char* cursor;      // free space of the last block
+    size_t available;
+    size_t used;
+};
+
+// Class to hold customer data. The text fields are views into the string
+// pool of the CRM (or of the loader that parsed them).
 class Customer {
 public:
-    string firstName;
-    string lastName;
-    string email;
-    string phone;
+    string_view firstName;
+    string_view lastName;
+    string_view email;
+    string_view phone;
     int customerId;
-    vector<Interaction> interactions;
 
-    Customer(string firstName, string lastName, string email, string phone, int customerId) 
-        : firstName(firstName), lastName(lastName), email(email), phone(phone), customerId(customerId) {
-    interactions.push_back(Interaction("No Interaction", "N/A")); // Default interaction
-}
+    // Range of the customer's interactions in the CRM's interaction arena.
+    // An empty range means "No Interaction".
+    uint32_t firstInteraction;
+    uint32_t interactionCount;
+    uint32_t interactionCapacity;
+
+    // Where the history is in the CRM's history file (the file the customer
+    // was loaded from), when it has not changed since. Until the history is
+    // loaded (historyLoaded false) the range above is empty.
+    uint64_t historyOffset;
+    uint32_t historyLength;  // 0: the range is the only copy
+    bool historyLoaded;
+
+    bool deleted;  // a tombstone left in the book by a delete
+
+    Customer(string_view firstName, string_view lastName, string_view email, string_view phone, int customerId)
+        : firstName(firstName), lastName(lastName), email(email), phone(phone), customerId(customerId),
+          firstInteraction(0), interactionCount(0), interactionCapacity(0),
+          historyOffset(0), historyLength(0), historyLoaded(true), deleted(false) {}
     
     // Overload the equality operator to compare customers
     bool operator==(const Customer& other) const {
@@ -39,469 +165,7574 @@ public:
     }
 };
 
-// CRM class to manage customers and interactions
-class CRM {
+// Stable reference to a customer: an entry of the CRM's slot table and the
+// generation the entry had when the customer was stored. Unlike a Customer*
+// it survives other customers being added, deleted or compacted away, and it
+// stops resolving once its own customer is deleted.
+struct CustomerHandle {
+    uint32_t slot;
+    uint32_t generation;
+};
+
+// Parse a whole decimal integer (optional minus sign, no blanks). Returns
+// false when text is not exactly such a number or it does not fit an int.
+bool parseInt(string_view text, int& value) {
+    auto result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size();
+}
+
+// Day number (days since 01/01/0001) of a "dd/mm/yyyy" date. Returns false
+// unless the text is exactly a valid date in that format, so that formatting
+// the day number gives the same text back.
+bool parseDayNumber(string_view text, int32_t& day) {
+    if (text.size() != 10 || text[2] != '/' || text[5] != '/') {
+        return false;
+    }
+    int value[3] = {0, 0, 0};
+    const int starts[3] = {0, 3, 6};
+    const int lengths[3] = {2, 2, 4};
+    for (int f = 0; f < 3; ++f) {
+        for (int i = starts[f]; i < starts[f] + lengths[f]; ++i) {
+            if (text[i] < '0' || text[i] > '9') {
+                return false;
+            }
+            value[f] = value[f] * 10 + (text[i] - '0');
+        }
+    }
+
+    int d = value[0], m = value[1], y = value[2];
+    const int monthDays[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    if (y < 1 || m < 1 || m > 12 || d < 1 || d > monthDays[m - 1] + (m == 2 && leap)) {
+        return false;
+    }
+
+    // days from civil, counted from 01/03/0000
+    y -= m <= 2;
+    int era = y / 400;
+    int yearOfEra = y - era * 400;
+    int dayOfYear = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    day = era * 146097 + dayOfEra - 306;
+    return true;
+}
+
+// Year, month and day of a day number
+void civilFromDayNumber(int32_t day, int& y, int& m, int& d) {
+    // civil from days, counted from 01/03/0000
+    int z = day + 306;
+    int era = z / 146097;
+    int dayOfEra = z - era * 146097;
+    int yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int mp = (5 * dayOfYear + 2) / 153;
+    d = dayOfYear - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = yearOfEra + era * 400 + (m <= 2);
+}
+
+// "dd/mm/yyyy" text of a day number
+string formatDayNumber(int32_t day) {
+    int y, m, d;
+    civilFromDayNumber(day, y, m, d);
+
+    char text[11] = {
+        char('0' + d / 10), char('0' + d % 10), '/', char('0' + m / 10), char('0' + m % 10), '/',
+        char('0' + y / 1000), char('0' + y / 100 % 10), char('0' + y / 10 % 10), char('0' + y % 10), 0};
+    return string(text, 10);
+}
+
+// Day number of the current date (UTC)
+int32_t todayDayNumber() {
+    int32_t epoch;
+    parseDayNumber("01/01/1970", epoch);
+    return epoch + (int32_t)(chrono::duration_cast<chrono::hours>(
+        chrono::system_clock::now().time_since_epoch()).count() / 24);
+}
+
+// Instrumentation: number of calls and latency histogram of each operation,
+// plus I/O counters. Shown by the Statistics menu entry, the stats command and
+// the server's STATS request, and written periodically to the file named by
+// CRM_STATS_FILE when it is set. Building with -DCRM_NO_STATS compiles it out.
+// Heap allocations are only counted in builds with -DCRM_COUNT_ALLOCATIONS.
+class Stats {
+public:
+#ifdef CRM_NO_STATS
+    static constexpr bool ENABLED = false;
+#else
+    static constexpr bool ENABLED = true;
+#endif
+#if defined(CRM_COUNT_ALLOCATIONS) && !defined(CRM_NO_STATS)
+    static constexpr bool COUNTS_ALLOCATIONS = true;
+#else
+    static constexpr bool COUNTS_ALLOCATIONS = false;
+#endif
+
+    enum Operation {
+        LOAD_CSV, LOAD_SNAPSHOT, REPLAY_JOURNAL, SAVE_CSV, SAVE_SNAPSHOT, COMPACT, IMPORT, EXPORT,
+        INSERT_CUSTOMER, UPDATE_CUSTOMER, REMOVE_CUSTOMER, RECORD_INTERACTION,
+        FIND_BY_ID, SEARCH, LIST, VALIDATE, VALIDATE_COLUMN, DEDUPE, JOURNAL_COMMIT, READ_VIEW, TIME_QUERY, OPERATION_COUNT
+    };
+
+    enum Counter {
+        BYTES_READ, BYTES_WRITTEN, ROWS_PARSED, JOURNAL_ENTRIES, FSYNCS, HISTORIES_LOADED, ALLOCATIONS, COUNTER_COUNT
+    };
+
+    static void record(Operation operation, uint64_t nanoseconds) {
+        if (!ENABLED) {
+            return;
+        }
+        Histogram& histogram = histograms[operation];
+        histogram.count.fetch_add(1, memory_order_relaxed);
+        histogram.total.fetch_add(nanoseconds, memory_order_relaxed);
+        histogram.buckets[bucketOf(nanoseconds)].fetch_add(1, memory_order_relaxed);
+        uint64_t longest = histogram.longest.load(memory_order_relaxed);
+        while (nanoseconds > longest && !histogram.longest.compare_exchange_weak(longest, nanoseconds)) {
+        }
+    }
+
+    static void add(Counter counter, uint64_t amount) {
+        if (ENABLED) {
+            counters[counter].fetch_add(amount, memory_order_relaxed);
+        }
+    }
+
+    static uint64_t total(Counter counter) {
+        return counters[counter].load(memory_order_relaxed);
+    }
+
+    // Records the time from its construction to its destruction
+    class Timer {
+    public:
+        explicit Timer(Operation operation) : operation(operation) {
+            if (ENABLED) {
+                start = chrono::steady_clock::now();
+            }
+        }
+
+        ~Timer() {
+            if (ENABLED) {
+                record(operation, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+            }
+        }
+
+    private:
+        Operation operation;
+        chrono::steady_clock::time_point start;
+    };
+
+    // The statistics as JSON, one line per operation
+    static string json() {
+        ostringstream out;
+        out << fixed << setprecision(1) << "{\n  \"operations\": {";
+        bool first = true;
+        for (int op = 0; op < OPERATION_COUNT; ++op) {
+            uint64_t count = histograms[op].count.load(memory_order_relaxed);
+            if (count == 0) {
+                continue;
+            }
+            out << (first ? "\n" : ",\n") << "    \"" << OPERATION_NAMES[op] << "\": {\"count\": " << count
+                << ", \"total_ms\": " << histograms[op].total.load(memory_order_relaxed) / 1e6
+                << ", \"p50_us\": " << percentile(op, 0.50) / 1e3 << ", \"p95_us\": " << percentile(op, 0.95) / 1e3
+                << ", \"p99_us\": " << percentile(op, 0.99) / 1e3
+                << ", \"max_us\": " << histograms[op].longest.load(memory_order_relaxed) / 1e3 << "}";
+            first = false;
+        }
+        out << "\n  },\n  \"counters\": {";
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            if (counter == ALLOCATIONS && !COUNTS_ALLOCATIONS) {
+                continue;
+            }
+            out << (counter ? ", " : "") << "\"" << COUNTER_NAMES[counter] << "\": " << counters[counter].load(memory_order_relaxed);
+        }
+        out << ", \"resident_kb\": " << memoryKilobytes("VmRSS:") << ", \"peak_resident_kb\": " << memoryKilobytes("VmHWM:");
+        out << "}\n}\n";
+        return out.str();
+    }
+
+    static void print() {
+        if (!ENABLED) {
+            cout << "Statistics are not available (built with CRM_NO_STATS)." << endl;
+            return;
+        }
+        cout << setw(20) << "Operation" << setw(10) << "Count" << setw(14) << "Total (ms)" << setw(12) << "p50 (us)"
+            << setw(12) << "p95 (us)" << setw(12) << "p99 (us)" << setw(12) << "Max (us)" << endl;
+        cout << fixed << setprecision(1);
+        for (int op = 0; op < OPERATION_COUNT; ++op) {
+            uint64_t count = histograms[op].count.load(memory_order_relaxed);
+            if (count == 0) {
+                continue;
+            }
+            cout << setw(20) << OPERATION_NAMES[op] << setw(10) << count
+                << setw(14) << histograms[op].total.load(memory_order_relaxed) / 1e6
+                << setw(12) << percentile(op, 0.50) / 1e3 << setw(12) << percentile(op, 0.95) / 1e3
+                << setw(12) << percentile(op, 0.99) / 1e3
+                << setw(12) << histograms[op].longest.load(memory_order_relaxed) / 1e3 << endl;
+        }
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            if (counter == ALLOCATIONS && !COUNTS_ALLOCATIONS) {
+                continue;
+            }
+            cout << setw(20) << COUNTER_NAMES[counter] << setw(10) << counters[counter].load(memory_order_relaxed) << endl;
+        }
+        cout << setw(20) << "resident_kb" << setw(10) << memoryKilobytes("VmRSS:") << endl;
+        cout << setw(20) << "peak_resident_kb" << setw(10) << memoryKilobytes("VmHWM:") << endl;
+    }
+
+    // A memory figure of this process from /proc/self/status (Linux), 0 elsewhere
+    static uint64_t memoryKilobytes(const string& field) {
+        ifstream status("/proc/self/status");
+        string line;
+        while (getline(status, line)) {
+            if (line.compare(0, field.size(), field) == 0) {
+                return strtoull(line.c_str() + field.size(), nullptr, 10);
+            }
+        }
+        return 0;
+    }
+
+    // Rewrite fileName with the JSON statistics every interval seconds, from a
+    // background thread, for the lifetime of the program
+    static void startPeriodicDump(const string& fileName, double interval) {
+        if (!ENABLED) {
+            return;
+        }
+        thread([fileName, interval]() {
+            while (true) {
+                this_thread::sleep_for(chrono::duration<double>(interval));
+                {
+                    ofstream file(fileName + ".tmp");
+                    file << json();
+                }
+                rename((fileName + ".tmp").c_str(), fileName.c_str());
+            }
+        }).detach();
+    }
+
 private:
-    vector<Customer> customers;
-    int nextCustomerId;
+    // Latencies are bucketed by their three leading bits: 8 buckets per power
+    // of two, so a percentile is off by at most 12.5%
+    static const int BUCKETS = 62 * 8;
+
+    struct Histogram {
+        atomic<uint64_t> count{0};
+        atomic<uint64_t> total{0};
+        atomic<uint64_t> longest{0};
+        atomic<uint64_t> buckets[BUCKETS] = {};
+    };
+
+    static Histogram histograms[OPERATION_COUNT];
+    static atomic<uint64_t> counters[COUNTER_COUNT];
+
+    static constexpr const char* OPERATION_NAMES[OPERATION_COUNT] = {
+        "load_csv", "load_snapshot", "replay_journal", "save_csv", "save_snapshot", "compact", "import", "export",
+        "insert_customer", "update_customer", "remove_customer", "record_interaction",
+        "find_by_id", "search", "list", "validate", "validate_column", "dedupe", "journal_commit", "read_view", "time_query"};
+    static constexpr const char* COUNTER_NAMES[COUNTER_COUNT] = {
+        "bytes_read", "bytes_written", "rows_parsed", "journal_entries", "fsyncs", "histories_loaded", "allocations"};
+
+    static int bucketOf(uint64_t nanoseconds) {
+        if (nanoseconds < 8) {
+            return (int)nanoseconds;
+        }
+        int bit = 63 - __builtin_clzll(nanoseconds);
+        return (bit - 2) * 8 + (int)((nanoseconds >> (bit - 3)) & 7);
+    }
+
+    // Middle of the bucket holding the given fraction of the calls (at most the maximum)
+    static double percentile(int operation, double fraction) {
+        const Histogram& histogram = histograms[operation];
+        uint64_t count = histogram.count.load(memory_order_relaxed);
+        uint64_t rank = (uint64_t)(fraction * count);
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; ++bucket) {
+            seen += histogram.buckets[bucket].load(memory_order_relaxed);
+            if (seen > rank) {
+                if (bucket < 8) {
+                    return bucket;
+                }
+                int bit = bucket / 8 + 2;
+                uint64_t low = (uint64_t)(8 + bucket % 8) << (bit - 3);
+                return min(low + ((uint64_t)1 << (bit - 3)) / 2.0, (double)histogram.longest.load(memory_order_relaxed));
+            }
+        }
+        return histogram.longest.load(memory_order_relaxed);
+    }
+};
+
+inline Stats::Histogram Stats::histograms[Stats::OPERATION_COUNT];
+inline atomic<uint64_t> Stats::counters[Stats::COUNTER_COUNT] = {};
+
+#if defined(CRM_COUNT_ALLOCATIONS) && !defined(CRM_NO_STATS)
+// Every heap allocation of the program is counted, so the cost of a load or an
+// operation in allocations shows up next to its latency. Opt-in: all threads
+// share the counter, which slows down allocation-heavy server threads. The
+// operators stay out of line so GCC does not see malloc paired with operator delete.
+__attribute__((noinline)) void* operator new(size_t size) {
+    Stats::add(Stats::ALLOCATIONS, 1);
+    if (void* memory = malloc(size ? size : 1)) {
+        return memory;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+__attribute__((noinline)) void* operator new(size_t size, const nothrow_t&) noexcept {
+    Stats::add(Stats::ALLOCATIONS, 1);
+    return malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void* operator new[](size_t size, const nothrow_t&) noexcept {
+    return operator new(size, nothrow);
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void* memory) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void* memory, size_t) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, const nothrow_t&) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void* memory, const nothrow_t&) noexcept {
+    free(memory);
+}
+#endif
+
+// Field validators. They accept exactly the same strings as the original regexes
+//   names: ^[a-zA-Z]+([',.\-_][a-zA-Z]+)*$
+//   email: [a-zA-Z0-9_+&*-]+(?:\.[a-zA-Z0-9_+&*-]+)*@(?:[a-zA-Z0-9-]+\.)+[a-zA-Z]{2,7}
+//   phone: ^\+?[0-9]{10,15}$
+// but are hand-written state machines over a character-class table built at
+// compile time, so nothing is compiled at run time and nothing is allocated.
+class Validator {
+public:
+    enum Field { FIRST_NAME, LAST_NAME, EMAIL, PHONE };
+
+    static bool isValidName(const char* s, size_t n) {
+        // states: 0 = expecting a letter, 1 = inside a word
+        int state = 0;
+        for (size_t i = 0; i < n; ++i) {
+            uint8_t cls = charClass(s[i]);
+            if (cls & LETTER) {
+                state = 1;
+            } else if (state == 1 && (cls & NAME_SEPARATOR)) {
+                state = 0;
+            } else {
+                return false;
+            }
+        }
+        return state == 1;
+    }
+
+    static bool isValidEmail(const char* s, size_t n) {
+        // local part: non-empty atoms separated by single dots
+        size_t i = 0;
+        size_t atom = 0;
+        for (; i < n && s[i] != '@'; ++i) {
+            if (charClass(s[i]) & EMAIL_LOCAL) {
+                atom++;
+            } else if (s[i] == '.' && atom > 0) {
+                atom = 0;
+            } else {
+                return false;
+            }
+        }
+        if (i == n || atom == 0) {
+            return false;
+        }
 
-    // Function to validate first name using regex
-    bool isValidFirstName(const string& firstName) {
-        // allow letters, apostrophes, periods, hyphens, and underscores between words
-        regex firstnamePattern("^[a-zA-Z]+([',.\\-_][a-zA-Z]+)*$");
-        return regex_match(firstName, firstnamePattern);
+        // domain: at least two non-empty labels separated by dots, the last one
+        // made of 2 to 7 letters
+        size_t labels = 0;
+        size_t label = 0;
+        bool lettersOnly = true;
+        for (++i; i < n; ++i) {
+            uint8_t cls = charClass(s[i]);
+            if (cls & DOMAIN) {
+                label++;
+                lettersOnly = lettersOnly && (cls & LETTER);
+            } else if (s[i] == '.' && label > 0) {
+                labels++;
+                label = 0;
+                lettersOnly = true;
+            } else {
+                return false;
+            }
+        }
+        return labels > 0 && lettersOnly && label >= 2 && label <= 7;
     }
 
-    // Function to validate last name using regex
-    bool isValidLastName(const string& lastName) {
-        // allow letters, apostrophes, periods, hyphens, and underscores between words
-        regex lastnamePattern("^[a-zA-Z]+([',.\\-_][a-zA-Z]+)*$");
-        return regex_match(lastName, lastnamePattern);
+    static bool isValidPhone(const char* s, size_t n) {
+        size_t i = (n > 0 && s[0] == '+') ? 1 : 0;
+        size_t digits = n - i;
+        if (digits < 10 || digits > 15) {
+            return false;
+        }
+        for (; i < n; ++i) {
+            if (!(charClass(s[i]) & DIGIT)) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    // Function to validate email using regex
-    bool isValidEmail(const string& email) {
-        regex emailPattern("[a-zA-Z0-9_+&*-]+(?:\\.[a-zA-Z0-9_+&*-]+)*@(?:[a-zA-Z0-9-]+\\.)+[a-zA-Z]{2,7}");
-        return regex_match(email, emailPattern);
+    static bool isValid(Field field, string_view value) {
+        switch (field) {
+            case FIRST_NAME:
+            case LAST_NAME:
+                return isValidName(value.data(), value.size());
+            case EMAIL:
+                return isValidEmail(value.data(), value.size());
+            default:
+                return isValidPhone(value.data(), value.size());
+        }
     }
 
-    // Function to validate phone number using regex
-    bool isValidPhone(const string& phone) {
-        regex phonePattern("^\\+?[0-9]{10,15}$");
-        return regex_match(phone, phonePattern);
+    // Validate a whole column of records: valid[i] is set to 1 when column[i]
+    // is valid. Returns the number of valid values.
+    static size_t validateColumn(Field field, const vector<string_view>& column, vector<uint8_t>& valid) {
+        Stats::Timer timer(Stats::VALIDATE_COLUMN);
+        valid.resize(column.size());
+        size_t count = 0;
+        for (size_t i = 0; i < column.size(); ++i) {
+            valid[i] = isValid(field, column[i]);
+            count += valid[i];
+        }
+        return count;
     }
 
-    // Function to check if the customer exists
-    Customer* findCustomerById(int id) {
-        for (auto& customer : customers) {
-            if (customer.customerId == id) {
-                return &customer;
+private:
+    enum CharClassBits : uint8_t {
+        LETTER = 1, DIGIT = 2, NAME_SEPARATOR = 4, EMAIL_LOCAL = 8, DOMAIN = 16
+    };
+
+    struct CharTable {
+        uint8_t bits[256];
+    };
+
+    static constexpr CharTable makeCharTable() {
+        CharTable table = {};
+        for (int c = 0; c < 256; ++c) {
+            bool letter = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+            bool digit = c >= '0' && c <= '9';
+            uint8_t bits = 0;
+            if (letter) bits |= LETTER;
+            if (digit) bits |= DIGIT;
+            if (c == '\'' || c == ',' || c == '.' || c == '-' || c == '_') bits |= NAME_SEPARATOR;
+            if (letter || digit || c == '_' || c == '+' || c == '&' || c == '*' || c == '-') bits |= EMAIL_LOCAL;
+            if (letter || digit || c == '-') bits |= DOMAIN;
+            table.bits[c] = bits;
+        }
+        return table;
+    }
+
+    static uint8_t charClass(char c) {
+        static constexpr CharTable table = makeCharTable();
+        return table.bits[(unsigned char)c];
+    }
+};
+
+// Record schema: the text columns of a customer, in customers.csv order.
+// Each entry names the Customer member, its heading (customers.csv header and
+// customer table), its JSON key, its width in the customer table, its
+// validator, and whether its values are interned (they repeat, like names)
+// or just stored. The CSV and JSON parsers and serializers, the snapshot
+// records, the validation and the customer table are all generated from it
+// with forEachField, which unrolls at compile time, so a new column only
+// needs a Customer member and an entry here.
+struct FieldSchema {
+    string_view Customer::*member;
+    const char* name;
+    const char* jsonKey;
+    int width;
+    Validator::Field validator;
+    bool interned;
+};
+
+constexpr FieldSchema CUSTOMER_FIELDS[] = {
+    {&Customer::firstName, "First Name", "firstName", 20, Validator::FIRST_NAME, true},
+    {&Customer::lastName, "Last Name", "lastName", 20, Validator::LAST_NAME, true},
+    {&Customer::email, "Email", "email", 30, Validator::EMAIL, false},
+    {&Customer::phone, "Phone", "phone", 15, Validator::PHONE, false},
+};
+constexpr size_t CUSTOMER_FIELD_COUNT = size(CUSTOMER_FIELDS);
+
+// The values of a customer's columns, in schema order
+using CustomerValues = array<string_view, CUSTOMER_FIELD_COUNT>;
+
+// The column checked by a validator, for the checks that need a particular
+// column of a record (duplicate names, e-mail and phone conflicts)
+constexpr size_t fieldWith(Validator::Field validator) {
+    size_t f = 0;
+    while (CUSTOMER_FIELDS[f].validator != validator) {
+        ++f;
+    }
+    return f;
+}
+constexpr size_t FIRST_NAME_FIELD = fieldWith(Validator::FIRST_NAME);
+constexpr size_t LAST_NAME_FIELD = fieldWith(Validator::LAST_NAME);
+constexpr size_t EMAIL_FIELD = fieldWith(Validator::EMAIL);
+constexpr size_t PHONE_FIELD = fieldWith(Validator::PHONE);
+
+// The values of a record that start at fields[first] (journal entries and
+// server requests put them after the command and the customer ID)
+CustomerValues valuesAt(const vector<string>& fields, size_t first) {
+    CustomerValues values;
+    for (size_t f = 0; f < CUSTOMER_FIELD_COUNT; ++f) {
+        values[f] = fields[first + f];
+    }
+    return values;
+}
+
+// The values of a customer's columns (views of its own storage)
+CustomerValues customerValues(const Customer& customer) {
+    CustomerValues values;
+    for (size_t f = 0; f < CUSTOMER_FIELD_COUNT; ++f) {
+        values[f] = customer.*CUSTOMER_FIELDS[f].member;
+    }
+    return values;
+}
+
+// The interaction columns, in the order of a history item: key in a
+// customers.csv item ("Type:...,Date:..."), JSON key and customer table label
+struct InteractionFieldSchema {
+    string_view csvKey;
+    string_view jsonKey;
+    string_view label;
+};
+
+constexpr InteractionFieldSchema INTERACTION_FIELDS[] = {
+    {"Type:", "type", "Type: "},
+    {"Date:", "date", "Date: "},
+};
+constexpr size_t INTERACTION_FIELD_COUNT = size(INTERACTION_FIELDS);
+
+// Delimiters of customers.csv: between the columns, between the fields of a
+// history item and between the items
+constexpr char CSV_SEPARATOR = ',';
+constexpr char HISTORY_FIELD_SEPARATOR = ',';
+constexpr char HISTORY_ITEM_SEPARATOR = '|';
+
+// Call visit(integral_constant<size_t, f>) for each customer column f, so
+// that CUSTOMER_FIELDS[f] is a constant expression in the visitor
+template <class Visit, size_t... F>
+void forEachField(Visit& visit, index_sequence<F...>) {
+    (visit(integral_constant<size_t, F>()), ...);
+}
+
+template <class Visit>
+void forEachField(Visit visit) {
+    forEachField(visit, make_index_sequence<CUSTOMER_FIELD_COUNT>());
+}
+
+// Value of column f of a customer
+template <size_t F>
+string_view fieldValue(const Customer& customer, integral_constant<size_t, F>) {
+    return customer.*CUSTOMER_FIELDS[F].member;
+}
+
+// Column with this JSON key, -1 if none
+int fieldByJsonKey(string_view key) {
+    for (size_t f = 0; f < CUSTOMER_FIELD_COUNT; ++f) {
+        if (key == CUSTOMER_FIELDS[f].jsonKey) {
+            return (int)f;
+        }
+    }
+    return -1;
+}
+
+// Lowercase heading of a column, as used in messages ("invalid first name")
+string fieldLabel(size_t f) {
+    string label = CUSTOMER_FIELDS[f].name;
+    transform(label.begin(), label.end(), label.begin(), [](unsigned char c) { return tolower(c); });
+    return label;
+}
+
+// Why the values of a record (one per column, in schema order) are not
+// valid ("invalid first name", for the first column that fails), "" if they are
+string invalidFieldReason(const CustomerValues& values) {
+    for (size_t f = 0; f < CUSTOMER_FIELD_COUNT; ++f) {
+        if (!Validator::isValid(CUSTOMER_FIELDS[f].validator, values[f])) {
+            return "invalid " + fieldLabel(f);
+        }
+    }
+    return "";
+}
+
+// The customers.csv header
+string csvHeader() {
+    string header;
+    for (const FieldSchema& field : CUSTOMER_FIELDS) {
+        header += field.name;
+        header += CSV_SEPARATOR;
+    }
+    return header + "Customer ID" + CSV_SEPARATOR + "Interactions";
+}
+
+// Append the columns and the ID of a customer (or of a read view record):
+// the start of its customers.csv row, up to the interactions
+template <class Record>
+void appendCsvColumns(string& out, const Record& customer) {
+    forEachField([&](auto f) {
+        out += fieldValue(customer, f);
+        out += CSV_SEPARATOR;
+    });
+    out += to_string(customer.customerId);
+    out += CSV_SEPARATOR;
+}
+
+// Append an interaction as shown in the customer table ("Type: ..., Date: ...")
+template <class Out>
+void appendInteractionLabels(Out& out, string_view type, string_view date) {
+    string_view values[INTERACTION_FIELD_COUNT] = {type, date};
+    for (size_t f = 0; f < INTERACTION_FIELD_COUNT; ++f) {
+        if (f > 0) {
+            out.append(", ");
+        }
+        out.append(INTERACTION_FIELDS[f].label);
+        out.append(values[f]);
+    }
+}
+
+// Append an interaction as a customers.csv history item
+void appendHistoryItem(string& out, string_view type, string_view date) {
+    string_view values[INTERACTION_FIELD_COUNT] = {type, date};
+    for (size_t f = 0; f < INTERACTION_FIELD_COUNT; ++f) {
+        if (f > 0) {
+            out += HISTORY_FIELD_SEPARATOR;
+        }
+        out += INTERACTION_FIELDS[f].csvKey;
+        out += values[f];
+    }
+}
+
+// Why an interaction type and date cannot be stored, or nullptr when they
+// can. A history item is split on the customers.csv separators and on the
+// item keys, a journal record on tabs and newlines; the date may be free text.
+const char* invalidInteractionReason(string_view type, string_view date) {
+    constexpr char delimiters[] = {CSV_SEPARATOR, HISTORY_FIELD_SEPARATOR, HISTORY_ITEM_SEPARATOR, '\t', '\r', '\n'};
+    auto storable = [&delimiters](string_view value) {
+        if (value.find_first_of(string_view(delimiters, size(delimiters))) != string_view::npos) {
+            return false;
+        }
+        for (const InteractionFieldSchema& field : INTERACTION_FIELDS) {
+            if (value.find(field.csvKey) != string_view::npos) {
+                return false;
             }
         }
-        return nullptr;
+        return true;
+    };
+    if (type.find_first_not_of(' ') == string_view::npos) {
+        return "blank interaction type";
+    }
+    if (date.find_first_not_of(' ') == string_view::npos) {
+        return "blank interaction date";
+    }
+    if (!storable(type)) {
+        return "interaction type contains a delimiter";
+    }
+    if (!storable(date)) {
+        return "interaction date contains a delimiter";
+    }
+    if (type == "No Interaction" && date == "N/A") {
+        return "interaction is the empty history placeholder";
+    }
+    return nullptr;
+}
+
+// FNV-1a hash, used to fingerprint the CSV file a journal applies to
+uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Run task(0) ... task(threads - 1) on separate threads and wait for all of them
+void runParallel(unsigned threads, const function<void(unsigned)>& task) {
+    vector<thread> workers;
+    for (unsigned t = 1; t < threads; ++t) {
+        workers.emplace_back(task, t);
+    }
+    task(0);
+    for (auto& worker : workers) {
+        worker.join();
     }
+}
+
+// Number of worker threads for a job of the given size, at least one per grain
+unsigned workerCount(size_t size, size_t grain) {
+    size_t hardware = max(1u, thread::hardware_concurrency());
+    return (unsigned)max<size_t>(1, min(hardware, size / grain));
+}
 
+// Read-only view of a whole file, memory-mapped where the platform allows it
+class MappedFile {
 public:
-    CRM() : nextCustomerId(1) {
-        loadFromFile();  // Load data from file on start
+    explicit MappedFile(const string& fileName) : mapped(nullptr), length(0) {
+#ifdef _WIN32
+        ifstream file(fileName, ios::binary);
+        buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        mapped = buffer.data();
+        length = buffer.size();
+#else
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                madvise(address, info.st_size, MADV_WILLNEED);
+                mapped = (const char*)address;
+                length = info.st_size;
+            }
+        }
+        close(fd);
+#endif
     }
 
-    // Function to load customers from a CSV file
-    void loadFromFile() {
-        ifstream file("customers.csv");
-        string line;
+    ~MappedFile() {
+#ifndef _WIN32
+        if (mapped) {
+            munmap((void*)mapped, length);
+        }
+#endif
+    }
 
-        // ignore the header
-        if (getline(file, line)) {
-            cout << "Header detected: " << line << endl;  // Debug: remove if not needed
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return mapped; }
+    size_t size() const { return length; }
+
+    // Drop the pages read so far from the process's memory; they are read
+    // from the file again when accessed
+    void release() {
+#ifndef _WIN32
+        if (mapped) {
+            madvise((void*)mapped, length, MADV_DONTNEED);
         }
+#endif
+    }
 
-        while (getline(file, line)) {
-            stringstream ss(line);
-            string firstName, lastName, email, phone, interactionsData;
-            int customerId;
+private:
+    const char* mapped;
+    size_t length;
+#ifdef _WIN32
+    string buffer;
+#endif
+};
+
+// Hash of a buffer, computed over 1 MB blocks whose hashes are then combined
+// so that large buffers are hashed in parallel
+uint64_t contentHash(const char* data, size_t size) {
+    const size_t blockSize = 1 << 20;
+    size_t blocks = (size + blockSize - 1) / blockSize;
+    vector<uint64_t> blockHashes(blocks);
+    unsigned threads = workerCount(blocks, 1);
+
+    runParallel(threads, [&](unsigned t) {
+        for (size_t b = blocks * t / threads; b < blocks * (t + 1) / threads; ++b) {
+            size_t begin = b * blockSize;
+            blockHashes[b] = fnv1a(data + begin, min(blockSize, size - begin));
+        }
+    });
+
+    return fnv1a((const char*)blockHashes.data(), blocks * sizeof(uint64_t));
+}
 
-            // read customer data
-            getline(ss, firstName, ',');
-            getline(ss, lastName, ',');
-            getline(ss, email, ',');
-            getline(ss, phone, ',');
-            ss >> customerId;
+// Fingerprint (size and hash) of a file's content
+string fingerprint(const char* data, size_t size) {
+    stringstream ss;
+    ss << size << "\t" << hex << contentHash(data, size);
+    return ss.str();
+}
+
+string fileFingerprint(const string& fileName) {
+    MappedFile file(fileName);
+    return fingerprint(file.data(), file.size());
+}
+
+// fsync a file's data
+void syncFile(const string& fileName) {
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+        Stats::add(Stats::FSYNCS, 1);
+    }
+#endif
+}
+
+// Move a file written aside over its destination so that both survive a
+// crash: the data is fsync'ed before the rename and the directory after it.
+// Returns false when the file could not be renamed.
+bool durableRename(const string& from, const string& to) {
+    syncFile(from);
+    if (rename(from.c_str(), to.c_str()) != 0) {
+        return false;
+    }
+#ifndef _WIN32
+    string directory = filesystem::path(to).parent_path().string();
+    int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+        Stats::add(Stats::FSYNCS, 1);
+    }
+#endif
+    return true;
+}
+
+// Group commit for the journal. append() only queues an entry, and waits
+// only while QUEUE_LIMIT entries are already queued; a writer thread writes
+// the queue with one write and one fsync once batchSize entries are queued,
+// flushInterval seconds after the oldest one, or when commit() asks for it.
+// CRM_COMMIT_BATCH and CRM_COMMIT_INTERVAL override the defaults.
+// A background compaction switches to a new file with carry() and rotate().
+class JournalWriter {
+public:
+    static constexpr size_t QUEUE_LIMIT = 1 << 16;
+
+    JournalWriter() : file(nullptr), running(false), writing(false), carrying(false), pendingEntries(0), queued(0),
+                      durable(0), wanted(0), batchSize(1000), flushInterval(0.1) {
+        if (const char* value = getenv("CRM_COMMIT_BATCH")) {
+            batchSize = max(1, atoi(value));
+        }
+        if (const char* value = getenv("CRM_COMMIT_INTERVAL")) {
+            flushInterval = max(0.0, atof(value));
+        }
+    }
+
+    ~JournalWriter() {
+        close();
+    }
+
+    bool open(const string& fileName) {
+        close();
+        file = fopen(fileName.c_str(), "ab");
+        if (!file) {
+            cout << "Error: could not open " << fileName << endl;
+            return false;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            running = true;
+        }
+        writer = thread(&JournalWriter::writeLoop, this);
+        return true;
+    }
+
+    bool isOpen() const {
+        return file != nullptr;
+    }
+
+    // Write what is queued (the writer drains the queue before it stops),
+    // stop the writer thread and close the file
+    void close() {
+        if (!file) {
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            running = false;
+        }
+        changed.notify_all();
+        writer.join();
+        fclose(file);
+        file = nullptr;
+    }
+
+    void append(const string& entry) {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this]() { return pendingEntries < QUEUE_LIMIT; });
+        if (pendingEntries == 0) {
+            oldest = chrono::steady_clock::now();
+        }
+        pending += entry;
+        if (carrying) {
+            carried += entry;
+        }
+        queued++;
+        if (++pendingEntries == batchSize) {
+            changed.notify_all();
+        }
+    }
+
+    // Wait until every entry queued so far is on disk. Safe to call from any
+    // thread, also while the journal is closed or being reopened.
+    void commit() {
+        unique_lock<mutex> guard(lock);
+        uint64_t target = queued;
+        wanted = max(wanted, target);
+        changed.notify_all();
+        changed.wait(guard, [this, target]() { return durable >= target; });
+    }
+
+    // Keep a copy of the entries appended from now on, for rotate()
+    void carry() {
+        lock_guard<mutex> guard(lock);
+        carrying = true;
+        carried.clear();
+    }
+
+    void stopCarrying() {
+        lock_guard<mutex> guard(lock);
+        carrying = false;
+        carried.clear();
+    }
+
+    // Switch to a new journal: header and the entries carried since carry()
+    // are written to fileName.tmp, publish() makes the book they apply to
+    // current (or returns false, which keeps this journal), and the file is
+    // renamed over fileName. The entries appended before carry() are in
+    // that book, so the ones still queued are dropped and count as durable.
+    // append() only waits for the entries carried while the bulk was written
+    // and for publish(), not for the bulk itself.
+    template <class Publish>
+    bool rotate(const string& fileName, const string& header, Publish publish) {
+        string tmpFile = fileName + ".tmp";
+        ofstream out(tmpFile, ios::binary | ios::trunc);
+        size_t copied;
+        {
+            string entries;
+            {
+                lock_guard<mutex> guard(lock);
+                entries = carried;
+            }
+            out << header << entries;
+            copied = entries.size();
+        }
+
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [this]() { return !writing; });
+        out.write(carried.data() + copied, carried.size() - copied);
+        out.close();
+        carrying = false;
+        carried.clear();
+        if (!out.good() || !publish()) {
+            remove(tmpFile.c_str());
+            return false;
+        }
+        if (!durableRename(tmpFile, fileName)) {
+            cout << "Error: could not rename " << tmpFile << " to " << fileName << endl;
+        }
+        if (FILE* reopened = fopen(fileName.c_str(), "ab")) {
+            fclose(file);
+            file = reopened;
+        } else {
+            cout << "Error: could not open " << fileName << endl;
+        }
+        pending.clear();
+        pendingEntries = 0;
+        durable = queued;
+        changed.notify_all();
+        return true;
+    }
+
+private:
+    void writeLoop() {
+        string batch;
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            if (pendingEntries == 0) {
+                if (!running) {
+                    return;
+                }
+                changed.wait(guard);
+                continue;
+            }
+            auto deadline = oldest + chrono::duration_cast<chrono::steady_clock::duration>(
+                                         chrono::duration<double>(flushInterval));
+            if (running && pendingEntries < batchSize && wanted <= durable && chrono::steady_clock::now() < deadline) {
+                changed.wait_until(guard, deadline);
+                continue;
+            }
+
+            // take the queue and write it without holding the lock
+            batch.swap(pending);
+            uint64_t batchEnd = queued;
+            pendingEntries = 0;
+            writing = true;
+            guard.unlock();
+            changed.notify_all();  // room in the queue
+            {
+                Stats::Timer timer(Stats::JOURNAL_COMMIT);
+                if (fwrite(batch.data(), 1, batch.size(), file) != batch.size() || fflush(file) != 0) {
+                    cout << "Error: could not write the journal" << endl;
+                }
+#ifndef _WIN32
+                fsync(fileno(file));
+                Stats::add(Stats::FSYNCS, 1);
+#endif
+            }
+            batch.clear();
+            guard.lock();
+            writing = false;
+            durable = batchEnd;
+            changed.notify_all();
+        }
+    }
+
+    FILE* file;
+    thread writer;
+    mutex lock;
+    condition_variable changed;  // queue filled or drained, commit requested, entries durable
+    bool running;
+    bool writing;    // the writer is writing a batch without the lock
+    bool carrying;
+    string carried;  // entries appended since carry()
+    string pending;  // queued entries, newline-terminated
+    size_t pendingEntries;
+    chrono::steady_clock::time_point oldest;  // when the first pending entry was queued
+    uint64_t queued;   // entries queued since open()
+    uint64_t durable;  // entries written and fsync'ed
+    uint64_t wanted;   // entries a commit() waits for
+    size_t batchSize;
+    double flushInterval;
+};
+
+// Customers and interactions produced by one loader thread. Interaction types
+// and dates that are not day numbers are interned per thread, as views into
+// the loaded file, and mapped to the CRM's IDs when the chunks are merged.
+// Free-form dates are stored as -(index + 1). With a historyBase, histories
+// are not parsed: the customers keep their offset from historyBase instead.
+struct LoadedChunk {
+    const char* historyBase;
+    vector<Customer> customers;        // interaction ranges index into interactions
+    StringPool names;                  // first and last names, interned
+    StringPool strings;                // emails and phones
+    vector<Interaction> interactions;
+    vector<string_view> types;
+    vector<string_view> dates;
+    unordered_map<string_view, uint32_t> typeIds;
+    unordered_map<string_view, int32_t> dateIds;
+
+    LoadedChunk() : historyBase(nullptr) {}
+
+    // Append an interaction to the last customer
+    void addInteraction(string_view type, string_view date) {
+        auto typeId = typeIds.try_emplace(type, (uint32_t)types.size());
+        if (typeId.second) {
+            types.push_back(type);
+        }
+
+        int32_t day;
+        if (!parseDayNumber(date, day)) {
+            auto dateId = dateIds.try_emplace(date, -(int32_t)dates.size() - 1);
+            if (dateId.second) {
+                dates.push_back(date);
+            }
+            day = dateId.first->second;
+        }
+
+        interactions.emplace_back(typeId.first->second, day);
+        customers.back().interactionCount++;
+        customers.back().interactionCapacity++;
+    }
+};
+
+// Placeholder written for an empty history
+const string_view NO_INTERACTION = "Type:No Interaction,Date:N/A";
+
+// Call visit(type, date) for each interaction of a "Type:...,Date:...|..."
+// history. Items without both keys and the placeholder are skipped.
+template <class Visit>
+size_t parseHistory(string_view history, Visit visit) {
+    constexpr string_view typeKey = INTERACTION_FIELDS[0].csvKey;
+    constexpr string_view dateKey = INTERACTION_FIELDS[1].csvKey;
+    size_t count = 0;
+    while (!history.empty()) {
+        size_t bar = history.find(HISTORY_ITEM_SEPARATOR);
+        string_view interactionItem = history.substr(0, bar);
+        history = bar == string_view::npos ? string_view() : history.substr(bar + 1);
+
+        size_t typePos = interactionItem.find(typeKey);
+        size_t datePos = interactionItem.find(dateKey);
+        if (typePos != string_view::npos && datePos != string_view::npos) {
+            string_view type = interactionItem.substr(typePos + typeKey.size(), datePos - typePos - typeKey.size() - 1);
+            string_view date = interactionItem.substr(datePos + dateKey.size());
+            if (type != "No Interaction" || date != "N/A") {
+                visit(type, date);
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+// True when formatting the parsed history gives the same text back, so that
+// it can be copied to a new customers.csv without being parsed
+bool isCanonicalHistory(string_view history) {
+    if (history.empty() || (history != NO_INTERACTION && history.find(NO_INTERACTION) != string_view::npos)) {
+        return false;
+    }
+    constexpr string_view typeKey = INTERACTION_FIELDS[0].csvKey;
+    constexpr string_view dateKey = INTERACTION_FIELDS[1].csvKey;
+    while (true) {
+        size_t bar = history.find(HISTORY_ITEM_SEPARATOR);
+        string_view interactionItem = history.substr(0, bar);
+        size_t datePos = interactionItem.find(dateKey);
+        if (interactionItem.compare(0, typeKey.size(), typeKey) != 0 || datePos == string_view::npos ||
+            datePos <= typeKey.size() || interactionItem[datePos - 1] != HISTORY_FIELD_SEPARATOR) {
+            return false;
+        }
+        if (bar == string_view::npos) {
+            return true;
+        }
+        history.remove_prefix(bar + 1);
+    }
+}
+
+// Parse one customers.csv row (without its line terminator), with the same
+// rules as the original stringstream reader: the comma-terminated columns of
+// CUSTOMER_FIELDS, the customer ID, then the "Type:...,Date:...|..." interactions. The
+// "Type:No Interaction,Date:N/A" placeholder stands for an empty history.
+// Returns false when the row has no readable customer ID.
+bool parseCustomerRow(string_view line, LoadedChunk& out) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);  // file edited on Windows
+    }
+
+    string_view fields[CUSTOMER_FIELD_COUNT];
+    size_t pos = 0;
+    for (auto& field : fields) {
+        size_t comma = line.find(CSV_SEPARATOR, pos);
+        if (comma == string_view::npos) {
+            return false;  // the ID would be missing
+        }
+        field = line.substr(pos, comma - pos);
+        pos = comma + 1;
+    }
+
+    // customer ID: optional blanks and sign, then digits
+    while (pos < line.size() && isspace((unsigned char)line[pos])) {
+        pos++;
+    }
+    bool negative = false;
+    if (pos < line.size() && (line[pos] == '-' || line[pos] == '+')) {
+        negative = line[pos++] == '-';
+    }
+    size_t digitsStart = pos;
+    long long customerId = 0;
+    while (pos < line.size() && isdigit((unsigned char)line[pos]) && customerId <= numeric_limits<int>::max()) {
+        customerId = customerId * 10 + (line[pos++] - '0');
+    }
+    if (pos == digitsStart || customerId > numeric_limits<int>::max()) {
+        return false;
+    }
+
+    Customer& customer = out.customers.emplace_back(string_view(), string_view(), string_view(), string_view(),
+                                                    (int)(negative ? -customerId : customerId));
+    forEachField([&](auto f) {
+        constexpr const FieldSchema& field = CUSTOMER_FIELDS[f];
+        if constexpr (field.interned) {
+            customer.*field.member = out.names.intern(fields[f]);
+        } else {
+            customer.*field.member = out.strings.store(fields[f]);
+        }
+    });
+    customer.firstInteraction = out.interactions.size();
+
+    // the rest of the line holds the interactions, after leading spaces and commas
+    string_view interactionsData = line.substr(pos);
+    size_t dataStart = interactionsData.find_first_not_of(", ");
+    interactionsData = dataStart == string_view::npos ? string_view() : interactionsData.substr(dataStart);
+
+    if (out.historyBase) {
+        if (!interactionsData.empty() && interactionsData != NO_INTERACTION) {
+            customer.historyOffset = interactionsData.data() - out.historyBase;
+            customer.historyLength = interactionsData.size();
+            customer.historyLoaded = false;
+        }
+        return true;
+    }
+    parseHistory(interactionsData, [&out](string_view type, string_view date) { out.addInteraction(type, date); });
+    return true;
+}
+
+// Parse the customers.csv rows from begin up to end, which holds whole lines
+void parseCustomerRows(const char* begin, const char* end, LoadedChunk& out) {
+    const char* line = begin;
+    while (line < end) {
+        const char* lineEnd = find(line, end, '\n');
+        parseCustomerRow(string_view(line, lineEnd - line), out);
+        line = lineEnd == end ? end : lineEnd + 1;
+    }
+}
+
+// Binary snapshot of the CRM state (customers.snap), loaded with a single
+// mmap and no parsing. Layout: header, fixed-width customer records, the
+// packed interaction table (Interaction records as held in memory), the
+// interaction type and free-form date tables, then the string heap.
+// The snapshot is only used while customers.csv still has the size and
+// modification time recorded in the header; otherwise the CSV is loaded.
+// The number of customer columns is part of the version, since it sets the
+// size of the customer records.
+const uint32_t SNAPSHOT_VERSION = 3 << 16 | CUSTOMER_FIELD_COUNT;
+
+struct SnapshotString {
+    uint64_t offset;  // into the string heap
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct SnapshotHeader {
+    char magic[8];              // "ICRMSNAP"
+    uint32_t version;
+    int32_t nextCustomerId;
+    uint64_t customerCount;
+    uint64_t interactionCount;
+    uint64_t typeCount;
+    uint64_t dateCount;
+    uint64_t heapSize;
+    uint64_t csvSize;           // customers.csv the snapshot was written with
+    int64_t csvModified;
+    char csvFingerprint[40];    // base for the journal
+    uint64_t checksum;          // over everything after the header
+};
+
+struct SnapshotCustomer {
+    int32_t customerId;
+    uint32_t interactionCount;
+    uint64_t firstInteraction;  // index into the interaction table
+    SnapshotString fields[CUSTOMER_FIELD_COUNT];  // the columns of CUSTOMER_FIELDS
+};
+
+// Size and modification time of a file, false if it does not exist
+bool fileStamp(const string& fileName, uint64_t& size, int64_t& modified) {
+    error_code error;
+    size = filesystem::file_size(fileName, error);
+    if (error) {
+        return false;
+    }
+    modified = filesystem::last_write_time(fileName, error).time_since_epoch().count();
+    return !error;
+}
+
+// Check the validators against the original regexes on edge cases and random
+// inputs, then compare their throughput. Returns the number of mismatches.
+int benchmarkValidators() {
+    struct Case {
+        Validator::Field field;
+        const char* name;
+        const char* pattern;
+        vector<vector<string>> parts;  // random inputs concatenate 0-4 tokens from each part
+        vector<string> samples;  // hand-picked edge cases
+    };
+    vector<Case> cases = {
+        {Validator::FIRST_NAME, "name", "^[a-zA-Z]+([',.\\-_][a-zA-Z]+)*$",
+         {{"Mario", "a", "Z", "'", ",", ".", "-", "_", " ", "1", "\\", "\xc3\xa8"},
+          {"Rossi", "b", "'", "-", "."}},
+         {"", "M", "Mario", "D'Angelo", "Jean-Luc", "a.b.c", "a..b", "-a", "a-", "'", "a_b_c", "a b",
+          "O'Neil-Smith", "Ren\xc3\xa9", "a,b", "a\\-b", "Mario1"}},
+        {Validator::EMAIL, "email",
+         "[a-zA-Z0-9_+&*-]+(?:\\.[a-zA-Z0-9_+&*-]+)*@(?:[a-zA-Z0-9-]+\\.)+[a-zA-Z]{2,7}",
+         {{"m", "rossi", "9", "_", "+", "&", "*", "-", ".", "..", "'", " "},
+          {"@", "@", "@", "", "@@"},
+          {"gmail.", "tim.", "x-1.", "9.", "b", ".", "..", "-", "@"},
+          {"com", "it", "abcdefgh", "c", "x1", "."}},
+         {"", "@", "a@b.it", "m.rossi@gmail.com", "neri@tim.it", "a@b.c", "a@b.abcdefg", "a@b.abcdefgh",
+          ".a@b.it", "a.@b.it", "a..b@c.it", "a@.b.it", "a@b..it", "a@b.it.", "a@b", "a@b.i1", "a@@b.it",
+          "a@b-c.d-e.com", "a+b&c*d-e_f@x.co", "a@b.c.de", "a@1.23"}},
+        {Validator::PHONE, "phone", "^\\+?[0-9]{10,15}$",
+         {{"+", "", "", "-"},
+          {"0", "1", "34048", "12345", "-", " ", "a"}},
+         {"", "+", "123456789", "1234567890", "+1234567890", "123456789012345", "1234567890123456",
+          "+123456789012345", "++1234567890", "12345 67890", "3404812855"}},
+    };
+
+    const int randomInputs = 200000;
+    int mismatches = 0;
+    uint64_t seed = 12345;
+    auto nextRandom = [&seed]() {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (uint32_t)(seed >> 33);
+    };
+
+    cout << setw(8) << "Field" << setw(12) << "Inputs" << setw(10) << "Valid" << setw(12) << "Mismatches"
+        << setw(18) << "regex/call (ns)" << setw(18) << "regex once (ns)" << setw(18) << "validator (ns)" << endl;
+
+    for (auto& testCase : cases) {
+        // edge cases first, then random concatenations of tokens
+        vector<string> column = testCase.samples;
+        while ((int)column.size() < randomInputs) {
+            string value;
+            for (auto& tokens : testCase.parts) {
+                int pieces = nextRandom() % 5;
+                for (int p = 0; p < pieces; ++p) {
+                    value += tokens[nextRandom() % tokens.size()];
+                }
+            }
+            column.push_back(value);
+        }
+
+        regex pattern(testCase.pattern);
+        vector<string_view> columnViews(column.begin(), column.end());
+        vector<uint8_t> valid;
+        Validator::validateColumn(testCase.field, columnViews, valid);
+
+        int caseMismatches = 0;
+        size_t validCount = 0;
+        for (size_t i = 0; i < column.size(); ++i) {
+            validCount += valid[i];
+            if ((bool)valid[i] != regex_match(column[i], pattern)) {
+                if (caseMismatches++ < 5) {
+                    cout << "  mismatch on " << testCase.name << " \"" << column[i] << "\"" << endl;
+                }
+            }
+        }
+        mismatches += caseMismatches;
+
+        // throughput: the original code built the regex on every call
+        size_t sink = 0;
+        const int perCallInputs = 20000;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < perCallInputs; ++i) {
+            sink += regex_match(column[i], regex(testCase.pattern));
+        }
+        double regexPerCall = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / perCallInputs;
+
+        start = chrono::steady_clock::now();
+        for (auto& value : column) {
+            sink += regex_match(value, pattern);
+        }
+        double regexOnce = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / column.size();
+
+        start = chrono::steady_clock::now();
+        sink += Validator::validateColumn(testCase.field, columnViews, valid);
+        double validator = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / column.size();
+
+        cout << fixed << setprecision(1) << setw(8) << testCase.name << setw(12) << column.size()
+            << setw(10) << validCount << setw(12) << caseMismatches << setw(18) << regexPerCall << setw(18) << regexOnce
+            << setw(18) << validator << endl;
+        if (sink == 0) {
+            cout << "(no valid inputs)" << endl;
+        }
+    }
+
+    cout << (mismatches == 0 ? "Validators match the regexes." : "Validators DIFFER from the regexes!") << endl;
+    return mismatches;
+}
+
+// Search index over first names, last names and e-mails, for the agents'
+// partial or misspelled queries. Terms are lowercased and kept in an ordered
+// map for prefix queries; name terms are also indexed by trigram, and the
+// trigram candidates are checked with a bounded edit distance for typos.
+// The customer IDs of a term are kept sorted, so a customer is found by binary
+// search when it is modified or deleted, even under a very common surname.
+class SearchIndex {
+public:
+    // Ranks of a match, best first
+    enum Rank { EXACT = 0, PREFIX = 1, FUZZY = 2 };
+
+    void add(int customerId, string_view firstName, string_view lastName, string_view email) {
+        for (string_view field : {firstName, lastName, email}) {
+            string term = lowercase(field);
+            auto entry = terms.try_emplace(term);
+            vector<int>& postings = entry.first->second;
+            if (postings.empty() || postings.back() < customerId) {
+                postings.push_back(customerId);  // new customers have the highest IDs
+            } else {
+                auto it = lower_bound(postings.begin(), postings.end(), customerId);
+                if (it == postings.end() || *it != customerId) {  // first and last name may be the same term
+                    postings.insert(it, customerId);
+                }
+            }
+            if (entry.second && term.find('@') == string::npos) {
+                for (uint32_t trigram : trigramsOf(term)) {
+                    trigrams[trigram].push_back(&entry.first->first);
+                }
+            }
+        }
+    }
+
+    void remove(int customerId, string_view firstName, string_view lastName, string_view email) {
+        for (string_view field : {firstName, lastName, email}) {
+            auto entry = terms.find(lowercase(field));
+            if (entry == terms.end()) {
+                continue;
+            }
+            vector<int>& postings = entry->second;
+            auto it = lower_bound(postings.begin(), postings.end(), customerId);
+            if (it != postings.end() && *it == customerId) {
+                postings.erase(it);
+            }
+            if (postings.empty()) {
+                if (entry->first.find('@') == string::npos) {
+                    for (uint32_t trigram : trigramsOf(entry->first)) {
+                        vector<const string*>& candidates = trigrams[trigram];
+                        candidates.erase(std::remove(candidates.begin(), candidates.end(), &entry->first), candidates.end());
+                    }
+                }
+                terms.erase(entry);
+            }
+        }
+    }
+
+    void clear() {
+        terms.clear();
+        trigrams.clear();
+    }
+
+    // Up to limit customer IDs matching the query, best first: exact matches,
+    // then prefix matches (shortest completions first), then names within
+    // one edit (two for queries longer than 4 characters)
+    vector<int> search(const string& query, size_t limit) const {
+        string q = lowercase(query);
+        vector<pair<int, const vector<int>*>> matches;  // (rank, postings)
+        size_t found = 0;
+
+        // exact and prefix matches: the exact term, if any, comes first
+        for (auto it = terms.lower_bound(q); it != terms.end() && found < limit; ++it) {
+            if (it->first.compare(0, q.size(), q) != 0) {
+                break;
+            }
+            int rank = it->first.size() == q.size() ? EXACT * 1000 : PREFIX * 1000 + (int)(it->first.size() - q.size());
+            matches.emplace_back(rank, &it->second);
+            found += it->second.size();
+        }
+
+        // typos: names sharing a trigram with the query, within the edit distance
+        if (found < limit && !q.empty()) {
+            size_t maxDistance = q.size() > 4 ? 2 : 1;
+            unordered_map<const string*, int> candidates;
+            for (uint32_t trigram : trigramsOf(q)) {
+                auto it = trigrams.find(trigram);
+                if (it != trigrams.end()) {
+                    for (const string* term : it->second) {
+                        candidates[term]++;
+                    }
+                }
+            }
+            for (auto& candidate : candidates) {
+                const string& term = *candidate.first;
+                if (term.compare(0, q.size(), q) == 0) {
+                    continue;  // already a prefix match
+                }
+                size_t distance = editDistance(q, term, maxDistance);
+                if (distance <= maxDistance) {
+                    matches.emplace_back(FUZZY * 1000 + (int)distance, &terms.find(term)->second);
+                }
+            }
+        }
+
+        stable_sort(matches.begin(), matches.end(),
+                    [](const pair<int, const vector<int>*>& a, const pair<int, const vector<int>*>& b) {
+                        return a.first < b.first;
+                    });
+
+        vector<int> result;
+        unordered_map<int, bool> seen;
+        for (auto& match : matches) {
+            for (int customerId : *match.second) {
+                if (result.size() == limit) {
+                    return result;
+                }
+                if (seen.emplace(customerId, true).second) {
+                    result.push_back(customerId);
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    map<string, vector<int>> terms;                          // term -> customer IDs, ascending
+    unordered_map<uint32_t, vector<const string*>> trigrams;  // trigram -> name terms
+
+    static string lowercase(string_view text) {
+        string result(text);
+        for (char& c : result) {
+            c = (char)tolower((unsigned char)c);
+        }
+        return result;
+    }
+
+    // Trigrams of a term padded with '$' at both ends, packed in 24 bits
+    static vector<uint32_t> trigramsOf(const string& term) {
+        string padded = "$" + term + "$";
+        vector<uint32_t> result;
+        for (size_t i = 0; i + 3 <= padded.size(); ++i) {
+            result.push_back((unsigned char)padded[i] << 16 | (unsigned char)padded[i + 1] << 8 | (unsigned char)padded[i + 2]);
+        }
+        sort(result.begin(), result.end());
+        result.erase(unique(result.begin(), result.end()), result.end());
+        return result;
+    }
+
+public:
+    // Levenshtein distance, or maxDistance + 1 as soon as it is known to be larger.
+    // Only the cells within maxDistance of the diagonal can stay within it, so
+    // each row is computed over that band.
+    static size_t editDistance(string_view a, string_view b, size_t maxDistance) {
+        if (max(a.size(), b.size()) - min(a.size(), b.size()) > maxDistance) {
+            return maxDistance + 1;
+        }
+        if (a == b) {
+            return 0;
+        }
+        // two rows of the table, on the stack for the usual short words
+        const size_t outside = maxDistance + 1;
+        size_t rows[2][64];
+        vector<size_t> heapRows;
+        size_t* previous = rows[0];
+        size_t* current = rows[1];
+        if (b.size() >= 64) {
+            heapRows.resize(2 * (b.size() + 1));
+            previous = heapRows.data();
+            current = previous + b.size() + 1;
+        }
+        for (size_t j = 0; j <= min(b.size(), maxDistance); ++j) {
+            previous[j] = j;
+        }
+        if (maxDistance < b.size()) {
+            previous[maxDistance + 1] = outside;
+        }
+        for (size_t i = 1; i <= a.size(); ++i) {
+            size_t low = i > maxDistance ? i - maxDistance : 1;
+            size_t high = min(b.size(), i + maxDistance);
+            current[low - 1] = low == 1 ? min(i, outside) : outside;
+            size_t rowMinimum = current[low - 1];
+            for (size_t j = low; j <= high; ++j) {
+                current[j] = min({previous[j] + 1, current[j - 1] + 1, previous[j - 1] + (a[i - 1] != b[j - 1])});
+                rowMinimum = min(rowMinimum, current[j]);
+            }
+            if (high < b.size()) {
+                current[high + 1] = outside;
+            }
+            if (rowMinimum > maxDistance) {
+                return outside;
+            }
+            swap(previous, current);
+        }
+        return min(previous[b.size()], outside);
+    }
+};
+
+// Time index over the interactions with a dd/mm/yyyy date: the interactions
+// by day, and the customers by the day of their latest dated interaction
+// (their last touch; NEVER when they have none). A range or last-touch query
+// costs one map lookup plus the entries it returns. Free-form dates are not
+// indexed.
+class TimeIndex {
+public:
+    static const int32_t NEVER = -1;
+
+    struct Entry {
+        int customerId;
+        uint32_t type;
+    };
+
+    // A customer and its interactions
+    void addCustomer(int customerId, const vector<Interaction>& history) {
+        int32_t lastTouch = NEVER;
+        for (const Interaction& interaction : history) {
+            if (interaction.date >= 0) {  // not a free-form date
+                days[interaction.date].push_back({customerId, interaction.type});
+                lastTouch = max(lastTouch, interaction.date);
+            }
+        }
+        if (lastTouchOf.emplace(customerId, lastTouch).second) {
+            lastTouches[lastTouch].push_back(customerId);
+        }
+    }
+
+    // An interaction recorded for a customer already added
+    void add(int customerId, const Interaction& interaction) {
+        if (interaction.date < 0) {
+            return;
+        }
+        days[interaction.date].push_back({customerId, interaction.type});
+        auto lastTouch = lastTouchOf.find(customerId);
+        if (lastTouch != lastTouchOf.end() && interaction.date > lastTouch->second) {
+            unlink(lastTouches, lastTouch->second, customerId);
+            lastTouches[interaction.date].push_back(customerId);
+            lastTouch->second = interaction.date;
+        }
+    }
+
+    // Drop a customer and its interactions
+    void removeCustomer(int customerId, const vector<Interaction>& history) {
+        auto lastTouch = lastTouchOf.find(customerId);
+        if (lastTouch == lastTouchOf.end()) {
+            return;
+        }
+        for (const Interaction& interaction : history) {
+            if (interaction.date < 0) {
+                continue;
+            }
+            auto day = days.find(interaction.date);
+            if (day == days.end()) {
+                continue;
+            }
+            vector<Entry>& entries = day->second;
+            auto it = find_if(entries.begin(), entries.end(), [&](const Entry& entry) {
+                return entry.customerId == customerId && entry.type == interaction.type;
+            });
+            if (it != entries.end()) {
+                entries.erase(it);  // keeps the rest of the day in the order recorded
+            }
+            if (entries.empty()) {
+                days.erase(day);
+            }
+        }
+        unlink(lastTouches, lastTouch->second, customerId);
+        lastTouchOf.erase(lastTouch);
+    }
+
+    void clear() {
+        days.clear();
+        lastTouches.clear();
+        lastTouchOf.clear();
+    }
+
+    void reserve(size_t customers) {
+        lastTouchOf.reserve(customers);
+    }
+
+    // Call visit(day, entry) for each interaction dated from "from" to "to"
+    // (inclusive), by date and in the order recorded within a day
+    template <class Visit>
+    void forEachBetween(int32_t from, int32_t to, Visit visit) const {
+        for (auto day = days.lower_bound(from); day != days.end() && day->first <= to; ++day) {
+            for (const Entry& entry : day->second) {
+                visit(day->first, entry);
+            }
+        }
+    }
+
+    // Call visit(customerId, lastTouch) for each customer whose last touch is
+    // before the given day, least recently touched first
+    template <class Visit>
+    void forEachTouchedBefore(int32_t day, Visit visit) const {
+        for (auto touch = lastTouches.begin(); touch != lastTouches.end() && touch->first < day; ++touch) {
+            for (int customerId : touch->second) {
+                visit(customerId, touch->first);
+            }
+        }
+    }
+
+private:
+    map<int32_t, vector<Entry>> days;        // day -> interactions
+    map<int32_t, vector<int>> lastTouches;   // last touch -> customer IDs
+    unordered_map<int, int32_t> lastTouchOf;  // customer ID -> last touch
+
+    static void unlink(map<int32_t, vector<int>>& index, int32_t key, int customerId) {
+        auto entry = index.find(key);
+        if (entry == index.end()) {
+            return;
+        }
+        // customers added lately, the usual ones to move, are at the back
+        vector<int>& ids = entry->second;
+        auto it = std::find(ids.rbegin(), ids.rend(), customerId);
+        if (it != ids.rend()) {
+            ids.erase(next(it).base());
+        }
+        if (ids.empty()) {
+            index.erase(entry);
+        }
+    }
+};
+
+// Unique index on a normalized contact (e-mail or phone). The table holds the
+// 64-bit hash of each normalized value, the number of customers carrying it
+// and the ID of one of them (the holder), with open addressing, so a lookup or
+// an update costs one probe sequence and no allocation. A hit only means the
+// hashes match: the caller confirms it against the holder's contact (see
+// CRM::contactTaken). Counts above 1 come from books written before the index
+// existed; the dedupe job reports them.
+class ContactIndex {
+public:
+    ContactIndex() : used(0), live(0) {}
+
+    // E-mails compare lowercased and without a +tag in the local part;
+    // emit(c) is called for each character of the normalized form
+    template <typename Emit>
+    static void normalizeEmail(string_view email, Emit emit) {
+        size_t at = email.rfind('@');
+        bool tagged = false;
+        for (size_t i = 0; i < email.size(); ++i) {
+            char c = email[i] >= 'A' && email[i] <= 'Z' ? (char)(email[i] + ('a' - 'A')) : email[i];
+            if (at != string_view::npos && i < at) {
+                tagged = tagged || c == '+';
+                if (tagged) {
+                    continue;
+                }
+            }
+            emit(c);
+        }
+    }
+
+    // Phones compare as bare digits, without the Italian country code when it
+    // is written +39 or 0039. The rule is for Italian books only: no other
+    // country code is recognized, so +44 20... and 0044 20... stay different.
+    template <typename Emit>
+    static void normalizePhone(string_view phone, Emit emit) {
+        size_t skip = 0;  // digits of the country code
+        if (phone.substr(0, 3) == "+39") {
+            skip = 2;
+        } else if (phone.substr(0, 4) == "0039") {
+            skip = 4;
+        }
+        for (char c : phone) {
+            if (c < '0' || c > '9') {
+                continue;
+            }
+            if (skip > 0) {
+                skip--;
+            } else {
+                emit(c);
+            }
+        }
+    }
+
+    static void appendNormalizedEmail(string& out, string_view email) {
+        normalizeEmail(email, [&out](char c) { out += c; });
+    }
+
+    static void appendNormalizedPhone(string& out, string_view phone) {
+        normalizePhone(phone, [&out](char c) { out += c; });
+    }
+
+    // Keys (hashes) of the normalized values; 0 for an empty value, which is
+    // not indexed
+    static uint64_t emailKey(string_view email) {
+        uint64_t hash = FNV_OFFSET;
+        size_t length = 0;
+        normalizeEmail(email, [&](char c) {
+            hash = fnv1a(&c, 1, hash);
+            length++;
+        });
+        return length == 0 ? 0 : hash ? hash : 1;
+    }
+
+    static uint64_t phoneKey(string_view phone) {
+        uint64_t hash = FNV_OFFSET;
+        size_t length = 0;
+        normalizePhone(phone, [&](char c) {
+            hash = fnv1a(&c, 1, hash);
+            length++;
+        });
+        return length == 0 ? 0 : hash ? hash : 1;
+    }
+
+    // Number of customers carrying the key
+    uint32_t count(uint64_t key) const {
+        if (key == 0 || table.empty()) {
+            return 0;
+        }
+        return table[find(key)].count;
+    }
+
+    // A carrier of the key, 0 if there is none or it is not known (it was
+    // removed while others still carry the key)
+    int holder(uint64_t key) const {
+        if (key == 0 || table.empty()) {
+            return 0;
+        }
+        return table[find(key)].holder;
+    }
+
+    void add(uint64_t key, int holder) {
+        if (key == 0) {
+            return;
+        }
+        if ((used + 1) * 4 > table.size() * 3) {
+            rehash(max<size_t>(16, (live + 1) * 2));
+        }
+        Entry& entry = table[find(key)];
+        if (entry.key == 0) {
+            entry.key = key;
+            used++;
+        }
+        if (entry.count == 0 || entry.holder == 0) {
+            entry.holder = holder;
+        }
+        live += entry.count++ == 0;
+    }
+
+    // Add many keys (keys[i] carried by holders[i]), prefetching the entries of
+    // the keys a few steps ahead: a bulk load would otherwise wait on a cache
+    // miss for every key
+    void addAll(const vector<uint64_t>& keys, const vector<int>& holders) {
+        reserve(live + keys.size());
+        const size_t AHEAD = 16;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (i + AHEAD < keys.size() && !table.empty()) {
+                __builtin_prefetch(&table[slotOf(keys[i + AHEAD])]);
+            }
+            add(keys[i], holders[i]);
+        }
+    }
+
+    // Keys whose count drops to 0 keep their entry until the next rehash
+    void remove(uint64_t key, int holder) {
+        if (key == 0 || table.empty()) {
+            return;
+        }
+        Entry& entry = table[find(key)];
+        if (entry.count > 0) {
+            live -= --entry.count == 0;
+        }
+        if (entry.holder == holder) {
+            entry.holder = 0;
+        }
+    }
+
+    void reserve(size_t keys) {
+        if (keys * 4 > table.size() * 3) {
+            rehash(keys + keys / 3 + 1);
+        }
+    }
+
+    void clear() {
+        table.clear();
+        used = 0;
+        live = 0;
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        uint32_t count;
+        int holder;
+    };
+    vector<Entry> table;  // power-of-two size, key 0 = empty
+    size_t used;          // entries with a key
+    size_t live;          // entries with a count
+
+    static constexpr uint64_t FNV_OFFSET = 14695981039346656037ULL;
+
+    // First entry to probe for a key
+    size_t slotOf(uint64_t key) const {
+        return (key ^ (key >> 29)) & (table.size() - 1);
+    }
+
+    // Entry holding the key, or the empty entry where it belongs
+    size_t find(uint64_t key) const {
+        size_t mask = table.size() - 1;
+        size_t i = slotOf(key);
+        while (table[i].key != 0 && table[i].key != key) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    // Move the counted keys to a table of at least minimumSize entries
+    void rehash(size_t minimumSize) {
+        size_t size = 16;
+        while (size < minimumSize) {
+            size *= 2;
+        }
+        vector<Entry> old(size, Entry{0, 0, 0});
+        old.swap(table);
+        used = 0;
+        for (const Entry& entry : old) {
+            if (entry.count > 0) {
+                table[find(entry.key)] = entry;
+                used++;
+            }
+        }
+    }
+};
+
+// Table output for the customer listings. Rows are built in a reusable buffer
+// (cells right-aligned like setw) and written to the stream in large blocks,
+// so a listing costs one write and one flush per page instead of one per line.
+class TableRenderer {
+public:
+    explicit TableRenderer(ostream& out, size_t flushThreshold = 64 << 10)
+        : out(out), flushThreshold(flushThreshold) {
+        buffer.reserve(flushThreshold + 1024);
+    }
+
+    ~TableRenderer() {
+        flush();
+    }
+
+    // Start a cell: everything appended until alignRight(start, width) is one cell
+    size_t mark() const {
+        return buffer.size();
+    }
+
+    void append(string_view text) {
+        buffer.append(text.data(), text.size());
+    }
+
+    void append(long long value) {
+        char text[24];
+        auto end = to_chars(text, text + sizeof(text), value).ptr;
+        buffer.append(text, end - text);
+    }
+
+    // Pad the cell started at start on the left up to width (longer cells are kept whole)
+    void alignRight(size_t start, size_t width) {
+        size_t length = buffer.size() - start;
+        if (length < width) {
+            buffer.insert(start, width - length, ' ');
+        }
+    }
+
+    void cell(string_view text, size_t width) {
+        size_t start = mark();
+        append(text);
+        alignRight(start, width);
+    }
+
+    void cell(long long value, size_t width) {
+        size_t start = mark();
+        append(value);
+        alignRight(start, width);
+    }
+
+    // End a row; the buffer is written out once it passes the threshold
+    void endRow() {
+        buffer += '\n';
+        if (buffer.size() >= flushThreshold) {
+            write();
+        }
+    }
+
+    // Write out the buffered rows and flush the stream (end of a page)
+    void flush() {
+        write();
+        out.flush();
+    }
+
+private:
+    ostream& out;
+    size_t flushThreshold;
+    string buffer;
+
+    void write() {
+        out.write(buffer.data(), buffer.size());
+        buffer.clear();  // keeps the capacity for the next rows
+    }
+};
+
+// Streaming JSON output: tokens and escaped strings are appended to one
+// reusable buffer, which is written out once it passes the threshold, so
+// memory does not depend on how much is written
+class JsonWriter {
+public:
+    explicit JsonWriter(ostream& out, size_t flushThreshold = 1 << 20)
+        : out(out), flushThreshold(flushThreshold), written(0) {
+        buffer.reserve(flushThreshold + 4096);
+    }
+
+    ~JsonWriter() {
+        flush();
+    }
+
+    // Structure: braces, brackets, commas, colons and newlines
+    void raw(string_view text) {
+        buffer.append(text.data(), text.size());
+    }
+
+    void quoted(string_view value) {
+        static const char hex[] = "0123456789abcdef";
+        buffer += '"';
+        size_t plain = 0;  // start of the run of characters that need no escape
+        for (size_t i = 0; i < value.size(); ++i) {
+            unsigned char c = value[i];
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                continue;
+            }
+            buffer.append(value.data() + plain, i - plain);
+            plain = i + 1;
+            buffer += '\\';
+            switch (c) {
+                case '"': buffer += '"'; break;
+                case '\\': buffer += '\\'; break;
+                case '\n': buffer += 'n'; break;
+                case '\r': buffer += 'r'; break;
+                case '\t': buffer += 't'; break;
+                default:
+                    buffer += "u00";
+                    buffer += hex[c >> 4];
+                    buffer += hex[c & 15];
+            }
+        }
+        buffer.append(value.data() + plain, value.size() - plain);
+        buffer += '"';
+    }
+
+    void number(long long value) {
+        char text[24];
+        auto end = to_chars(text, text + sizeof(text), value).ptr;
+        buffer.append(text, end - text);
+    }
+
+    // End a record; the buffer is written out once it passes the threshold
+    void endRecord() {
+        if (buffer.size() >= flushThreshold) {
+            write();
+        }
+    }
+
+    void flush() {
+        write();
+        out.flush();
+    }
+
+    // Bytes written so far, buffered ones included
+    uint64_t size() const {
+        return written + buffer.size();
+    }
+
+private:
+    ostream& out;
+    size_t flushThreshold;
+    string buffer;
+    uint64_t written;
+
+    void write() {
+        out.write(buffer.data(), buffer.size());
+        written += buffer.size();
+        buffer.clear();  // keeps the capacity
+    }
+};
+
+// Pull parser for JSON, and for NDJSON (any number of top-level values;
+// lineDelimited makes a line end inside a value an error). next() returns
+// one token at a time and nothing like a document tree is built: the input
+// is read through a fixed buffer and a string or number is unescaped into a
+// reusable one, so memory does not depend on the input size.
+class JsonReader {
+public:
+    enum Token { BEGIN_OBJECT, END_OBJECT, BEGIN_ARRAY, END_ARRAY, KEY, STRING, NUMBER, LITERAL, END, ERROR };
+
+    // Longest string or number accepted, and deepest nesting
+    static constexpr size_t MAX_TEXT = 1 << 20;
+    static constexpr size_t MAX_DEPTH = 64;
+
+    explicit JsonReader(istream& in, bool lineDelimited = false, size_t bufferSize = 1 << 16)
+        : in(in), lineDelimited(lineDelimited), buffer(bufferSize), position(0), available(0), consumed(0),
+          lineNumber(1), state(EXPECT_VALUE) {}
+
+    Token next() {
+        if (state == FAILED) {
+            return ERROR;
+        }
+        while (true) {
+            skipWhitespace();
+            int c = peek();
+            if (c == '\n') {
+                return fail("value not closed at the end of the line");  // lineDelimited only
+            }
+            if (state == AFTER_VALUE) {
+                if (containers.empty()) {
+                    state = EXPECT_VALUE;  // next top-level value
+                    continue;
+                }
+                char open = containers.back();
+                if (c == ',') {
+                    get();
+                    state = open == '{' ? EXPECT_KEY : EXPECT_VALUE;
+                    continue;
+                }
+                if ((c == '}' && open == '{') || (c == ']' && open == '[')) {
+                    get();
+                    containers.pop_back();
+                    return c == '}' ? END_OBJECT : END_ARRAY;
+                }
+                return fail(c == EOF ? "unexpected end of input" : "expected ',' or the end of the container");
+            }
+            if (c == EOF) {
+                return containers.empty() ? END : fail("unexpected end of input");
+            }
+            if ((state == EXPECT_KEY_OR_END && c == '}') || (state == EXPECT_VALUE_OR_END && c == ']')) {
+                get();
+                containers.pop_back();
+                state = AFTER_VALUE;
+                return c == '}' ? END_OBJECT : END_ARRAY;
+            }
+            if (state == EXPECT_KEY || state == EXPECT_KEY_OR_END) {
+                if (c != '"') {
+                    return fail("expected a key");
+                }
+                if (!readString()) {
+                    return stop();
+                }
+                skipWhitespace();
+                if (get() != ':') {
+                    return fail("expected ':' after a key");
+                }
+                state = EXPECT_VALUE;
+                return KEY;
+            }
+
+            state = AFTER_VALUE;
+            if (c == '{' || c == '[') {
+                if (containers.size() == MAX_DEPTH) {
+                    return fail("nested too deep");
+                }
+                get();
+                containers.push_back((char)c);
+                state = c == '{' ? EXPECT_KEY_OR_END : EXPECT_VALUE_OR_END;
+                return c == '{' ? BEGIN_OBJECT : BEGIN_ARRAY;
+            }
+            if (c == '"') {
+                return readString() ? STRING : stop();
+            }
+            if (c == '-' || (c >= '0' && c <= '9')) {
+                return readNumber() ? NUMBER : fail("invalid number");
+            }
+            if (c >= 'a' && c <= 'z') {
+                return readLiteral() ? LITERAL : fail("invalid literal");
+            }
+            return fail("unexpected character");
+        }
+    }
+
+    // Text of the last KEY, STRING (unescaped), NUMBER or LITERAL
+    string_view text() const {
+        return value;
+    }
+
+    // Skip the rest of the value whose first token was just returned
+    void skip(Token first) {
+        if (first != BEGIN_OBJECT && first != BEGIN_ARRAY) {
+            return;
+        }
+        size_t depth = containers.size();
+        while (containers.size() >= depth) {
+            Token token = next();
+            if (token == ERROR || token == END) {
+                return;
+            }
+        }
+    }
+
+    // NDJSON recovery after an error: drop the rest of the line and start
+    // over with the next one. Returns false at the end of the input.
+    bool skipLine() {
+        int c;
+        while ((c = get()) != EOF && c != '\n') {
+        }
+        containers.clear();
+        state = EXPECT_VALUE;
+        failure.clear();
+        return c != EOF;
+    }
+
+    // Line of the last character read, and why parsing stopped
+    size_t line() const {
+        return lineNumber;
+    }
+
+    const string& error() const {
+        return failure;
+    }
+
+    // Bytes read so far
+    uint64_t offset() const {
+        return consumed + position;
+    }
+
+private:
+    enum State { EXPECT_VALUE, EXPECT_VALUE_OR_END, EXPECT_KEY, EXPECT_KEY_OR_END, AFTER_VALUE, FAILED };
+
+    istream& in;
+    bool lineDelimited;
+    vector<char> buffer;
+    size_t position;
+    size_t available;
+    uint64_t consumed;  // bytes before the buffer
+    size_t lineNumber;
+    State state;
+    string containers;  // '{' or '[' for each open container
+    string value;
+    string failure;
+
+    int peek() {
+        if (position == available) {
+            consumed += available;
+            in.read(buffer.data(), buffer.size());
+            available = in.gcount();
+            position = 0;
+            if (available == 0) {
+                return EOF;
+            }
+        }
+        return (unsigned char)buffer[position];
+    }
+
+    int get() {
+        int c = peek();
+        if (c != EOF) {
+            position++;
+            lineNumber += c == '\n';
+        }
+        return c;
+    }
+
+    void skipWhitespace() {
+        int c;
+        while ((c = peek()) == ' ' || c == '\n' || c == '\r' || c == '\t') {
+            if (c == '\n' && lineDelimited && !containers.empty()) {
+                return;
+            }
+            get();
+        }
+    }
+
+    Token fail(const char* message) {
+        failure = message;
+        return stop();
+    }
+
+    // Fail with the reason already in failure
+    Token stop() {
+        state = FAILED;
+        return ERROR;
+    }
+
+    // String at the current '"', unescaped into value
+    bool readString() {
+        get();
+        value.clear();
+        while (true) {
+            // copy the run of characters that need no unescaping at once
+            size_t run = position;
+            while (run < available && (unsigned char)buffer[run] >= 0x20 && buffer[run] != '"' && buffer[run] != '\\') {
+                run++;
+            }
+            value.append(buffer.data() + position, run - position);
+            position = run;
+            if (value.size() >= MAX_TEXT) {
+                failure = "string too long";
+                return false;
+            }
+
+            int c = get();
+            if (c == '"') {
+                return true;
+            }
+            if (c == EOF || c < 0x20) {
+                failure = c == EOF ? "unterminated string" : "control character in a string";
+                return false;
+            }
+            if (c != '\\') {
+                value += (char)c;
+                continue;
+            }
+            c = get();
+            switch (c) {
+                case '"': case '\\': case '/': value += (char)c; break;
+                case 'b': value += '\b'; break;
+                case 'f': value += '\f'; break;
+                case 'n': value += '\n'; break;
+                case 'r': value += '\r'; break;
+                case 't': value += '\t'; break;
+                case 'u': {
+                    uint32_t code;
+                    if (!readHex(code)) {
+                        return false;
+                    }
+                    if (code >= 0xD800 && code <= 0xDBFF) {  // high surrogate: the low one follows
+                        uint32_t low;
+                        if (get() != '\\' || get() != 'u' || !readHex(low) || low < 0xDC00 || low > 0xDFFF) {
+                            failure = "invalid surrogate pair";
+                            return false;
+                        }
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                    } else if (code >= 0xDC00 && code <= 0xDFFF) {
+                        failure = "invalid surrogate pair";
+                        return false;
+                    }
+                    appendUtf8(code);
+                    break;
+                }
+                default:
+                    failure = "invalid escape";
+                    return false;
+            }
+        }
+    }
+
+    bool readHex(uint32_t& code) {
+        code = 0;
+        for (int i = 0; i < 4; ++i) {
+            int c = get();
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                      : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0) {
+                failure = "invalid \\u escape";
+                return false;
+            }
+            code = code * 16 + digit;
+        }
+        return true;
+    }
+
+    void appendUtf8(uint32_t code) {
+        if (code < 0x80) {
+            value += (char)code;
+        } else if (code < 0x800) {
+            value += (char)(0xC0 | code >> 6);
+            value += (char)(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            value += (char)(0xE0 | code >> 12);
+            value += (char)(0x80 | (code >> 6 & 0x3F));
+            value += (char)(0x80 | (code & 0x3F));
+        } else {
+            value += (char)(0xF0 | code >> 18);
+            value += (char)(0x80 | (code >> 12 & 0x3F));
+            value += (char)(0x80 | (code >> 6 & 0x3F));
+            value += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    // -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+    bool readNumber() {
+        value.clear();
+        auto digits = [this]() {
+            size_t count = 0;
+            while (peek() >= '0' && peek() <= '9' && value.size() < MAX_TEXT) {
+                value += (char)get();
+                count++;
+            }
+            return count;
+        };
+        if (peek() == '-') {
+            value += (char)get();
+        }
+        if (peek() == '0') {
+            value += (char)get();
+        } else if (digits() == 0) {
+            return false;
+        }
+        if (peek() == '.') {
+            value += (char)get();
+            if (digits() == 0) {
+                return false;
+            }
+        }
+        if (peek() == 'e' || peek() == 'E') {
+            value += (char)get();
+            if (peek() == '+' || peek() == '-') {
+                value += (char)get();
+            }
+            if (digits() == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool readLiteral() {
+        value.clear();
+        while (peek() >= 'a' && peek() <= 'z' && value.size() < 5) {
+            value += (char)get();
+        }
+        return value == "true" || value == "false" || value == "null";
+    }
+};
+
+// Read one customer object, after its BEGIN_OBJECT token, into out:
+//   {"id": 1, "firstName": "...", "lastName": "...", "email": "...", "phone": "...",
+//    "interactions": [{"type": "...", "date": "..."}, ...]}
+// The ID and unknown keys are skipped, missing fields are left empty (and
+// rejected by the validation). Returns false with the reason when the object
+// is not a customer; reader.error() is set when the JSON itself is malformed.
+bool parseCustomerObject(JsonReader& reader, LoadedChunk& out, string& reason) {
+    size_t firstInteraction = out.interactions.size();
+    out.customers.emplace_back(string_view(), string_view(), string_view(), string_view(), 0);
+    out.customers.back().firstInteraction = firstInteraction;
+    reason.clear();
+    auto invalid = [&reason](const char* why) {
+        if (reason.empty()) {
+            reason = why;
+        }
+    };
+
+    JsonReader::Token token;
+    while ((token = reader.next()) == JsonReader::KEY) {
+        string_view key = reader.text();
+        const int interactionsField = CUSTOMER_FIELD_COUNT;
+        int field = key == "interactions" ? interactionsField : fieldByJsonKey(key);
+        token = reader.next();
+        if (field >= 0 && field < interactionsField) {
+            if (token != JsonReader::STRING) {
+                invalid("a customer field is not a string");
+                reader.skip(token);
+                continue;
+            }
+            Customer& customer = out.customers.back();
+            string_view value = reader.text();
+            const FieldSchema& schema = CUSTOMER_FIELDS[field];
+            customer.*schema.member = schema.interned ? out.names.intern(value) : out.strings.store(value);
+        } else if (field == interactionsField && token == JsonReader::BEGIN_ARRAY) {
+            while ((token = reader.next()) != JsonReader::END_ARRAY && token != JsonReader::ERROR) {
+                if (token != JsonReader::BEGIN_OBJECT) {
+                    invalid("an interaction is not an object");
+                    reader.skip(token);
+                    continue;
+                }
+                // types and dates repeat: interned like the names
+                string_view type, date;
+                bool hasType = false, hasDate = false;
+                while ((token = reader.next()) == JsonReader::KEY) {
+                    bool isType = reader.text() == INTERACTION_FIELDS[0].jsonKey;
+                    bool isDate = reader.text() == INTERACTION_FIELDS[1].jsonKey;
+                    token = reader.next();
+                    if ((isType || isDate) && token == JsonReader::STRING) {
+                        (isType ? type : date) = out.names.intern(reader.text());
+                        (isType ? hasType : hasDate) = true;
+                    } else {
+                        if (isType || isDate) {
+                            invalid("an interaction type or date is not a string");
+                        }
+                        reader.skip(token);
+                    }
+                }
+                if (token != JsonReader::END_OBJECT) {
+                    break;  // malformed
+                }
+                if (!hasType || !hasDate) {
+                    invalid("an interaction has no type or date");
+                } else if (const char* why = invalidInteractionReason(type, date)) {
+                    invalid(why);
+                } else {
+                    out.addInteraction(type, date);
+                }
+            }
+            if (token == JsonReader::ERROR) {
+                break;
+            }
+        } else {
+            if (field == interactionsField) {
+                invalid("interactions is not an array");
+            }
+            reader.skip(token);
+        }
+    }
+
+    if (token != JsonReader::END_OBJECT) {
+        reason = "malformed JSON: " + reader.error();
+    }
+    if (!reason.empty()) {
+        out.customers.pop_back();
+        out.interactions.resize(firstInteraction);
+        return false;
+    }
+    return true;
+}
+
+// Formats of the import and export files, from their extension
+enum FileFormat { CSV_FORMAT, JSON_FORMAT, NDJSON_FORMAT };
+
+FileFormat fileFormat(const string& fileName) {
+    string extension = filesystem::path(fileName).extension().string();
+    transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return tolower(c); });
+    if (extension == ".json") {
+        return JSON_FORMAT;
+    }
+    return extension == ".ndjson" || extension == ".jsonl" ? NDJSON_FORMAT : CSV_FORMAT;
+}
+
+// The interactions of the whole book in columns, for the reports: type[i] and
+// date[i] (a day number, negative for free-form dates) of the i-th
+// interaction. The c-th customer's interactions are [start[c], start[c + 1]).
+struct InteractionColumns {
+    vector<uint32_t> type;
+    vector<int32_t> date;
+    vector<uint32_t> start;
+};
+
+// Aggregations over InteractionColumns. The inner loops are branch-free over
+// plain arrays so that the compiler can vectorize them, and the columns are
+// split between threads, each with its own partial result.
+class Analytics {
+public:
+    static const uint32_t ANY_TYPE = UINT32_MAX;
+
+    // Minimum number of interactions per thread
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    enum Period { WEEK, MONTH, QUARTER, YEAR };
+
+    // Key of the period holding a day; keys grow with the day
+    static int32_t periodOf(int32_t day, Period period) {
+        if (period == WEEK) {
+            return day / 7;  // weeks start on Monday, as 01/01/0001 did
+        }
+        int y, m, d;
+        civilFromDayNumber(day, y, m, d);
+        return period == MONTH ? y * 12 + m - 1 : period == QUARTER ? y * 4 + (m - 1) / 3 : y;
+    }
+
+    static string periodLabel(int32_t key, Period period) {
+        switch (period) {
+            case WEEK:
+                return "week of " + formatDayNumber(key * 7);
+            case MONTH:
+                return string(key % 12 < 9 ? "0" : "") + to_string(key % 12 + 1) + "/" + to_string(key / 12);
+            case QUARTER:
+                return "Q" + to_string(key % 4 + 1) + " " + to_string(key / 4);
+            default:
+                return to_string(key);
+        }
+    }
+
+    // Number of interactions of a type (or of any type) per period, by period
+    // key. Interactions with a free-form date are not counted.
+    static map<int32_t, uint64_t> countByPeriod(const InteractionColumns& columns, uint32_t type, Period period) {
+        size_t n = columns.date.size();
+        unsigned threads = workerCount(n, CHUNK_SIZE);
+        const uint32_t* types = columns.type.data();
+        const int32_t* dates = columns.date.data();
+
+        // range of the dates, for the day -> period table
+        vector<int32_t> lows(threads), highs(threads);
+        runParallel(threads, [&](unsigned t) {
+            int32_t low = INT32_MAX, high = -1;
+            for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i) {
+                low = min(low, dates[i] < 0 ? INT32_MAX : dates[i]);
+                high = max(high, dates[i]);
+            }
+            lows[t] = low;
+            highs[t] = high;
+        });
+        int32_t low = *min_element(lows.begin(), lows.end());
+        int32_t high = *max_element(highs.begin(), highs.end());
+        map<int32_t, uint64_t> result;
+        if (high < 0) {
+            return result;
+        }
+
+        // period of every day in the range, as an offset from the first one
+        int32_t firstKey = periodOf(low, period);
+        uint32_t range = high - low;
+        uint32_t buckets = periodOf(high, period) - firstKey + 1;
+        vector<uint32_t> bucketOfDay(range + 1);
+        for (uint32_t day = 0; day <= range; ++day) {
+            bucketOfDay[day] = periodOf(low + day, period) - firstKey;
+        }
+
+        // per-thread counts; every interaction adds 0 or 1 to the bucket of its
+        // day (clamped to the range), so the loop has no branch and no hot
+        // "not counted" bucket
+        vector<vector<uint64_t>> counts(threads, vector<uint64_t>(buckets));
+        bool anyType = type == ANY_TYPE;
+        runParallel(threads, [&](unsigned t) {
+            uint64_t* local = counts[t].data();
+            for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i) {
+                uint32_t offset = (uint32_t)dates[i] - (uint32_t)low;  // free-form dates wrap past the range
+                bool counted = (anyType | (types[i] == type)) & (offset <= range);
+                local[bucketOfDay[min(offset, range)]] += counted;
+            }
+        });
+
+        for (uint32_t bucket = 0; bucket < buckets; ++bucket) {
+            uint64_t total = 0;
+            for (auto& local : counts) {
+                total += local[bucket];
+            }
+            if (total > 0) {
+                result[firstKey + (int32_t)bucket] = total;
+            }
+        }
+        return result;
+    }
+
+    // Number of interactions of each type dated within [from, to)
+    static vector<uint64_t> countByType(const InteractionColumns& columns, size_t typeCount, int32_t from, int32_t to) {
+        size_t n = columns.date.size();
+        unsigned threads = workerCount(n, CHUNK_SIZE);
+        const uint32_t* types = columns.type.data();
+        const int32_t* dates = columns.date.data();
+        uint32_t range = (uint32_t)to - (uint32_t)from;
+
+        // with few types, consecutive interactions often hit the same counter:
+        // four interleaved copies keep the increments independent
+        const size_t COPIES = 4;
+        vector<vector<uint64_t>> counts(threads, vector<uint64_t>(typeCount * COPIES));
+        runParallel(threads, [&](unsigned t) {
+            uint64_t* local = counts[t].data();
+            for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i) {
+                bool counted = (uint32_t)dates[i] - (uint32_t)from < range;
+                local[types[i] * COPIES + i % COPIES] += counted;
+            }
+        });
+
+        vector<uint64_t> result(typeCount);
+        for (auto& local : counts) {
+            for (size_t i = 0; i < local.size(); ++i) {
+                result[i / COPIES] += local[i];
+            }
+        }
+        return result;
+    }
+
+    // Positions of the customers without an interaction of the type (or of any
+    // type) dated on or after the given day, in book order
+    static vector<uint32_t> inactiveSince(const InteractionColumns& columns, uint32_t type, int32_t day) {
+        size_t customers = columns.start.size() - 1;
+        unsigned threads = workerCount(columns.date.size(), CHUNK_SIZE);
+        const uint32_t* types = columns.type.data();
+        const int32_t* dates = columns.date.data();
+
+        vector<vector<uint32_t>> found(threads);
+        runParallel(threads, [&](unsigned t) {
+            for (size_t c = customers * t / threads; c < customers * (t + 1) / threads; ++c) {
+                int32_t latest = -1;
+                for (uint32_t i = columns.start[c]; i < columns.start[c + 1]; ++i) {
+                    latest = max(latest, type == ANY_TYPE || types[i] == type ? dates[i] : -1);
+                }
+                if (latest < day) {
+                    found[t].push_back((uint32_t)c);
+                }
+            }
+        });
+
+        vector<uint32_t> result;
+        for (auto& part : found) {
+            result.insert(result.end(), part.begin(), part.end());
+        }
+        return result;
+    }
+
+    // Time the aggregations on synthetic columns of the given size
+    static void benchmark(size_t interactions) {
+        InteractionColumns columns;
+        columns.type.resize(interactions);
+        columns.date.resize(interactions);
+        int32_t firstDay;
+        parseDayNumber("01/01/2000", firstDay);
+        uint64_t seed = 42;
+        for (size_t i = 0; i < interactions; ++i) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            columns.type[i] = (uint32_t)(seed >> 62);
+            columns.date[i] = firstDay + (int32_t)((seed >> 33) % 9800);
+            if (i % 3 == 0) {
+                columns.start.push_back((uint32_t)i);
+            }
+        }
+        columns.start.push_back((uint32_t)interactions);
+
+        cout << "Aggregating " << interactions << " interactions of " << columns.start.size() - 1
+            << " customers on " << workerCount(interactions, CHUNK_SIZE) << " threads" << endl;
+        cout << setw(30) << "Report" << setw(14) << "Time (ms)" << setw(20) << "Interactions/s" << endl;
+        size_t sink = 0;
+        auto timed = [&](const char* name, const function<size_t()>& report) {
+            auto start = chrono::steady_clock::now();
+            sink += report();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << setw(30) << name << setw(14) << fixed << setprecision(1) << seconds * 1e3
+                << setw(20) << setprecision(0) << interactions / seconds << endl;
+        };
+        timed("contracts per month", [&]() { return countByPeriod(columns, 2, MONTH).size(); });
+        timed("interactions per week", [&]() { return countByPeriod(columns, ANY_TYPE, WEEK).size(); });
+        timed("interactions per type in 2024", [&]() {
+            int32_t from, to;
+            parseDayNumber("01/01/2024", from);
+            parseDayNumber("01/01/2025", to);
+            return countByType(columns, 4, from, to).size();
+        });
+        timed("no contact in 12 months", [&]() {
+            int32_t day;
+            parseDayNumber("17/10/2025", day);
+            return inactiveSince(columns, ANY_TYPE, day).size();
+        });
+        if (sink == 0) {
+            cout << "(no results)" << endl;
+        }
+    }
+};
+
+// Whole-book duplicate detection. Comparing every pair of customers is out of
+// reach for a large book, so customers are grouped by three blocking keys
+// (normalized phone, e-mail local part, phonetic surname with the first
+// initial) and only customers sharing a block are scored. Blocks too large to
+// compare pairwise (common surnames) are sorted by name and e-mail and each
+// customer is scored against the next WINDOW ones. Blocks are spread over all
+// cores; a pair sharing the key of an earlier pass is left to that pass.
+class Deduplicator {
+public:
+    struct Candidate {
+        int customerId;
+        int duplicateId;  // larger than customerId
+        float score;
+    };
+
+    struct Result {
+        vector<Candidate> candidates;  // by customer ID
+        size_t blocks = 0;
+        uint64_t comparisons = 0;
+    };
+
+    static constexpr size_t PAIRWISE_BLOCK = 64;
+    static constexpr size_t WINDOW = 16;
+
+    // Pairs of live (not deleted) customers scoring at least threshold
+    static Result findCandidates(const vector<Customer>& customers, double threshold) {
+        // blocking keys of every live customer, in parallel
+        vector<Record> records;
+        records.reserve(customers.size());
+        for (uint32_t i = 0; i < customers.size(); ++i) {
+            if (!customers[i].deleted) {
+                records.push_back({i, {0, 0, 0}, 0, 0});
+            }
+        }
+        size_t n = records.size();
+        unsigned threads = workerCount(n, 1 << 14);
+        runParallel(threads, [&](unsigned t) {
+            string text;
+            for (size_t r = n * t / threads; r < n * (t + 1) / threads; ++r) {
+                Record& record = records[r];
+                const Customer& customer = customers[record.index];
+                record.emailKey = ContactIndex::emailKey(customer.email);
+                record.phoneKey = ContactIndex::phoneKey(customer.phone);
+                record.keys[0] = record.phoneKey;
+                text.clear();
+                appendLower(text, localPart(customer.email));
+                record.keys[1] = text.empty() ? 0 : fnv1a(text.data(), text.size());
+                text = soundex(customer.lastName);
+                text += (char)tolower((unsigned char)(customer.firstName.empty() ? ' ' : customer.firstName[0]));
+                record.keys[2] = fnv1a(text.data(), text.size());
+            }
+        });
+
+        Result result;
+        vector<vector<Candidate>> found(max(1u, workerCount(n, 1)));
+        vector<uint64_t> comparisons(found.size());
+        for (int pass = 0; pass < PASSES; ++pass) {
+            // blocks: runs of records with the same key
+            vector<pair<uint64_t, uint32_t>> keyed;
+            keyed.reserve(n);
+            for (uint32_t r = 0; r < n; ++r) {
+                if (records[r].keys[pass] != 0) {
+                    keyed.emplace_back(records[r].keys[pass], r);
+                }
+            }
+            sort(keyed.begin(), keyed.end());
+            vector<pair<size_t, size_t>> blocks;
+            for (size_t begin = 0, end; begin < keyed.size(); begin = end) {
+                end = begin + 1;
+                while (end < keyed.size() && keyed[end].first == keyed[begin].first) {
+                    end++;
+                }
+                if (end - begin > 1) {
+                    blocks.emplace_back(begin, end);
+                }
+            }
+            result.blocks += blocks.size();
+
+            // score the blocks, taking them from a shared counter
+            atomic<size_t> nextBlock(0);
+            runParallel((unsigned)found.size(), [&](unsigned t) {
+                vector<uint32_t> members;
+                size_t b;
+                while ((b = nextBlock.fetch_add(1, memory_order_relaxed)) < blocks.size()) {
+                    members.clear();
+                    for (size_t k = blocks[b].first; k < blocks[b].second; ++k) {
+                        members.push_back(keyed[k].second);
+                    }
+                    size_t window = members.size();
+                    if (members.size() > PAIRWISE_BLOCK) {
+                        sort(members.begin(), members.end(), [&](uint32_t x, uint32_t y) {
+                            const Customer& a = customers[records[x].index];
+                            const Customer& c = customers[records[y].index];
+                            return a.firstName != c.firstName ? a.firstName < c.firstName : a.email < c.email;
+                        });
+                        window = WINDOW + 1;
+                    }
+                    for (size_t i = 0; i < members.size(); ++i) {
+                        for (size_t j = i + 1; j < min(members.size(), i + window); ++j) {
+                            const Record& x = records[members[i]];
+                            const Record& y = records[members[j]];
+                            bool seen = false;
+                            for (int earlier = 0; earlier < pass; ++earlier) {
+                                seen = seen || (x.keys[earlier] != 0 && x.keys[earlier] == y.keys[earlier]);
+                            }
+                            if (seen) {
+                                continue;
+                            }
+                            comparisons[t]++;
+                            double score = pairScore(customers[x.index], customers[y.index], x, y, threshold);
+                            if (score >= threshold) {
+                                int first = customers[x.index].customerId;
+                                int second = customers[y.index].customerId;
+                                found[t].push_back({min(first, second), max(first, second), (float)score});
+                            }
+                        }
+                    }
+                }
+            });
+        }
+
+        for (size_t t = 0; t < found.size(); ++t) {
+            result.candidates.insert(result.candidates.end(), found[t].begin(), found[t].end());
+            result.comparisons += comparisons[t];
+        }
+        sort(result.candidates.begin(), result.candidates.end(), [](const Candidate& a, const Candidate& b) {
+            return a.customerId != b.customerId ? a.customerId < b.customerId : a.duplicateId < b.duplicateId;
+        });
+        result.candidates.erase(unique(result.candidates.begin(), result.candidates.end(),
+                                       [](const Candidate& a, const Candidate& b) {
+                                           return a.customerId == b.customerId && a.duplicateId == b.duplicateId;
+                                       }),
+                                result.candidates.end());
+        return result;
+    }
+
+    // 1 for equal strings, falling to 0 at half the length in edits; 0 as
+    // well below minimum, which bounds the distance computation
+    static double similarity(string_view a, string_view b, double minimum = 0) {
+        size_t length = max(a.size(), b.size());
+        if (length == 0) {
+            return 1.0;
+        }
+        size_t maxDistance = (size_t)((1.0 - max(0.0, minimum)) * length / 2 + 1e-9);
+        size_t distance = SearchIndex::editDistance(a, b, maxDistance);
+        return distance > maxDistance ? 0.0 : 1.0 - 2.0 * distance / length;
+    }
+
+    // American Soundex code of a name, e.g. Rossi and Rosi -> R200
+    static string soundex(string_view name) {
+        static const char codes[] = "01230120022455012623010202";  // a..z
+        string code;
+        char previous = 0;
+        for (char c : name) {
+            c = (char)tolower((unsigned char)c);
+            if (c < 'a' || c > 'z') {
+                continue;
+            }
+            char digit = codes[c - 'a'];
+            if (code.empty()) {
+                code += (char)toupper((unsigned char)c);
+            } else if (digit != '0' && digit != previous) {
+                code += digit;
+            }
+            if (c != 'h' && c != 'w') {
+                previous = digit;
+            }
+            if (code.size() == 4) {
+                break;
+            }
+        }
+        code.resize(code.empty() ? 0 : 4, '0');
+        return code;
+    }
+
+private:
+    static constexpr int PASSES = 3;
+
+    struct Record {
+        uint32_t index;      // in customers
+        uint64_t keys[PASSES];  // blocking keys, 0 = none
+        uint64_t emailKey;
+        uint64_t phoneKey;
+    };
+
+    // How alike two customers are, from 0 to 1: names weigh 0.4, e-mail and
+    // phone 0.3 each. Equal normalized contacts count fully; the same local
+    // part at another domain counts 0.9, a similar one less, and half as much
+    // when its digits differ (mario.rossi62 and mario.rossi69 are usually two
+    // people). A phone one edit away counts 0.6. Returns 0 as soon as the
+    // threshold is out of reach; the e-mail is compared last, only as far as
+    // it can still matter.
+    static double pairScore(const Customer& a, const Customer& b, const Record& x, const Record& y, double threshold) {
+        thread_local string left, right;
+        auto similar = [](string_view first, string_view second, double minimum = 0) {
+            left.clear();
+            right.clear();
+            appendLower(left, first);
+            appendLower(right, second);
+            return similarity(left, right, minimum);
+        };
+        double name = (similar(a.firstName, b.firstName) + similar(a.lastName, b.lastName)) / 2;
+        if (0.4 * name + 0.6 < threshold) {
+            return 0;
+        }
+
+        double phone = 1.0;
+        if (x.phoneKey == 0 || x.phoneKey != y.phoneKey) {
+            left.clear();
+            right.clear();
+            ContactIndex::appendNormalizedPhone(left, a.phone);
+            ContactIndex::appendNormalizedPhone(right, b.phone);
+            phone = SearchIndex::editDistance(left, right, 1) <= 1 ? 0.6 : 0.0;
+        }
+        if (0.4 * name + 0.3 * phone + 0.3 < threshold) {
+            return 0;
+        }
+
+        double email = 1.0;
+        if (x.emailKey == 0 || x.emailKey != y.emailKey) {
+            string_view localA = localPart(a.email), localB = localPart(b.email);
+            email = similar(localA, localB, (threshold - 0.4 * name - 0.3 * phone) / 0.3);
+            if (digitsOf(localA) != digitsOf(localB)) {
+                email /= 2;
+            }
+            if (a.email.substr(a.email.find('@') + 1) != b.email.substr(b.email.find('@') + 1)) {
+                email *= 0.9;
+            }
+        }
+        return 0.4 * name + 0.3 * email + 0.3 * phone;
+    }
+
+    // The digits of a text, as one number (up to 18 of them)
+    static uint64_t digitsOf(string_view text) {
+        uint64_t digits = 0;
+        for (char c : text) {
+            if (c >= '0' && c <= '9') {
+                digits = digits * 10 + (c - '0');
+            }
+        }
+        return digits;
+    }
+
+    // Local part of an e-mail, without a +tag
+    static string_view localPart(string_view email) {
+        return email.substr(0, min(email.find('@'), email.find('+')));
+    }
+
+    static void appendLower(string& out, string_view text) {
+        for (char c : text) {
+            out += (char)tolower((unsigned char)c);
+        }
+    }
+};
+
+// Write a synthetic customers.csv with the given number of customers.
+// The output only depends on the arguments: names and e-mail domains are
+// drawn from fixed pools, phones are unique, and the number of interactions
+// per customer follows a geometric distribution with the given mean, with
+// dates in chronological order between 2015 and 2025. With duplicatePercent,
+// that share of the rows records a recent customer again, with another
+// e-mail domain or a typo in the e-mail, the phone or the first name.
+void generateCustomersFile(const string& fileName, size_t count, double meanInteractions, uint64_t seed,
+                           double duplicatePercent = 0) {
+    const char* firstNames[] = {"Mario", "Franco", "Luca", "Giulia", "Anna", "Marco", "Sara", "Paolo", "Elena",
+                                "Andrea", "Chiara", "Davide", "Laura", "Matteo", "Silvia", "Stefano", "Giorgio",
+                                "Francesca", "Alessandro", "Valentina", "Roberto", "Federica", "Simone", "Martina"};
+    const char* lastNames[] = {"Rossi", "Russo", "Ferrari", "Esposito", "Bianchi", "Romano", "Colombo", "Ricci",
+                               "Marino", "Greco", "Bruno", "Gallo", "Conti", "De_Luca", "Mancini", "Costa",
+                               "Giordano", "Rizzo", "Lombardi", "Moretti", "Barbieri", "Fontana", "Santoro",
+                               "Mariani", "Rinaldi", "Caruso", "Ferrara", "Galli", "Martini", "Leone", "Neri"};
+    const char* domains[] = {"gmail.com", "libero.it", "tim.it", "outlook.com", "yahoo.it", "alice.it"};
+    const char* types[] = {"Appointment", "Contact", "Contract", "Meeting"};
+
+    uint64_t state = seed;
+    auto nextRandom = [&state]() {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return state >> 11;  // 53 random bits
+    };
+    auto uniform = [&nextRandom]() { return (nextRandom() + 0.5) / 9007199254740992.0; };
+
+    int32_t firstDay, lastDay;
+    parseDayNumber("01/01/2015", firstDay);
+    parseDayNumber("31/12/2025", lastDay);
+    double continueProbability = meanInteractions / (1 + meanInteractions);
+
+    ofstream file(fileName, ios::binary | ios::trunc);
+    string buffer = csvHeader() + '\n';
+    vector<int32_t> days;
+    vector<array<string, 4>> recent(duplicatePercent > 0 ? 4096 : 0);  // first, last, email, phone
+
+    for (size_t i = 0; i < count; ++i) {
+        string firstName = firstNames[nextRandom() % 24];
+        string lastName = lastNames[nextRandom() % 31];
+        if (nextRandom() % 4 == 0) {
+            // a quarter of the book has a double-barrelled surname
+            lastName += "-";
+            lastName += lastNames[nextRandom() % 31];
+        }
+        // the row number in letters makes every first and last name pair
+        // unique, while the surnames repeat as in a real book
+        for (size_t n = i + 1; n > 0; n /= 26) {
+            firstName += (char)('a' + n % 26);
+        }
+
+        string email = firstName;
+        email += ".";
+        email += lastName;
+        email += to_string(i + 1) + "@" + domains[nextRandom() % 6];
+        transform(email.begin(), email.end(), email.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+        string phone = "3" + to_string(100000000 + i);
+
+        if (!recent.empty()) {
+            if (i >= recent.size() && uniform() * 100 < duplicatePercent) {
+                const array<string, 4>& original = recent[nextRandom() % recent.size()];
+                firstName = original[0];
+                lastName = original[1];
+                email = original[2];
+                phone = original[3];
+                size_t at = email.find('@');
+                if (nextRandom() % 2 == 0) {
+                    email = email.substr(0, at + 1) + domains[nextRandom() % 6];
+                } else {
+                    size_t typo = nextRandom() % (at - 1);
+                    swap(email[typo], email[typo + 1]);
+                }
+                if (nextRandom() % 2 == 0) {
+                    phone[1 + nextRandom() % (phone.size() - 1)] = (char)('0' + nextRandom() % 10);
+                }
+                if (nextRandom() % 5 == 0) {
+                    firstName.erase(1 + nextRandom() % (firstName.size() - 1), 1);
+                }
+            }
+            recent[i % recent.size()] = {firstName, lastName, email, phone};
+        }
+
+        // each column gets the value generated for its kind
+        Customer row({}, {}, {}, {}, (int)(i + 1));
+        for (size_t f = 0; f < CUSTOMER_FIELD_COUNT; ++f) {
+            switch (CUSTOMER_FIELDS[f].validator) {
+            case Validator::FIRST_NAME:
+                row.*CUSTOMER_FIELDS[f].member = firstName;
+                break;
+            case Validator::LAST_NAME:
+                row.*CUSTOMER_FIELDS[f].member = lastName;
+                break;
+            case Validator::EMAIL:
+                row.*CUSTOMER_FIELDS[f].member = email;
+                break;
+            case Validator::PHONE:
+                row.*CUSTOMER_FIELDS[f].member = phone;
+                break;
+            }
+        }
+        appendCsvColumns(buffer, row);
+
+        days.clear();
+        while (uniform() < continueProbability) {
+            days.push_back(firstDay + (int32_t)(nextRandom() % (lastDay - firstDay + 1)));
+        }
+        sort(days.begin(), days.end());
+        if (days.empty()) {
+            buffer += NO_INTERACTION;
+        }
+        for (size_t k = 0; k < days.size(); ++k) {
+            if (k > 0) {
+                buffer += HISTORY_ITEM_SEPARATOR;
+            }
+            appendHistoryItem(buffer, types[nextRandom() % 4], formatDayNumber(days[k]));
+        }
+        buffer += '\n';
+
+        if (buffer.size() > (1 << 20)) {
+            file.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    file.write(buffer.data(), buffer.size());
+}
+
+// Consistent, immutable copy of the customer book, taken by CRM::readView().
+// The book is frozen in blocks of BLOCK_CUSTOMERS book positions, each with
+// its own copy of the text, so a view stays valid and unchanged while the CRM
+// goes on changing, compacting and saving. The CRM keeps the blocks it froze
+// and hands the same ones to the next views until one of their customers
+// changes: taking a view only copies the blocks changed since the last one.
+class ReadView {
+public:
+    static constexpr size_t BLOCK_CUSTOMERS = 256;
+
+    struct Record {
+        int customerId;
+        string_view fields[CUSTOMER_FIELD_COUNT];  // the columns of CUSTOMER_FIELDS
+        string_view history;  // "Type:...,Date:...|...", empty without interactions
+    };
+
+    struct Block {
+        size_t positions;        // book positions covered, deleted customers included
+        vector<Record> records;  // the customers still in the book
+        string text;
+    };
+
+    ReadView() : count(0), viewVersion(0) {}
+
+    // Number of customers
+    size_t size() const {
+        return count;
+    }
+
+    // CRM::version() when the view was taken
+    uint64_t version() const {
+        return viewVersion;
+    }
+
+    // Customer i, in book order
+    const Record& operator[](size_t i) const {
+        size_t block = upper_bound(ends.begin(), ends.end(), i) - ends.begin();
+        return blocks[block]->records[i - (block > 0 ? ends[block - 1] : 0)];
+    }
+
+    // Call visit(record) for each customer, in book order
+    template <class Visit>
+    void forEach(Visit visit) const {
+        for (const auto& block : blocks) {
+            for (const Record& record : block->records) {
+                visit(record);
+            }
+        }
+    }
+
+    // Same as CRM::visitInteractions, for a record of the view
+    template <class Visit>
+    static size_t visitInteractions(const Record& record, Visit visit) {
+        return parseHistory(record.history, visit);
+    }
+
+private:
+    friend class CRM;
+
+    vector<shared_ptr<const Block>> blocks;
+    vector<size_t> ends;  // customers up to the end of each block
+    size_t count;
+    uint64_t viewVersion;
+};
+
+// Value of column f of a read view record
+template <size_t F>
+string_view fieldValue(const ReadView::Record& record, integral_constant<size_t, F>) {
+    return record.fields[F];
+}
+
+// Compare the parser and serializer generated from CUSTOMER_FIELDS with the
+// original stringstream loader and << writer, on a generated customers.csv.
+// Both sides must give the same customers and the same text. Returns the
+// number of mismatching rows.
+int benchmarkSchema(size_t count) {
+    string fileName = (filesystem::temp_directory_path() / "insurance_crm_schema.csv").string();
+    generateCustomersFile(fileName, count, 2.0, 42);
+    vector<string> lines;
+    {
+        ifstream file(fileName);
+        string line;
+        getline(file, line);  // header
+        while (getline(file, line)) {
+            lines.push_back(line);
+        }
+    }
+    filesystem::remove(fileName);
+
+    struct Row {
+        string fields[CUSTOMER_FIELD_COUNT];
+        int customerId;
+        vector<pair<string, string>> interactions;
+    };
+    auto elapsed = [](chrono::steady_clock::time_point start) {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    };
+
+    // the original loader, placeholder interaction left out
+    auto start = chrono::steady_clock::now();
+    vector<Row> rows;
+    rows.reserve(lines.size());
+    for (const string& line : lines) {
+        stringstream ss(line);
+        Row row;
+        string interactionsData;
+        for (auto& field : row.fields) {
+            getline(ss, field, CSV_SEPARATOR);
+        }
+        ss >> row.customerId;
+        getline(ss, interactionsData);
+        interactionsData = interactionsData.substr(interactionsData.find_first_not_of(", "));
+
+        stringstream interactionStream(interactionsData);
+        string interactionItem;
+        while (getline(interactionStream, interactionItem, HISTORY_ITEM_SEPARATOR)) {
+            string_view typeKey = INTERACTION_FIELDS[0].csvKey;
+            string_view dateKey = INTERACTION_FIELDS[1].csvKey;
+            size_t typePos = interactionItem.find(typeKey);
+            size_t datePos = interactionItem.find(dateKey);
+            if (typePos != string::npos && datePos != string::npos && interactionItem != NO_INTERACTION) {
+                string type = interactionItem.substr(typePos + typeKey.size(), datePos - typePos - typeKey.size() - 1);
+                string date = interactionItem.substr(datePos + dateKey.size());
+                row.interactions.emplace_back(type, date);
+            }
+        }
+        rows.push_back(move(row));
+    }
+    double streamParse = elapsed(start);
+
+    start = chrono::steady_clock::now();
+    LoadedChunk chunk;
+    chunk.customers.reserve(lines.size());
+    for (const string& line : lines) {
+        parseCustomerRow(line, chunk);
+    }
+    double schemaParse = elapsed(start);
+
+    int mismatches = 0;
+    auto mismatch = [&](size_t i, const char* what) {
+        if (mismatches++ < 5) {
+            cout << "  mismatch on row " << i + 1 << ": " << what << endl;
+        }
+    };
+    if (chunk.customers.size() != rows.size()) {
+        cout << "  " << chunk.customers.size() << " customers parsed, " << rows.size() << " expected" << endl;
+        return 1;
+    }
+    for (size_t i = 0; i < rows.size(); ++i) {
+        const Customer& customer = chunk.customers[i];
+        bool sameFields = customer.customerId == rows[i].customerId;
+        forEachField([&](auto f) { sameFields = sameFields && fieldValue(customer, f) == rows[i].fields[f]; });
+        if (!sameFields) {
+            mismatch(i, "columns");
+            continue;
+        }
+        bool sameHistory = customer.interactionCount == rows[i].interactions.size();
+        for (size_t k = 0; sameHistory && k < rows[i].interactions.size(); ++k) {
+            const Interaction& interaction = chunk.interactions[customer.firstInteraction + k];
+            string date = interaction.date < 0 ? string(chunk.dates[-interaction.date - 1])
+                                               : formatDayNumber(interaction.date);
+            sameHistory = chunk.types[interaction.type] == rows[i].interactions[k].first &&
+                date == rows[i].interactions[k].second;
+        }
+        if (!sameHistory) {
+            mismatch(i, "interactions");
+        }
+    }
+
+    // the original << writer, against the generated columns and history items
+    start = chrono::steady_clock::now();
+    ostringstream stream;
+    for (const Row& row : rows) {
+        for (const string& field : row.fields) {
+            stream << field << CSV_SEPARATOR;
+        }
+        stream << row.customerId << CSV_SEPARATOR;
+        for (size_t k = 0; k < row.interactions.size(); ++k) {
+            if (k > 0) {
+                stream << HISTORY_ITEM_SEPARATOR;
+            }
+            stream << INTERACTION_FIELDS[0].csvKey << row.interactions[k].first << HISTORY_FIELD_SEPARATOR
+                   << INTERACTION_FIELDS[1].csvKey << row.interactions[k].second;
+        }
+        if (row.interactions.empty()) {
+            stream << NO_INTERACTION;
+        }
+        stream << '\n';
+    }
+    string streamText = stream.str();
+    double streamWrite = elapsed(start);
+
+    start = chrono::steady_clock::now();
+    string schemaText;
+    schemaText.reserve(streamText.size());
+    ReadView::Record record;
+    for (const Row& row : rows) {
+        record.customerId = row.customerId;
+        for (size_t f = 0; f < CUSTOMER_FIELD_COUNT; ++f) {
+            record.fields[f] = row.fields[f];
+        }
+        appendCsvColumns(schemaText, record);
+        for (size_t k = 0; k < row.interactions.size(); ++k) {
+            if (k > 0) {
+                schemaText += HISTORY_ITEM_SEPARATOR;
+            }
+            appendHistoryItem(schemaText, row.interactions[k].first, row.interactions[k].second);
+        }
+        if (row.interactions.empty()) {
+            schemaText += NO_INTERACTION;
+        }
+        schemaText += '\n';
+    }
+    double schemaWrite = elapsed(start);
+    if (schemaText != streamText) {
+        mismatch(0, "serialized text differs");
+    }
+
+    double megabytes = streamText.size() / 1e6;
+    cout << setw(20) << "Operation" << setw(14) << "Time (ms)" << setw(12) << "MB/s" << setw(14) << "Rows/s" << endl;
+    auto report = [&](const char* name, double seconds) {
+        cout << setw(20) << name << setw(14) << fixed << setprecision(1) << seconds * 1e3
+            << setw(12) << megabytes / seconds << setw(14) << setprecision(0) << rows.size() / seconds << endl;
+    };
+    report("parse stringstream", streamParse);
+    report("parse schema", schemaParse);
+    report("write stringstream", streamWrite);
+    report("write schema", schemaWrite);
+    cout << rows.size() << " rows, " << mismatches << " mismatches" << endl;
+    return mismatches;
+}
+
+// CRM class to manage customers and interactions
+class CRM {
+    friend class CRMServer;
+
+private:
+    // Customers in book order. A deleted customer stays in place as a
+    // tombstone (deleted set) until compactCustomers() drops the
+    // tombstones, so deletes don't move the customers after it. Handles name
+    // an entry of customerSlots, which follows the customer when it moves;
+    // deleting the customer bumps the entry's generation and frees it.
+    struct CustomerSlot {
+        uint32_t position;
+        uint32_t generation;
+    };
+    vector<Customer> customers;
+    vector<CustomerSlot> customerSlots;
+    vector<uint32_t> freeCustomerSlots;
+    size_t customerTombstones;
+    int nextCustomerId;
+
+    // Text of the customers: interned first/last names (kept for the CRM's
+    // lifetime), and emails and phones, whose pool is rebuilt once the values
+    // replaced by modifications and deletes (stringGarbage bytes) outweigh it
+    StringPool names;
+    StringPool strings;
+    size_t stringGarbage;
+
+    // Hash of a (first name, last name) pair
+    struct FullNameHash {
+        size_t operator()(const pair<string_view, string_view>& name) const {
+            size_t first = hash<string_view>()(name.first);
+            return first ^ (hash<string_view>()(name.second) + 0x9e3779b97f4a7c15ULL + (first << 6) + (first >> 2));
+        }
+    };
+
+    // Indexes kept up to date by every mutation: customer ID -> handle,
+    // first/last name (viewing the names pool) -> IDs of the customers
+    // carrying it, (first name, last name) -> IDs for the duplicate check,
+    // and the unique normalized e-mails and phones
+    unordered_map<int, CustomerHandle> idIndex;
+    unordered_map<string_view, unordered_set<int>> nameIndex;
+    unordered_multimap<pair<string_view, string_view>, int, FullNameHash> fullNameIndex;
+    ContactIndex emailIndex;
+    ContactIndex phoneIndex;
+
+    // Persistence: customers.csv is the snapshot, customers.journal holds the
+    // mutations applied since the snapshot was written (one line per mutation)
+    string dataFile;
+    string journalFile;
+    string snapshotFile;  // optional binary copy of customers.csv, see SnapshotHeader
+    JournalWriter journal;
+    size_t journalEntries;
+    bool snapshotOutdated;  // a background compaction left the binary snapshot behind
+
+    // Sharded storage: once a manifest (customers.shards) exists, the book is
+    // kept in one file per range of shardWidth customer IDs instead of in
+    // customers.csv. Shard k holds the IDs from k * shardWidth + 1 up to
+    // (k + 1) * shardWidth, in the customers.csv format, and is the source
+    // of their unloaded histories. A mutation marks its customer's shard
+    // dirty; a save rewrites only the dirty shards (see saveShards).
+    struct Shard {
+        string file;  // name listed in the manifest, empty until first saved
+        unique_ptr<MappedFile> source;
+        bool dirty;
+
+        Shard() : dirty(true) {}
+    };
+    string shardManifest;
+    vector<Shard> shards;  // empty when the book is in customers.csv
+    int shardWidth;
+    uint64_t shardGeneration;  // bumped by every save, part of the names of the files written
+    string shardsFingerprint;  // of the manifest: the base of the journal
+
+    // Interaction storage: each customer's interactions are a range of the
+    // arena. Interaction types and free-form dates (anything that is not a
+    // dd/mm/yyyy date, stored as -(index + 1)) are interned.
+    vector<Interaction> interactionArena;
+    size_t unusedArenaSlots;  // left behind by ranges that moved or were deleted
+    vector<string> interactionTypes;
+    unordered_map<string, uint32_t> interactionTypeIds;
+    vector<string> freeformDates;
+    unordered_map<string, int32_t> freeformDateIds;
+
+    // Lazy interaction loading: a history stays in the file it was loaded
+    // from (customers.csv text, or Interaction records of the snapshot) until
+    // it is accessed. Loaded histories that still match their source are in
+    // an LRU list of customer slots (most recent first) and dropped beyond
+    // historyCacheLimit bytes; changed ones stay loaded until the next
+    // compaction makes the new customers.csv their source.
+    unique_ptr<MappedFile> historyFile;
+    bool historyFileIsSnapshot;
+    list<uint32_t> historyCache;
+    unordered_map<uint32_t, list<uint32_t>::iterator> historyCacheEntries;
+    size_t historyCacheBytes;
+    size_t historyCacheLimit;
+    vector<CustomerHandle> historiesToCache;  // see cacheWrittenHistories
+
+    // Ranked prefix/fuzzy search over names and e-mails, built on the first
+    // search (so loading does not pay for it) and kept up to date afterwards
+    SearchIndex searchIndex;
+    bool searchIndexReady;
+
+    // Column copy of the interactions for the reports, built on the first
+    // report and rebuilt after interactions were added or customers moved
+    InteractionColumns analyticsColumns;
+    bool analyticsColumnsReady;
+
+    // Interactions by date and customers by last touch (see TimeIndex), built
+    // on the first agenda or last-touch query and kept up to date afterwards
+    TimeIndex timeIndex;
+    bool timeIndexReady;
+
+    // Blocks of the book frozen for the read views (see ReadView); an entry
+    // is reset when a customer of its block changes, and the blocks after a
+    // compaction moved customers are dropped. changes counts the mutations.
+    vector<shared_ptr<const ReadView::Block>> frozenBlocks;
+    mutex frozenBlocksLock;  // readers sharing the CRM take views concurrently
+    uint64_t changes;
+
+    // Background compaction (see logMutation): a worker thread writes the
+    // book as it was when the compaction started, frozen block by block (as
+    // for the read views) by the mutations that follow: each freezes the
+    // next few blocks, and the blocks it is about to change first. The
+    // journal carries the entries appended meanwhile over to the new file.
+    struct Compaction {
+        struct Output {
+            size_t shard;  // the shard written, in a sharded book
+            string file;   // customers.csv or the new shard file
+            vector<int> customerIds;                   // in file order
+            vector<pair<uint64_t, uint32_t>> sources;  // their histories in the file
+        };
+        vector<Output> outputs;
+        vector<int> outputOf;  // sharded book: output of each shard, -1 when it is clean
+        string manifest;       // sharded book: the manifest naming the new files
+        size_t positions;      // the customers at positions [0, positions) are written
+        size_t nextBlock;      // next block frozen in order
+        size_t journalEntries; // entries folded in
+        unordered_set<int> changedHistories;  // customers with interactions added since the start
+
+        // shared with the worker
+        thread worker;
+        mutex lock;
+        condition_variable changed;
+        vector<shared_ptr<const ReadView::Block>> blocks;  // frozen and not yet written
+        size_t written;      // blocks taken by the worker
+        bool cancelled;
+        bool finished;
+        bool published;      // the new files are the book
+        string fingerprint;  // of the new customers.csv or manifest
+
+        Compaction() : positions(0), nextBlock(0), journalEntries(0), written(0), cancelled(false), finished(false),
+                       published(false) {}
+    };
+    unique_ptr<Compaction> compaction;
+
+    // Field validation, see Validator
+    bool isValidFirstName(string_view firstName) {
+        Stats::Timer timer(Stats::VALIDATE);
+        return Validator::isValid(Validator::FIRST_NAME, firstName);
+    }
+
+    bool isValidLastName(string_view lastName) {
+        Stats::Timer timer(Stats::VALIDATE);
+        return Validator::isValid(Validator::LAST_NAME, lastName);
+    }
+
+    bool isValidEmail(string_view email) {
+        Stats::Timer timer(Stats::VALIDATE);
+        return Validator::isValid(Validator::EMAIL, email);
+    }
+
+    bool isValidPhone(string_view phone) {
+        Stats::Timer timer(Stats::VALIDATE);
+        return Validator::isValid(Validator::PHONE, phone);
+    }
+
+    // The customer a handle refers to, or nullptr if it was deleted
+    Customer* resolve(CustomerHandle handle) {
+        if (handle.slot >= customerSlots.size() || customerSlots[handle.slot].generation != handle.generation) {
+            return nullptr;
+        }
+        return &customers[customerSlots[handle.slot].position];
+    }
+
+    // Function to check if the customer exists
+    Customer* findCustomerById(int id) {
+        auto it = idIndex.find(id);
+        return it != idIndex.end() ? resolve(it->second) : nullptr;
+    }
+
+    // Find the customers whose first or last name matches, in book order
+    vector<Customer*> findCustomersByName(string_view name) {
+        vector<Customer*> matchingCustomers;
+        auto it = nameIndex.find(name);
+        if (it == nameIndex.end()) {
+            return matchingCustomers;
+        }
+
+        for (int id : it->second) {
+            matchingCustomers.push_back(findCustomerById(id));
+        }
+        sort(matchingCustomers.begin(), matchingCustomers.end());  // customers is in book order
+        return matchingCustomers;
+    }
+
+    // Find a customer with the same first and last name, the first one in
+    // book order if there are several
+    Customer* findDuplicate(string_view firstName, string_view lastName) {
+        Customer* duplicate = nullptr;
+        auto range = fullNameIndex.equal_range({firstName, lastName});
+        for (auto it = range.first; it != range.second; ++it) {
+            Customer* customer = findCustomerById(it->second);
+            if (!duplicate || customer < duplicate) {
+                duplicate = customer;
+            }
+        }
+        return duplicate;
+    }
+
+    // Why a customer with this e-mail and phone would duplicate another one
+    // ("email already in use" or "phone already in use"), or "" when both are
+    // free; customerId is the customer being modified, 0 for a new one
+    string contactConflict(string_view email, string_view phone, int customerId = 0) {
+        Customer* current = customerId ? findCustomerById(customerId) : nullptr;
+        auto holderOf = [this](int id) { return findCustomerById(id); };
+        if (contactTaken(emailIndex, &Customer::email, email, current, holderOf)) {
+            return "email already in use";
+        }
+        if (contactTaken(phoneIndex, &Customer::phone, phone, current, holderOf)) {
+            return "phone already in use";
+        }
+        return "";
+    }
+
+    // Whether a customer other than current carries this e-mail or phone
+    // (contact is the Customer member), according to an index whose holders
+    // holderOf(id) finds. The index only compares hashes, so when there is a
+    // single other carrier its normalized contact is compared too and a hash
+    // collision is not taken for a duplicate. Several other carriers, or one
+    // that is not known, only occur in books with duplicates from before the
+    // index, and count as taken.
+    template <class HolderOf>
+    static bool contactTaken(const ContactIndex& index, string_view Customer::*contact, string_view value,
+                             const Customer* current, HolderOf holderOf) {
+        bool email = contact == &Customer::email;
+        auto keyOf = email ? ContactIndex::emailKey : ContactIndex::phoneKey;
+        uint64_t key = keyOf(value);
+        uint32_t others = index.count(key) - (current && keyOf(current->*contact) == key ? 1 : 0);
+        if (others != 1) {
+            return others > 1;
+        }
+        const Customer* holder = holderOf(index.holder(key));
+        if (!holder || holder == current) {
+            return true;
+        }
+        auto normalize = email ? ContactIndex::appendNormalizedEmail : ContactIndex::appendNormalizedPhone;
+        string normalized, holderNormalized;
+        normalize(normalized, value);
+        normalize(holderNormalized, holder->*contact);
+        return normalized == holderNormalized;
+    }
+
+    // Find the customers best matching a partial or misspelled name or e-mail,
+    // best match first (see SearchIndex::search)
+    vector<Customer*> searchCustomersRanked(const string& query, size_t limit) {
+        Stats::Timer timer(Stats::SEARCH);
+        if (!searchIndexReady) {
+            for (const Customer& customer : customers) {
+                if (customer.deleted) {
+                    continue;  // tombstone
+                }
+                searchIndex.add(customer.customerId, customer.firstName, customer.lastName, customer.email);
+            }
+            searchIndexReady = true;
+        }
+        vector<Customer*> matchingCustomers;
+        for (int id : searchIndex.search(query, limit)) {
+            matchingCustomers.push_back(findCustomerById(id));
+        }
+        return matchingCustomers;
+    }
+
+    // Add/remove a customer's names to/from the name and search indexes
+    void indexNames(const Customer& customer) {
+        nameIndex[customer.firstName].insert(customer.customerId);
+        nameIndex[customer.lastName].insert(customer.customerId);
+        fullNameIndex.emplace(make_pair(customer.firstName, customer.lastName), customer.customerId);
+        if (searchIndexReady) {
+            searchIndex.add(customer.customerId, customer.firstName, customer.lastName, customer.email);
+        }
+    }
+
+    void unindexNames(const Customer& customer) {
+        for (string_view name : {customer.firstName, customer.lastName}) {
+            auto it = nameIndex.find(name);
+            if (it == nameIndex.end()) {
+                continue;
+            }
+            it->second.erase(customer.customerId);
+            if (it->second.empty()) {
+                nameIndex.erase(it);
+            }
+        }
+        // only the customers sharing both names are looked at, usually just this one
+        auto range = fullNameIndex.equal_range({customer.firstName, customer.lastName});
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == customer.customerId) {
+                fullNameIndex.erase(it);
+                break;
+            }
+        }
+        if (searchIndexReady) {
+            searchIndex.remove(customer.customerId, customer.firstName, customer.lastName, customer.email);
+        }
+    }
+
+    // Add/remove a customer's e-mail and phone to/from the contact indexes
+    void indexContacts(const Customer& customer) {
+        emailIndex.add(ContactIndex::emailKey(customer.email), customer.customerId);
+        phoneIndex.add(ContactIndex::phoneKey(customer.phone), customer.customerId);
+    }
+
+    void unindexContacts(const Customer& customer) {
+        emailIndex.remove(ContactIndex::emailKey(customer.email), customer.customerId);
+        phoneIndex.remove(ContactIndex::phoneKey(customer.phone), customer.customerId);
+    }
+
+    // Interned ID of an interaction type
+    uint32_t internType(string_view type) {
+        auto id = interactionTypeIds.try_emplace(string(type), (uint32_t)interactionTypes.size());
+        if (id.second) {
+            interactionTypes.push_back(string(type));
+        }
+        return id.first->second;
+    }
+
+    // Packed form of an interaction date: a day number, or an interned free-form date
+    int32_t internDate(string_view date) {
+        int32_t day;
+        if (parseDayNumber(date, day)) {
+            return day;
+        }
+        auto id = freeformDateIds.try_emplace(string(date), -(int32_t)freeformDates.size() - 1);
+        if (id.second) {
+            freeformDates.push_back(string(date));
+        }
+        return id.first->second;
+    }
+
+    // Text of a packed interaction date
+    string dateText(int32_t date) const {
+        return date >= 0 ? formatDayNumber(date) : freeformDates[-date - 1];
+    }
+
+    // Shard of a customer ID (see Shard)
+    size_t shardOf(int customerId) const {
+        return customerId > 0 && shardWidth > 0 ? (size_t)(customerId - 1) / shardWidth : 0;
+    }
+
+    // A customer of the shard changed: the next save rewrites it
+    void markShardDirty(int customerId) {
+        if (!isSharded()) {
+            return;
+        }
+        size_t shard = shardOf(customerId);
+        if (shard >= shards.size()) {
+            shards.resize(shard + 1);  // new shards start dirty
+        }
+        shards[shard].dirty = true;
+    }
+
+    // Path of a shard file, next to the manifest
+    string shardPath(const string& file) const {
+        return (filesystem::path(shardManifest).parent_path() / file).string();
+    }
+
+    // A customer's text and history changed: its block must be frozen again
+    // for the next read view
+    void touchCustomer(size_t position) {
+        if (position / ReadView::BLOCK_CUSTOMERS < frozenBlocks.size()) {
+            frozenBlocks[position / ReadView::BLOCK_CUSTOMERS].reset();
+        }
+        changes++;
+    }
+
+    // Customer table rows, shared by the listing, the search and the list command
+    void renderCustomerHeader(TableRenderer& table) {
+        table.cell("ID", 10);
+        for (const FieldSchema& field : CUSTOMER_FIELDS) {
+            table.cell(field.name, field.width);
+        }
+        table.cell("Interactions", 50);
+        table.endRow();
+    }
+
+    // The ID and the columns of a customer, without the interactions
+    void renderCustomerColumnsHeader(TableRenderer& table) {
+        table.cell("ID", 10);
+        for (const FieldSchema& field : CUSTOMER_FIELDS) {
+            table.cell(field.name, field.width);
+        }
+        table.endRow();
+    }
+
+    void renderCustomerColumns(TableRenderer& table, const Customer& customer) {
+        table.cell(customer.customerId, 10);
+        forEachField([&](auto f) {
+            table.cell(fieldValue(customer, f), CUSTOMER_FIELDS[f].width);
+        });
+        table.endRow();
+    }
+
+    // One customer: details, then the interactions separated by " | " (or
+    // noInteraction when the history is empty)
+    void renderCustomer(TableRenderer& table, const Customer& customer, string_view noInteraction) {
+        table.cell(customer.customerId, 10);
+        forEachField([&](auto f) {
+            table.cell(fieldValue(customer, f), CUSTOMER_FIELDS[f].width);
+        });
+
+        size_t start = table.mark();
+        bool first = true;
+        visitInteractions(customer, [&](string_view type, string_view date) {
+            if (!first) {
+                table.append(" | ");  // separator between interactions
+            }
+            first = false;
+            appendInteractionLabels(table, type, date);
+        });
+        if (first) {
+            table.append(noInteraction);
+        }
+        table.alignRight(start, 50);
+        table.endRow();
+    }
+
+    // Call visit(type, date) for each interaction of a customer, from its
+    // range or, when it is not loaded, from its source. Changes nothing, so
+    // the server's readers can share it. Returns the number of interactions.
+    template <class Visit>
+    size_t visitInteractions(const Customer& customer, Visit visit) const {
+        if (customer.historyLoaded || historyFileIsSnapshot) {
+            size_t count = customer.historyLoaded ? customer.interactionCount : customer.historyLength / sizeof(Interaction);
+            for (size_t i = 0; i < count; ++i) {
+                Interaction interaction = customer.historyLoaded ? interactionArena[customer.firstInteraction + i]
+                                                                 : historyRecord(customer, i);
+                visit(interactionTypes[interaction.type], dateText(interaction.date));
+            }
+            return count;
+        }
+        return parseHistory(historySource(customer), visit);
+    }
+
+    string_view historySource(const Customer& customer) const {
+        // a shard not written yet (while resharding) still reads from customers.csv
+        const MappedFile* source = historyFile.get();
+        size_t shard = shardOf(customer.customerId);
+        if (shard < shards.size() && shards[shard].source) {
+            source = shards[shard].source.get();
+        }
+        return string_view(source->data() + customer.historyOffset, customer.historyLength);
+    }
+
+    Interaction historyRecord(const Customer& customer, size_t i) const {
+        Interaction interaction;
+        memcpy(&interaction, historyFile->data() + customer.historyOffset + i * sizeof(Interaction), sizeof(Interaction));
+        return interaction;
+    }
+
+    // Append a customer's history in the customers.csv form, nothing when it
+    // is empty. An unchanged history is copied from its source when that
+    // gives the same text. Changes nothing, like visitInteractions.
+    void appendHistory(string& out, const Customer& customer) const {
+        if (customer.historyLength > 0 && !historyFileIsSnapshot) {
+            string_view source = historySource(customer);
+            if (isCanonicalHistory(source)) {
+                out += source != NO_INTERACTION ? source : string_view();
+                return;
+            }
+        }
+        size_t start = out.size();
+        visitInteractions(customer, [&out, start](string_view type, string_view date) {
+            if (out.size() > start) {
+                out += HISTORY_ITEM_SEPARATOR;  // Add separator between interactions
+            }
+            appendHistoryItem(out, type, date);
+        });
+    }
+
+    // The interactions of a customer in packed form, without caching them
+    void decodeHistory(const Customer& customer, vector<Interaction>& out) {
+        out.clear();
+        if (customer.historyLoaded) {
+            out.assign(interactionArena.begin() + customer.firstInteraction,
+                       interactionArena.begin() + customer.firstInteraction + customer.interactionCount);
+        } else if (historyFileIsSnapshot) {
+            for (size_t i = 0; i < customer.historyLength / sizeof(Interaction); ++i) {
+                out.push_back(historyRecord(customer, i));
+            }
+        } else {
+            parseHistory(historySource(customer), [&](string_view type, string_view date) {
+                out.emplace_back(internType(type), internDate(date));
+            });
+        }
+    }
+
+    // Load a customer's history into the arena if needed, and mark it as the
+    // most recently used
+    void loadHistory(Customer& customer) {
+        uint32_t slot = idIndex[customer.customerId].slot;
+        if (customer.historyLoaded) {
+            auto entry = historyCacheEntries.find(slot);
+            if (entry != historyCacheEntries.end()) {
+                historyCache.splice(historyCache.begin(), historyCache, entry->second);
+            }
+            return;
+        }
+
+        vector<Interaction> history;
+        decodeHistory(customer, history);
+        customer.firstInteraction = interactionArena.size();
+        customer.interactionCount = history.size();
+        customer.interactionCapacity = history.size();
+        customer.historyLoaded = true;
+        interactionArena.insert(interactionArena.end(), history.begin(), history.end());
+        historyCache.push_front(slot);
+        historyCacheEntries[slot] = historyCache.begin();
+        historyCacheBytes += history.size() * sizeof(Interaction);
+        Stats::add(Stats::HISTORIES_LOADED, 1);
+        trimHistoryCache();
+    }
+
+    // Drop the least recently used histories beyond the limit (but not the
+    // most recent one)
+    void trimHistoryCache() {
+        while (historyCacheBytes > historyCacheLimit && historyCache.size() > 1) {
+            Customer& evicted = customers[customerSlots[historyCache.back()].position];
+            uncacheHistory(historyCache.back(), evicted);
+            unusedArenaSlots += evicted.interactionCapacity;
+            evicted.firstInteraction = 0;
+            evicted.interactionCount = 0;
+            evicted.interactionCapacity = 0;
+            evicted.historyLoaded = false;
+        }
+        if (unusedArenaSlots > interactionArena.size() / 2) {
+            compactArena();
+        }
+    }
+
+    // Take a history out of the LRU list: it is about to change or go away
+    void uncacheHistory(uint32_t slot, const Customer& customer) {
+        auto entry = historyCacheEntries.find(slot);
+        if (entry != historyCacheEntries.end()) {
+            historyCacheBytes -= customer.interactionCount * sizeof(Interaction);
+            historyCache.erase(entry->second);
+            historyCacheEntries.erase(entry);
+        }
+    }
+
+    // Make the file just written (customers.csv or a shard) the source of
+    // the histories it holds: sources[i] is where the history of the
+    // customer at positions[i] (at position i, without positions) was written,
+    // with length 0 when it is empty (the file has the placeholder there).
+    // With cacheLater, the changed histories are listed there instead of
+    // becoming evictable right away (see cacheWrittenHistories).
+    void rebaseHistories(MappedFile& file, const vector<pair<uint64_t, uint32_t>>& sources,
+                         const vector<uint32_t>* positions = nullptr, vector<CustomerHandle>* cacheLater = nullptr) {
+        for (size_t i = 0; i < sources.size(); ++i) {
+            Customer& customer = customers[positions ? (*positions)[i] : i];
+            CustomerHandle handle = idIndex[customer.customerId];
+            uint32_t slot = handle.slot;
+            if (sources[i].second == 0) {
+                uncacheHistory(slot, customer);  // empty: nothing to load or drop
+                customer.historyLength = 0;
+                customer.historyLoaded = true;
+                continue;
+            }
+            customer.historyOffset = sources[i].first;
+            customer.historyLength = sources[i].second;
+            if (customer.historyLoaded && historyCacheEntries.count(slot) == 0) {
+                if (cacheLater) {
+                    cacheLater->push_back(handle);
+                } else {
+                    cacheHistory(slot, customer);  // changed histories become evictable
+                }
+            }
+        }
+        file.release();
+        trimHistoryCache();
+    }
+
+    // Put a loaded history at the end of the LRU list, where it is the next
+    // to be evicted
+    void cacheHistory(uint32_t slot, const Customer& customer) {
+        historyCache.push_back(slot);
+        historyCacheEntries[slot] = prev(historyCache.end());
+        historyCacheBytes += customer.interactionCount * sizeof(Interaction);
+    }
+
+    // Make the next changed histories written by a background compaction
+    // evictable, unless they changed again (or went away) since
+    void cacheWrittenHistories() {
+        for (size_t n = 0; n < COMPACTION_BLOCKS_PER_MUTATION * ReadView::BLOCK_CUSTOMERS && !historiesToCache.empty(); ++n) {
+            CustomerHandle handle = historiesToCache.back();
+            historiesToCache.pop_back();
+            Customer* customer = resolve(handle);
+            if (customer && customer->historyLoaded && customer->historyLength > 0 &&
+                historyCacheEntries.count(handle.slot) == 0) {
+                cacheHistory(handle.slot, *customer);
+            }
+        }
+        trimHistoryCache();
+    }
+
+    // Append an interaction to a customer's range, moving the range to the end
+    // of the arena (with twice the capacity) when it is full
+    void appendInteraction(Customer& customer, Interaction interaction) {
+        loadHistory(customer);
+        uncacheHistory(idIndex[customer.customerId].slot, customer);
+        customer.historyLength = 0;  // the file no longer has the whole history
+        if (customer.interactionCount == customer.interactionCapacity) {
+            uint32_t capacity = max(4u, customer.interactionCapacity * 2);
+            if (customer.firstInteraction + customer.interactionCapacity == interactionArena.size()) {
+                interactionArena.resize(customer.firstInteraction + capacity);  // last range: grow in place
+            } else {
+                uint32_t first = interactionArena.size();
+                interactionArena.resize(first + capacity);
+                copy(interactionArena.begin() + customer.firstInteraction,
+                     interactionArena.begin() + customer.firstInteraction + customer.interactionCount,
+                     interactionArena.begin() + first);
+                unusedArenaSlots += customer.interactionCapacity;
+                customer.firstInteraction = first;
+            }
+            customer.interactionCapacity = capacity;
+        }
+        interactionArena[customer.firstInteraction + customer.interactionCount++] = interaction;
+
+        if (unusedArenaSlots > interactionArena.size() / 2) {
+            compactArena();
+        }
+    }
+
+    // Rebuild the arena without the unused slots, in customer order
+    void compactArena() {
+        vector<Interaction> arena;
+        arena.reserve(interactionArena.size() - unusedArenaSlots);
+        for (auto& customer : customers) {
+            uint32_t first = arena.size();
+            arena.insert(arena.end(), interactionArena.begin() + customer.firstInteraction,
+                         interactionArena.begin() + customer.firstInteraction + customer.interactionCount);
+            customer.firstInteraction = first;
+            customer.interactionCapacity = customer.interactionCount;
+        }
+        interactionArena.swap(arena);
+        unusedArenaSlots = 0;
+    }
+
+    // The interactions in columns, in book order
+    const InteractionColumns& interactionColumns() {
+        if (!analyticsColumnsReady) {
+            compactCustomers();
+            InteractionColumns& columns = analyticsColumns;
+            columns.type.clear();
+            columns.date.clear();
+            columns.start.resize(customers.size() + 1);
+            vector<Interaction> history;  // histories are decoded, not loaded
+            for (size_t c = 0; c < customers.size(); ++c) {
+                columns.start[c] = columns.type.size();
+                decodeHistory(customers[c], history);
+                for (const Interaction& interaction : history) {
+                    columns.type.push_back(interaction.type);
+                    columns.date.push_back(interaction.date);
+                }
+            }
+            columns.start[customers.size()] = columns.type.size();
+            analyticsColumnsReady = true;
+        }
+        return analyticsColumns;
+    }
+
+    // The time index, built from every history on the first call
+    const TimeIndex& interactionTimeIndex() {
+        if (!timeIndexReady) {
+            vector<Interaction> history;  // histories are decoded, not loaded
+            timeIndex.reserve(customers.size());
+            for (const Customer& customer : customers) {
+                if (customer.deleted) {
+                    continue;  // tombstone
+                }
+                decodeHistory(customer, history);
+                timeIndex.addCustomer(customer.customerId, history);
+            }
+            timeIndexReady = true;
+        }
+        return timeIndex;
+    }
+
+    // Copy of the customers at positions [begin, end) for the read views
+    shared_ptr<const ReadView::Block> freezeBlock(size_t begin, size_t end) const {
+        auto block = make_shared<ReadView::Block>();
+        block->positions = end - begin;
+        vector<size_t> marks;  // where each field starts in the text
+        for (size_t position = begin; position < end; ++position) {
+            const Customer& customer = customers[position];
+            if (customer.deleted) {
+                continue;
+            }
+            block->records.push_back({customer.customerId, {}, {}});
+            forEachField([&](auto f) {
+                marks.push_back(block->text.size());
+                block->text += fieldValue(customer, f);
+            });
+            marks.push_back(block->text.size());
+            appendHistory(block->text, customer);
+        }
+        marks.push_back(block->text.size());
+
+        // the text is complete: point the records into it
+        auto field = [&block, &marks](size_t i) {
+            return string_view(block->text.data() + marks[i], marks[i + 1] - marks[i]);
+        };
+        const size_t columns = CUSTOMER_FIELD_COUNT + 1;
+        for (size_t r = 0; r < block->records.size(); ++r) {
+            ReadView::Record& record = block->records[r];
+            for (size_t f = 0; f < CUSTOMER_FIELD_COUNT; ++f) {
+                record.fields[f] = field(r * columns + f);
+            }
+            record.history = field(r * columns + CUSTOMER_FIELD_COUNT);
+        }
+        return block;
+    }
+
+    // Interned ID of a report's type argument, Analytics::ANY_TYPE for "all".
+    // Building the columns (or the time index, for the time-indexed reports)
+    // interns the types of the histories not loaded yet.
+    bool reportType(const string& type, uint32_t& id, bool timeIndexed = false) {
+        if (timeIndexed) {
+            interactionTimeIndex();
+        } else {
+            interactionColumns();
+        }
+        if (type == "all") {
+            id = Analytics::ANY_TYPE;
+            return true;
+        }
+        auto it = interactionTypeIds.find(type);
+        if (it == interactionTypeIds.end()) {
+            cout << "No interactions of type " << type << "." << endl;
+            return false;
+        }
+        id = it->second;
+        return true;
+    }
+
+    // Apply mutations to the in-memory state (shared by the menu and the journal replay)
+    void applyAddCustomer(int id, const CustomerValues& values) {
+        markShardDirty(id);
+        Customer customer({}, {}, {}, {}, id);
+        assignFields(customer, values);
+        storeCustomer(move(customer));
+    }
+
+    // Set the columns of a customer, interning the values of the interned
+    // columns and storing the others (the values they replace become garbage)
+    void assignFields(Customer& customer, const CustomerValues& values) {
+        forEachField([&](auto f) {
+            constexpr const FieldSchema& field = CUSTOMER_FIELDS[f];
+            if constexpr (field.interned) {
+                customer.*field.member = names.intern(values[f]);
+            } else {
+                stringGarbage += (customer.*field.member).size();
+                customer.*field.member = strings.store(values[f]);
+            }
+        });
+    }
+
+    // Bytes a customer holds in the strings pool
+    static size_t storedBytes(const Customer& customer) {
+        size_t bytes = 0;
+        forEachField([&](auto f) {
+            if constexpr (!CUSTOMER_FIELDS[f].interned) {
+                bytes += fieldValue(customer, f).size();
+            }
+        });
+        return bytes;
+    }
+
+    // Add a customer whose text is already in the CRM's pools. A bulk load
+    // indexes the contacts of all its customers at once instead.
+    void storeCustomer(Customer customer, bool indexContact = true) {
+        CustomerHandle handle;
+        if (freeCustomerSlots.empty()) {
+            handle = {(uint32_t)customerSlots.size(), 0};
+            customerSlots.push_back({0, 0});
+        } else {
+            handle.slot = freeCustomerSlots.back();
+            handle.generation = customerSlots[handle.slot].generation;
+            freeCustomerSlots.pop_back();
+        }
+        customerSlots[handle.slot].position = customers.size();
+        idIndex[customer.customerId] = handle;
+        nextCustomerId = max(nextCustomerId, customer.customerId + 1);
+        customers.push_back(move(customer));
+        indexNames(customers.back());
+        if (indexContact) {
+            indexContacts(customers.back());
+        }
+        touchCustomer(customers.size() - 1);
+        analyticsColumnsReady = false;
+        if (timeIndexReady) {
+            vector<Interaction> history;
+            decodeHistory(customers.back(), history);
+            timeIndex.addCustomer(customers.back().customerId, history);
+        }
+    }
+
+    bool applyModifyCustomer(int id, const CustomerValues& values) {
+        Customer* customer = findCustomerById(id);
+        if (!customer) {
+            return false;
+        }
+        markShardDirty(id);
+        preserveForCompaction(customer - customers.data());
+        unindexNames(*customer);
+        unindexContacts(*customer);
+        assignFields(*customer, values);
+        indexNames(*customer);
+        indexContacts(*customer);
+        touchCustomer(customer - customers.data());
+        compactStrings();
+        return true;
+    }
+
+    bool applyDeleteCustomer(int id) {
+        auto it = idIndex.find(id);
+        if (it == idIndex.end()) {
+            return false;
+        }
+        markShardDirty(id);
+        CustomerSlot& slot = customerSlots[it->second.slot];
+        preserveForCompaction(slot.position);
+        Customer& customer = customers[slot.position];
+        unindexNames(customer);
+        unindexContacts(customer);
+        if (timeIndexReady) {
+            vector<Interaction> history;
+            decodeHistory(customer, history);
+            timeIndex.removeCustomer(id, history);
+        }
+        uncacheHistory(it->second.slot, customer);
+        unusedArenaSlots += customer.interactionCapacity;
+        stringGarbage += storedBytes(customer);
+        customer = Customer({}, {}, {}, {}, id);
+        customer.deleted = true;  // tombstone
+        touchCustomer(slot.position);
+        slot.generation++;
+        freeCustomerSlots.push_back(it->second.slot);
+        idIndex.erase(it);
+        analyticsColumnsReady = false;
+
+        if (++customerTombstones > max(CUSTOMER_COMPACT_MIN_TOMBSTONES, customers.size() / 2)) {
+            compactCustomers();
+        }
+        compactStrings();
+        return true;
+    }
+
+    // Rebuild the email/phone pool without the replaced values, once they
+    // make up half of it
+    void compactStrings() {
+        if (stringGarbage < max(StringPool::BLOCK_SIZE, strings.size() / 2)) {
+            return;
+        }
+        StringPool compacted;
+        for (auto& customer : customers) {
+            forEachField([&](auto f) {
+                constexpr const FieldSchema& field = CUSTOMER_FIELDS[f];
+                if constexpr (!field.interned) {
+                    customer.*field.member = compacted.store(customer.*field.member);
+                }
+            });
+        }
+        strings.clear();
+        strings.adopt(compacted);
+        stringGarbage = 0;
+    }
+
+    // Drop the tombstones left by deletes, keeping the book order. Handles
+    // stay valid; Customer pointers don't.
+    void compactCustomers() {
+        if (customerTombstones == 0) {
+            return;
+        }
+        if (compaction) {
+            for (size_t b = 0; b < compaction->blocks.size(); ++b) {
+                preserveBlock(b);  // the customers are about to move
+            }
+        }
+        size_t live = 0;
+        for (size_t position = 0; position < customers.size(); ++position) {
+            if (customers[position].deleted) {
+                if (live == position) {
+                    // the customers from here on move: their blocks are frozen again
+                    frozenBlocks.resize(min(frozenBlocks.size(), position / ReadView::BLOCK_CUSTOMERS));
+                }
+                continue;
+            }
+            if (live != position) {
+                customers[live] = move(customers[position]);
+                customerSlots[idIndex[customers[live].customerId].slot].position = live;
+            }
+            ++live;
+        }
+        customers.erase(customers.begin() + live, customers.end());
+        customerTombstones = 0;
+        analyticsColumnsReady = false;
+    }
+
+    bool applyAddInteraction(int id, const string& type, const string& date) {
+        Customer* customer = findCustomerById(id);
+        if (!customer) {
+            return false;
+        }
+        markShardDirty(id);
+        preserveForCompaction(customer - customers.data());
+        if (compaction) {
+            compaction->changedHistories.insert(id);
+        }
+        Interaction interaction(internType(type), internDate(date));
+        appendInteraction(*customer, interaction);
+        touchCustomer(customer - customers.data());
+        analyticsColumnsReady = false;
+        if (timeIndexReady) {
+            timeIndex.add(id, interaction);
+        }
+        return true;
+    }
+
+    // Replay the journal over the customers loaded from the CSV file.
+    // The journal is only valid for the CSV it was started on: its first line
+    // holds that file's fingerprint, anything else means it has already been
+    // folded into the CSV (e.g. a crash during compaction) and is discarded.
+    void replayJournal(const string& baseFingerprint) {
+        Stats::Timer timer(Stats::REPLAY_JOURNAL);
+        string header = "#base\t" + baseFingerprint;
+
+        // a crash between the two renames of a background compaction leaves
+        // the journal of the new CSV aside (see JournalWriter::rotate)
+        auto startsWithHeader = [&header](const string& fileName) {
+            ifstream file(fileName, ios::binary);
+            string line;
+            return getline(file, line) && line == header;
+        };
+        if (!startsWithHeader(journalFile) && startsWithHeader(journalFile + ".tmp")) {
+            durableRename(journalFile + ".tmp", journalFile);
+        }
+
+        ifstream file(journalFile, ios::binary);
+        string line;
+        if (!getline(file, line) || line != header) {
+            file.close();
+            startJournal(baseFingerprint);
+            return;
+        }
+
+        uintmax_t validSize = line.size() + 1;
+        size_t lineNumber = 1;
+        bool corrupted = false;
+        while (getline(file, line)) {
+            if (file.eof()) {
+                break;  // last line has no newline: torn write, drop it
+            }
+            lineNumber++;
+
+            vector<string> fields;
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, '\t')) {
+                fields.push_back(field);
+            }
+
+            // an unreadable record (edited by hand, or damaged) ends the
+            // replay like a torn tail does
+            int id;
+            if (fields.size() < 2 || !parseInt(fields[1], id)) {
+                corrupted = true;
+            } else if (fields.size() == 2 + CUSTOMER_FIELD_COUNT && fields[0] == "A") {
+                applyAddCustomer(id, valuesAt(fields, 2));
+            } else if (fields.size() == 2 + CUSTOMER_FIELD_COUNT && fields[0] == "M") {
+                applyModifyCustomer(id, valuesAt(fields, 2));
+            } else if (fields.size() == 2 && fields[0] == "D") {
+                applyDeleteCustomer(id);
+            } else if (fields.size() == 4 && fields[0] == "I") {
+                applyAddInteraction(id, fields[2], fields[3]);
+            } else {
+                corrupted = true;
+            }
+            if (corrupted) {
+                break;
+            }
+            validSize += line.size() + 1;
+            journalEntries++;
+        }
+        file.close();
+
+        Stats::add(Stats::BYTES_READ, validSize);
+
+        // keep what is cut for the operator, then cut a torn or unreadable
+        // tail so that new entries start on a fresh line
+        if (corrupted) {
+            cerr << "Journal " << journalFile << " line " << lineNumber << " is unreadable, the "
+                << "changes from it on are not applied (kept in " << journalFile << ".corrupted)" << endl;
+            filesystem::copy_file(journalFile, journalFile + ".corrupted", filesystem::copy_options::overwrite_existing);
+        }
+        filesystem::resize_file(journalFile, validSize);
+        journal.open(journalFile);
+    }
+
+    // Start an empty journal for the given CSV fingerprint (written aside, then renamed)
+    void startJournal(const string& baseFingerprint) {
+        journal.close();
+
+        string tmpFile = journalFile + ".tmp";
+        {
+            ofstream file(tmpFile, ios::binary | ios::trunc);
+            file << "#base\t" << baseFingerprint << '\n';
+        }
+        durableRename(tmpFile, journalFile);
+
+        journal.open(journalFile);
+        journalEntries = 0;
+    }
+
+    // Journal entry of an added (A) or modified (M) customer: the ID, then the columns
+    void logRecordMutation(const char* kind, int customerId, const CustomerValues& values) {
+        vector<string> fields = {kind, to_string(customerId)};
+        fields.insert(fields.end(), values.begin(), values.end());
+        logMutation(fields);
+    }
+
+    // Queue one mutation for the journal writer. Fields are tab-separated:
+    // the console reads every field with cin >>, so they never contain blanks.
+    // The cost of an entry does not depend on the number of customers.
+    void logMutation(const vector<string>& fields) {
+        if (!journal.isOpen()) {
+            return;  // in-memory CRM (benchmarks)
+        }
+        string line;
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (i > 0) {
+                line += '\t';
+            }
+            line += fields[i];
+        }
+        line += '\n';
+        journal.append(line);
+        Stats::add(Stats::BYTES_WRITTEN, line.size());
+        Stats::add(Stats::JOURNAL_ENTRIES, 1);
+
+        // fold the journal back into the CSV once it is as large as the book,
+        // which keeps the amortized cost per mutation constant; the book is
+        // written in the background, so no mutation waits for the whole of it
+        ++journalEntries;
+        if (compaction) {
+            stepCompaction();
+        } else if (journalEntries > max(JOURNAL_COMPACT_MIN_ENTRIES, customerCount())) {
+            startCompaction();
+        }
+        if (!historiesToCache.empty()) {
+            cacheWrittenHistories();
+        }
+    }
+
+    // Start a background compaction of the book as it is now: customers.csv,
+    // or the dirty shards of a sharded book (they count as clean from here
+    // on, and as dirty again if the compaction fails)
+    void startCompaction() {
+        compaction.reset(new Compaction());
+        Compaction& job = *compaction;
+        job.positions = customers.size();
+        job.journalEntries = journalEntries;
+        job.blocks.resize((customers.size() + ReadView::BLOCK_CUSTOMERS - 1) / ReadView::BLOCK_CUSTOMERS);
+        if (isSharded()) {
+            shardGeneration++;
+            string stem = filesystem::path(dataFile).stem().string();
+            job.outputOf.assign(shards.size(), -1);
+            job.manifest = "#shards\t" + to_string(shardWidth) + "\t" + to_string(shardGeneration) + "\t" +
+                to_string(nextCustomerId) + "\n";
+            for (size_t shard = 0; shard < shards.size(); ++shard) {
+                if (shards[shard].dirty) {
+                    job.outputOf[shard] = job.outputs.size();
+                    job.outputs.push_back({shard, stem + ".shard" + to_string(shard) + "." + to_string(shardGeneration) + ".csv", {}, {}});
+                    shards[shard].dirty = false;
+                }
+                job.manifest += (job.outputOf[shard] >= 0 ? job.outputs.back().file : shards[shard].file) + "\n";
+            }
+        } else {
+            job.outputs.push_back({0, dataFile, {}, {}});
+        }
+        journal.carry();
+        job.worker = thread(&CRM::writeCompaction, this, &job);
+    }
+
+    // Freeze the next blocks for the background compaction, and switch to
+    // the files it wrote once it is done
+    void stepCompaction() {
+        Compaction& job = *compaction;
+        for (size_t frozen = 0; frozen < COMPACTION_BLOCKS_PER_MUTATION && job.nextBlock < job.blocks.size(); ++job.nextBlock) {
+            frozen += preserveBlock(job.nextBlock);
+        }
+        bool finished;
+        {
+            lock_guard<mutex> guard(job.lock);
+            finished = job.finished;
+        }
+        if (finished) {
+            finishCompaction();
+        }
+    }
+
+    // Called before the customer at a position changes: a background
+    // compaction must still see it as it was
+    void preserveForCompaction(size_t position) {
+        if (compaction && position < compaction->positions) {
+            preserveBlock(position / ReadView::BLOCK_CUSTOMERS);
+        }
+    }
+
+    // Freeze a block for the background compaction unless it already is (or
+    // was written). The read views' copy is taken when it is still current.
+    bool preserveBlock(size_t b) {
+        Compaction& job = *compaction;
+        {
+            lock_guard<mutex> guard(job.lock);
+            if (b < job.written || job.blocks[b]) {
+                return false;
+            }
+        }
+        size_t begin = b * ReadView::BLOCK_CUSTOMERS;
+        size_t end = min(begin + ReadView::BLOCK_CUSTOMERS, job.positions);
+        shared_ptr<const ReadView::Block> block;
+        {
+            lock_guard<mutex> guard(frozenBlocksLock);
+            if (b < frozenBlocks.size() && frozenBlocks[b] && frozenBlocks[b]->positions == end - begin) {
+                block = frozenBlocks[b];
+            }
+        }
+        if (!block) {
+            block = freezeBlock(begin, end);
+        }
+        {
+            lock_guard<mutex> guard(job.lock);
+            job.blocks[b] = move(block);
+        }
+        job.changed.notify_all();
+        return true;
+    }
+
+    // The worker of a background compaction: writes the frozen blocks, in
+    // order, to the outputs, then switches to them together with the journal
+    // (see JournalWriter::rotate). It touches nothing but the job, the file
+    // names and the journal, so the book can change meanwhile.
+    void writeCompaction(Compaction* job) {
+        Stats::Timer timer(Stats::COMPACT);
+        bool sharded = !job->outputOf.empty();
+        auto outputPath = [&](const Compaction::Output& output) {
+            return sharded ? shardPath(output.file) : output.file;
+        };
+        vector<ofstream> files;
+        vector<string> buffers(job->outputs.size(), csvHeader() + '\n');
+        vector<uint64_t> offsets(job->outputs.size(), 0);
+        for (const Compaction::Output& output : job->outputs) {
+            files.emplace_back(outputPath(output) + ".tmp", ios::binary | ios::trunc);
+        }
+        auto flush = [&](size_t o) {
+            files[o].write(buffers[o].data(), buffers[o].size());
+            offsets[o] += buffers[o].size();
+            Stats::add(Stats::BYTES_WRITTEN, buffers[o].size());
+            buffers[o].clear();
+        };
+
+        bool written = true;
+        for (size_t b = 0; b < job->blocks.size() && written; ++b) {
+            shared_ptr<const ReadView::Block> block;
+            {
+                unique_lock<mutex> guard(job->lock);
+                job->changed.wait(guard, [job, b]() { return job->blocks[b] || job->cancelled; });
+                if (job->cancelled) {
+                    written = false;
+                    break;
+                }
+                block.swap(job->blocks[b]);
+                job->written = b + 1;
+            }
+            for (const ReadView::Record& record : block->records) {
+                size_t shard = shardOf(record.customerId);
+                if (sharded && (shard >= job->outputOf.size() || job->outputOf[shard] < 0)) {
+                    continue;  // clean shard
+                }
+                size_t o = sharded ? job->outputOf[shard] : 0;
+                Compaction::Output& output = job->outputs[o];
+                string& buffer = buffers[o];
+                appendCsvColumns(buffer, record);
+                output.customerIds.push_back(record.customerId);
+                output.sources.emplace_back(offsets[o] + buffer.size(), record.history.size());
+                buffer += record.history.empty() ? NO_INTERACTION : record.history;
+                buffer += '\n';
+                if (buffer.size() >= (1 << 20)) {
+                    flush(o);
+                }
+            }
+        }
+        for (size_t o = 0; o < files.size(); ++o) {
+            flush(o);
+            files[o].close();
+            written = written && files[o].good();
+        }
+
+        // the new shard files are not part of the book until the manifest names them
+        string fingerprint;
+        if (written && sharded) {
+            for (const Compaction::Output& output : job->outputs) {
+                written = written && durableRename(outputPath(output) + ".tmp", outputPath(output));
+            }
+            ofstream manifest(shardManifest + ".tmp", ios::binary | ios::trunc);
+            manifest << job->manifest;
+            manifest.close();
+            written = written && manifest.good();
+            Stats::add(Stats::BYTES_WRITTEN, job->manifest.size());
+            syncFile(shardManifest + ".tmp");
+            fingerprint = ::fingerprint(job->manifest.data(), job->manifest.size());
+        } else if (written) {
+            syncFile(dataFile + ".tmp");  // rotate() then only waits for the rename
+            fingerprint = fileFingerprint(dataFile + ".tmp");
+        }
+        bool published = written && journal.rotate(journalFile, "#base\t" + fingerprint + "\n", [&]() {
+            return sharded ? durableRename(shardManifest + ".tmp", shardManifest)
+                           : durableRename(dataFile + ".tmp", dataFile);
+        });
+
+        lock_guard<mutex> guard(job->lock);
+        job->published = published;
+        job->fingerprint = fingerprint;
+        job->finished = true;
+    }
+
+    // Wait for the background compaction (with cancel, stop it first unless
+    // it already switched files) and make the files it wrote the sources of
+    // the histories, or remove them
+    void finishCompaction(bool cancel = false) {
+        Compaction& job = *compaction;
+        if (cancel) {
+            {
+                lock_guard<mutex> guard(job.lock);
+                job.cancelled = true;
+            }
+            job.changed.notify_all();
+        }
+        job.worker.join();
+
+        bool sharded = !job.outputOf.empty();
+        if (!job.published) {
+            if (!cancel) {
+                cout << "Error writing " << (sharded ? shardManifest : dataFile) << ", the journal is kept." << endl;
+            }
+            journal.stopCarrying();
+            for (const Compaction::Output& output : job.outputs) {
+                string path = sharded ? shardPath(output.file) : output.file;
+                remove((path + ".tmp").c_str());
+                if (sharded) {
+                    remove(path.c_str());
+                    shards[output.shard].dirty = true;
+                }
+            }
+            remove((shardManifest + ".tmp").c_str());
+            compaction.reset();
+            return;
+        }
+
+        // histories that changed since the start stay loaded
+        auto rebase = [&](MappedFile& file, const Compaction::Output& output) {
+            vector<pair<uint64_t, uint32_t>> sources;
+            vector<uint32_t> positions;
+            for (size_t i = 0; i < output.customerIds.size(); ++i) {
+                Customer* customer = findCustomerById(output.customerIds[i]);
+                if (customer && job.changedHistories.count(output.customerIds[i]) == 0) {
+                    sources.push_back(output.sources[i]);
+                    positions.push_back(customer - customers.data());
+                }
+            }
+            rebaseHistories(file, sources, &positions, &historiesToCache);  // a few at a time, like the freezing
+        };
+        if (sharded) {
+            for (const Compaction::Output& output : job.outputs) {
+                Shard& shard = shards[output.shard];
+                string replaced = shard.file;
+                shard.file = output.file;
+                shard.source.reset(new MappedFile(shardPath(output.file)));
+                rebase(*shard.source, output);
+                if (!replaced.empty()) {
+                    filesystem::remove(shardPath(replaced));
+                }
+            }
+            shardsFingerprint = job.fingerprint;
+        } else {
+            historyFile.reset(new MappedFile(dataFile));
+            historyFileIsSnapshot = false;
+            rebase(*historyFile, job.outputs[0]);
+            snapshotOutdated = filesystem::exists(snapshotFile);  // written by the next compact()
+        }
+        journalEntries -= job.journalEntries;
+        compaction.reset();
+    }
+
+public:
+    // Minimum number of journal entries before an automatic compaction
+    static constexpr size_t JOURNAL_COMPACT_MIN_ENTRIES = 1000;
+
+    // Blocks of the book each mutation freezes for a background compaction
+    static constexpr size_t COMPACTION_BLOCKS_PER_MUTATION = 1;
+
+    // Minimum number of deleted customers before the tombstones are dropped
+    static constexpr size_t CUSTOMER_COMPACT_MIN_TOMBSTONES = 1000;
+
+    // Memory for the loaded interaction histories (CRM_HISTORY_CACHE_MB overrides it)
+    static constexpr size_t HISTORY_CACHE_BYTES = 64 << 20;
+
+    // Minimum amount of CSV data per loader thread
+    static const size_t LOAD_CHUNK_SIZE = 4 << 20;
+
+    // Most matches listed by a name search, and by the modify/delete pickers
+    static const size_t SEARCH_RESULT_LIMIT = 50;
+    static const size_t PICK_RESULT_LIMIT = 20;
+
+    // Rows per page of Display All Customers
+    static const size_t PAGE_SIZE = 50;
+
+    // Customers listed by a report (the count covers them all)
+    static const size_t REPORT_ROW_LIMIT = 20;
+
+    // An empty file name gives an in-memory CRM that is neither loaded nor saved
+    CRM(const string& dataFile = "customers.csv")
+        : customerTombstones(0), nextCustomerId(1), stringGarbage(0), dataFile(dataFile),
+          journalFile(dataFile.substr(0, dataFile.rfind('.')) + ".journal"),
+          snapshotFile(dataFile.substr(0, dataFile.rfind('.')) + ".snap"), journalEntries(0), snapshotOutdated(false),
+          shardManifest(dataFile.substr(0, dataFile.rfind('.')) + ".shards"), shardWidth(0), shardGeneration(0),
+          unusedArenaSlots(0), historyFileIsSnapshot(false), historyCacheBytes(0),
+          historyCacheLimit(HISTORY_CACHE_BYTES), searchIndexReady(false), analyticsColumnsReady(false), timeIndexReady(false),
+          changes(0) {
+        if (const char* megabytes = getenv("CRM_HISTORY_CACHE_MB")) {
+            historyCacheLimit = (size_t)max(0.0, atof(megabytes) * (1 << 20));
+        }
+        if (!dataFile.empty()) {
+            loadFromFile();  // Load data from file on start
+        }
+    }
+
+    // The journal holds what a background compaction still running had not
+    // folded in yet
+    ~CRM() {
+        if (compaction) {
+            finishCompaction(true);
+        }
+    }
+
+    // Function to load customers from the shards when the book is sharded,
+    // from the snapshot when it is up to date, otherwise from the CSV file,
+    // then replay the journal
+    void loadFromFile() {
+        string baseFingerprint;
+        if (!loadShards(baseFingerprint) && !loadSnapshot(true, baseFingerprint)) {
+            baseFingerprint = loadCsv();
+        }
+        replayJournal(baseFingerprint);
+    }
+
+    // Load the shards listed in the manifest, several at a time, and return
+    // the manifest's fingerprint. Returns false when the book is not sharded.
+    // The manifest is "#shards <width> <generation> <next customer ID>" and
+    // one file name per shard. Rows found in the wrong shard (a file edited
+    // by hand) are loaded with their histories and moved by the next save.
+    bool loadShards(string& baseFingerprint) {
+        ifstream manifestFile(shardManifest, ios::binary);
+        if (!manifestFile) {
+            return false;
+        }
+        Stats::Timer timer(Stats::LOAD_CSV);
+        string manifest((istreambuf_iterator<char>(manifestFile)), istreambuf_iterator<char>());
+        Stats::add(Stats::BYTES_READ, manifest.size());
+
+        istringstream lines(manifest);
+        string line, tag;
+        int width = 0, next = 0;
+        uint64_t generation = 0;
+        getline(lines, line);
+        istringstream header(line);
+        header >> tag >> width >> generation >> next;
+        if (tag != "#shards" || width <= 0) {
+            cout << "Shard manifest " << shardManifest << " is corrupted, ignoring it" << endl;
+            return false;
+        }
+        shardWidth = width;
+        shardGeneration = generation;
+        while (getline(lines, line)) {
+            Shard& shard = shards.emplace_back();
+            shard.file = line;
+            shard.source.reset(new MappedFile(shardPath(line)));
+            shard.dirty = false;
+            if (shard.source->size() == 0) {
+                cout << "Shard file " << shardPath(line) << " is missing or empty" << endl;
+            }
+        }
+
+        vector<LoadedChunk> parsed(shards.size());
+        vector<uint8_t> misplaced(shards.size(), 0);
+        unsigned threads = workerCount(shards.size(), 1);
+        runParallel(threads, [&](unsigned t) {
+            for (size_t k = t; k < shards.size(); k += threads) {
+                const MappedFile& file = *shards[k].source;
+                const char* end = file.data() + file.size();
+                const char* body = find(file.data(), end, '\n');  // after the header
+                body = body == end ? end : body + 1;
+                parsed[k].historyBase = file.data();
+                parseCustomerRows(body, end, parsed[k]);
+                for (const Customer& customer : parsed[k].customers) {
+                    misplaced[k] |= shardOf(customer.customerId) != k;
+                }
+                if (misplaced[k]) {
+                    parsed[k] = LoadedChunk();  // this file will not stay the source of the histories
+                    parseCustomerRows(body, end, parsed[k]);
+                }
+            }
+        });
+
+        vector<int> moved;
+        for (size_t k = 0; k < shards.size(); ++k) {
+            Stats::add(Stats::BYTES_READ, shards[k].source->size());
+            Stats::add(Stats::ROWS_PARSED, parsed[k].customers.size());
+            if (misplaced[k]) {
+                shards[k].dirty = true;
+                for (const Customer& customer : parsed[k].customers) {
+                    moved.push_back(customer.customerId);
+                }
+            }
+        }
+        nextCustomerId = max(nextCustomerId, next);  // new IDs given on load come after it
+        vector<size_t> renumbered;
+        if (mergeLoaded(parsed, &renumbered) > 0) {
+            for (size_t k = 0; k < renumbered.size(); ++k) {
+                if (renumbered[k] > 0) {
+                    cerr << "Gave new IDs to " << renumbered[k] << " rows of " << shardPath(shards[k].file)
+                        << " with an invalid or duplicate customer ID, saved with them by the next compaction" << endl;
+                    shards[k].dirty = true;  // rewritten without the old IDs
+                }
+            }
+        }
+        for (int customerId : moved) {
+            markShardDirty(customerId);
+        }
+        for (Shard& shard : shards) {
+            if (shard.source) {
+                shard.source->release();  // not the shards added for the rows moved or given new IDs
+            }
+        }
+        shardsFingerprint = fingerprint(manifest.data(), manifest.size());
+        baseFingerprint = shardsFingerprint;
+        cerr << "Shards detected: " << parsed.size() << " files listed in " << shardManifest << endl;
+        return true;
+    }
+
+    // Load customers from the CSV file and return its fingerprint.
+    // The file is memory-mapped and its rows are split into newline-aligned
+    // chunks that are parsed in parallel, one customer buffer per thread.
+    // Interaction histories are not parsed: the mapping stays open as
+    // their source.
+    string loadCsv() {
+        Stats::Timer timer(Stats::LOAD_CSV);
+        historyFile.reset(new MappedFile(dataFile));
+        historyFileIsSnapshot = false;
+        MappedFile& file = *historyFile;
+        const char* data = file.data();
+        const char* end = data + file.size();
+        Stats::add(Stats::BYTES_READ, file.size());
+
+        // ignore the header
+        const char* bodyStart = end;
+        if (data != end) {
+            const char* headerEnd = find(data, end, '\n');
+            string_view header(data, headerEnd - data);
+            if (!header.empty() && header.back() == '\r') {
+                header.remove_suffix(1);
+            }
+            cerr << "Header detected: " << header << endl;
+            bodyStart = headerEnd == end ? end : headerEnd + 1;
+        }
+
+        unsigned threads = workerCount(end - bodyStart, LOAD_CHUNK_SIZE);
+        vector<const char*> chunkStarts;
+        for (unsigned t = 0; t < threads; ++t) {
+            const char* start = bodyStart + (end - bodyStart) * t / threads;
+            if (t > 0 && start != end) {
+                start = find(start - 1, end, '\n');  // move to the start of the next row
+                start = start == end ? end : start + 1;
+            }
+            chunkStarts.push_back(start);
+        }
+        chunkStarts.push_back(end);
+
+        vector<LoadedChunk> parsed(threads);
+        runParallel(threads, [&](unsigned t) {
+            parsed[t].historyBase = data;
+            parseCustomerRows(chunkStarts[t], max(chunkStarts[t], chunkStarts[t + 1]), parsed[t]);
+        });
+
+        for (auto& chunk : parsed) {
+            Stats::add(Stats::ROWS_PARSED, chunk.customers.size());
+        }
+        if (size_t renumbered = mergeLoaded(parsed)) {
+            cerr << "Gave new IDs to " << renumbered << " rows of " << dataFile
+                << " with an invalid or duplicate customer ID, saved with them by the next compaction" << endl;
+        }
+        string csvFingerprint = fingerprint(data, file.size());
+        file.release();
+        return csvFingerprint;
+    }
+
+    // Load the state from the binary snapshot and return the fingerprint of the
+    // CSV it was written with. With requireFresh, a snapshot older than the
+    // current customers.csv is rejected. Must be called on an empty CRM.
+    // The interaction table is not copied: the mapping stays open as the
+    // source of the histories.
+    bool loadSnapshot(bool requireFresh, string& baseFingerprint) {
+        Stats::Timer timer(Stats::LOAD_SNAPSHOT);
+        unique_ptr<MappedFile> mapping(new MappedFile(snapshotFile));
+        MappedFile& file = *mapping;
+        SnapshotHeader header;
+        if (file.size() < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        Stats::add(Stats::BYTES_READ, file.size());
+
+        size_t recordsSize = header.customerCount * sizeof(SnapshotCustomer);
+        size_t interactionsSize = header.interactionCount * sizeof(Interaction);
+        size_t tablesSize = (header.typeCount + header.dateCount) * sizeof(SnapshotString);
+        if (memcmp(header.magic, "ICRMSNAP", 8) != 0 || header.version != SNAPSHOT_VERSION ||
+            sizeof(header) + recordsSize + interactionsSize + tablesSize + header.heapSize != file.size()) {
+            return false;
+        }
+
+        uint64_t csvSize;
+        int64_t csvModified;
+        if (requireFresh && (!fileStamp(dataFile, csvSize, csvModified) ||
+                             csvSize != header.csvSize || csvModified != header.csvModified)) {
+            return false;  // stale: customers.csv was written after the snapshot
+        }
+
+        const char* body = file.data() + sizeof(header);
+        if (contentHash(body, file.size() - sizeof(header)) != header.checksum) {
+            cout << "Snapshot " << snapshotFile << " is corrupted, ignoring it" << endl;
+            return false;
+        }
+
+        const SnapshotCustomer* records = (const SnapshotCustomer*)body;
+        const char* interactions = body + recordsSize;
+        const SnapshotString* tables = (const SnapshotString*)(interactions + interactionsSize);
+        const char* heap = (const char*)(tables + header.typeCount + header.dateCount);
+        auto text = [heap](const SnapshotString& value) {
+            return string(heap + value.offset, value.length);
+        };
+
+        // the tables give the CRM's type and date IDs, in the same order
+        uint64_t interactionsOffset = interactions - file.data();
+        for (uint64_t i = 0; i < header.typeCount; ++i) {
+            internType(text(tables[i]));
+        }
+        for (uint64_t i = 0; i < header.dateCount; ++i) {
+            internDate(text(tables[header.typeCount + i]));
+        }
+
+        // the stored (not interned) columns stay in the heap, copied into the pool in one block
+        const char* pooledHeap = strings.storeBlock(heap, header.heapSize);
+        auto pooled = [pooledHeap](const SnapshotString& value) {
+            return string_view(pooledHeap + value.offset, value.length);
+        };
+
+        // build the customers in parallel, one buffer per thread
+        unsigned threads = workerCount(header.customerCount, LOAD_CHUNK_SIZE / sizeof(SnapshotCustomer));
+        vector<LoadedChunk> loaded(threads);
+        runParallel(threads, [&](unsigned t) {
+            size_t first = header.customerCount * t / threads;
+            size_t last = header.customerCount * (t + 1) / threads;
+            loaded[t].customers.reserve(last - first);
+
+            for (size_t i = first; i < last; ++i) {
+                const SnapshotCustomer& record = records[i];
+                Customer& customer = loaded[t].customers.emplace_back(string_view(), string_view(), string_view(),
+                                                                      string_view(), record.customerId);
+                forEachField([&](auto f) {
+                    constexpr const FieldSchema& field = CUSTOMER_FIELDS[f];
+                    if constexpr (field.interned) {
+                        customer.*field.member = loaded[t].names.intern(pooled(record.fields[f]));
+                    } else {
+                        customer.*field.member = pooled(record.fields[f]);
+                    }
+                });
+                if (record.interactionCount > 0) {
+                    customer.historyOffset = interactionsOffset + record.firstInteraction * sizeof(Interaction);
+                    customer.historyLength = record.interactionCount * sizeof(Interaction);
+                    customer.historyLoaded = false;
+                }
+            }
+        });
+
+        nextCustomerId = max(nextCustomerId, header.nextCustomerId);  // new IDs given on load come after it
+        if (size_t renumbered = mergeLoaded(loaded)) {
+            cerr << "Gave new IDs to " << renumbered << " records of " << snapshotFile
+                << " with an invalid or duplicate customer ID, saved with them by the next compaction" << endl;
+        }
+        historyFile = move(mapping);
+        historyFileIsSnapshot = true;
+        historyFile->release();
+        baseFingerprint = string(header.csvFingerprint, strnlen(header.csvFingerprint, sizeof(header.csvFingerprint)));
+        cerr << "Snapshot detected: " << snapshotFile << endl;
+        return true;
+    }
+
+    // Write the current state to the binary snapshot (written aside, then renamed).
+    // Only called right after saveToFile(), so the snapshot matches customers.csv.
+    void saveSnapshot(const string& csvFingerprint) {
+        Stats::Timer timer(Stats::SAVE_SNAPSHOT);
+        vector<SnapshotCustomer> records;
+        vector<Interaction> interactionRecords;
+        vector<SnapshotString> tables;
+        string heap;
+        compactCustomers();
+        records.reserve(customers.size());
+
+        auto addString = [&heap](string_view value) {
+            SnapshotString stored = {heap.size(), (uint32_t)value.size(), 0};
+            heap += value;
+            return stored;
+        };
+        // names repeat: store each distinct one once
+        unordered_map<string_view, SnapshotString> names;
+        auto addName = [&](string_view name) {
+            auto it = names.find(name);
+            return it != names.end() ? it->second : names.emplace(name, addString(name)).first->second;
+        };
+
+        vector<Interaction> history;
+        for (auto& customer : customers) {
+            decodeHistory(customer, history);
+            SnapshotCustomer record = {};
+            record.customerId = customer.customerId;
+            record.interactionCount = history.size();
+            record.firstInteraction = interactionRecords.size();
+            forEachField([&](auto f) {
+                constexpr const FieldSchema& field = CUSTOMER_FIELDS[f];
+                record.fields[f] = field.interned ? addName(customer.*field.member) : addString(customer.*field.member);
+            });
+            interactionRecords.insert(interactionRecords.end(), history.begin(), history.end());
+            records.push_back(record);
+        }
+        for (auto& type : interactionTypes) {
+            tables.push_back(addString(type));
+        }
+        for (auto& date : freeformDates) {
+            tables.push_back(addString(date));
+        }
+
+        SnapshotHeader header = {};
+        memcpy(header.magic, "ICRMSNAP", 8);
+        header.version = SNAPSHOT_VERSION;
+        header.nextCustomerId = nextCustomerId;
+        header.customerCount = records.size();
+        header.interactionCount = interactionRecords.size();
+        header.typeCount = interactionTypes.size();
+        header.dateCount = freeformDates.size();
+        header.heapSize = heap.size();
+        fileStamp(dataFile, header.csvSize, header.csvModified);
+        csvFingerprint.copy(header.csvFingerprint, sizeof(header.csvFingerprint) - 1);
+
+        // the checksum covers the body exactly as it is laid out in the file
+        string body((const char*)records.data(), records.size() * sizeof(SnapshotCustomer));
+        body.append((const char*)interactionRecords.data(), interactionRecords.size() * sizeof(Interaction));
+        body.append((const char*)tables.data(), tables.size() * sizeof(SnapshotString));
+        body += heap;
+        header.checksum = contentHash(body.data(), body.size());
+
+        string tmpFile = snapshotFile + ".tmp";
+        {
+            ofstream file(tmpFile, ios::binary | ios::trunc);
+            file.write((const char*)&header, sizeof(header));
+            file.write(body.data(), body.size());
+        }
+        Stats::add(Stats::BYTES_WRITTEN, sizeof(header) + body.size());
+        durableRename(tmpFile, snapshotFile);
+    }
+
+    // Add the customers loaded by the loader threads, in file order. The
+    // interactions of each chunk are appended to the arena with their types
+    // and dates mapped to the CRM's IDs; a chunk without interactions has
+    // customer ranges that already point into the arena (snapshot load).
+    // Customers with an ID below 1 or an ID already in the book (a file
+    // edited by hand) get new IDs after the highest one, and their histories
+    // are loaded (a shard file is only the source of its own IDs); the first
+    // ones are reported on stderr. Returns how many, and with
+    // renumberedPerChunk how many per chunk.
+    size_t mergeLoaded(vector<LoadedChunk>& chunks, vector<size_t>* renumberedPerChunk = nullptr) {
+        size_t total = customers.size();
+        size_t totalInteractions = interactionArena.size();
+        for (auto& chunk : chunks) {
+            total += chunk.customers.size();
+            totalInteractions += chunk.interactions.size();
+        }
+        customers.reserve(total);
+        customerSlots.reserve(total);
+        idIndex.reserve(total);
+        fullNameIndex.reserve(total);
+        interactionArena.reserve(totalInteractions);
+        size_t firstNew = customers.size();
+        size_t renumbered = 0;
+        int freshId = nextCustomerId;
+        for (auto& chunk : chunks) {
+            for (auto& customer : chunk.customers) {
+                freshId = max(freshId, customer.customerId + 1);
+            }
+        }
+
+        for (auto& chunk : chunks) {
+            size_t chunkRenumbered = 0;
+            names.adopt(chunk.names);
+            strings.adopt(chunk.strings);
+
+            vector<uint32_t> typeMap;
+            vector<int32_t> dateMap;
+            for (string_view type : chunk.types) {
+                typeMap.push_back(internType(type));
+            }
+            for (string_view date : chunk.dates) {
+                dateMap.push_back(internDate(date));
+            }
+
+            uint32_t base = interactionArena.size();
+            for (auto& interaction : chunk.interactions) {
+                interactionArena.emplace_back(typeMap[interaction.type],
+                                              interaction.date >= 0 ? interaction.date : dateMap[-interaction.date - 1]);
+            }
+            for (auto& customer : chunk.customers) {
+                if (!chunk.interactions.empty()) {
+                    customer.firstInteraction += base;
+                }
+                if (customer.customerId <= 0 || idIndex.count(customer.customerId) > 0) {
+                    if (renumbered + chunkRenumbered < 10) {
+                        cerr << "Customer ID " << customer.customerId << " of " << customer.firstName << " "
+                            << customer.lastName << " is invalid or already used, given ID " << freshId << endl;
+                    }
+                    customer.customerId = freshId++;
+                    if (!customer.historyLoaded && chunk.historyBase) {
+                        string_view history(chunk.historyBase + customer.historyOffset, customer.historyLength);
+                        customer.firstInteraction = interactionArena.size();
+                        customer.interactionCount = parseHistory(history, [this](string_view type, string_view date) {
+                            interactionArena.emplace_back(internType(type), internDate(date));
+                        });
+                        customer.interactionCapacity = customer.interactionCount;
+                        customer.historyLength = 0;
+                        customer.historyLoaded = true;
+                    }
+                    markShardDirty(customer.customerId);
+                    chunkRenumbered++;
+                }
+                storeCustomer(move(customer), false);
+            }
+            chunk = LoadedChunk();
+            if (renumberedPerChunk) {
+                renumberedPerChunk->push_back(chunkRenumbered);
+            }
+            renumbered += chunkRenumbered;
+        }
+
+        // contact keys of the new customers in parallel, then one bulk insert
+        size_t added = customers.size() - firstNew;
+        vector<uint64_t> emailKeys(added), phoneKeys(added);
+        vector<int> holders(added);
+        unsigned threads = workerCount(added, 1 << 16);
+        runParallel(threads, [&](unsigned t) {
+            for (size_t i = added * t / threads; i < added * (t + 1) / threads; ++i) {
+                emailKeys[i] = ContactIndex::emailKey(customers[firstNew + i].email);
+                phoneKeys[i] = ContactIndex::phoneKey(customers[firstNew + i].phone);
+                holders[i] = customers[firstNew + i].customerId;
+            }
+        });
+        emailIndex.addAll(emailKeys, holders);
+        phoneIndex.addAll(phoneKeys, holders);
+        return renumbered;
+    }
+
+    // Function to save customers to CSV file.
+    // The file is written aside and renamed over the old one, so a crash
+    // never leaves a truncated customers.csv behind.
+    // The histories are then read from the new file.
+    // A sharded book only rewrites its dirty shards (see saveShards).
+    // Returns false, leaving the old file in place, if the save failed.
+    bool saveToFile() {
+        Stats::Timer timer(Stats::SAVE_CSV);
+        if (isSharded()) {
+            return saveShards();
+        }
+        string tmpFile = dataFile + ".tmp";
+        vector<pair<uint64_t, uint32_t>> historySources;
+        if (!writeCsv(tmpFile, &historySources)) {
+            cout << "Error writing " << tmpFile << ", " << dataFile << " is unchanged." << endl;
+            remove(tmpFile.c_str());
+            return false;
+        }
+        if (!durableRename(tmpFile, dataFile)) {
+            return false;
+        }
+        historyFile.reset(new MappedFile(dataFile));
+        historyFileIsSnapshot = false;
+        rebaseHistories(*historyFile, historySources);
+        return true;
+    }
+
+    // Rewrite the dirty shards, several at a time, each under a new file
+    // name, then switch to them with one rename of the manifest and remove
+    // the files they replace. A crash leaves the old or the new manifest,
+    // each with all of its files. The clean shards are not read or written.
+    // Returns false, leaving the old manifest and its files as the book, when
+    // a shard or the manifest could not be written.
+    bool saveShards() {
+        compactCustomers();
+        vector<vector<uint32_t>> members(shards.size());  // positions of the dirty shards' customers
+        for (size_t position = 0; position < customers.size(); ++position) {
+            size_t shard = shardOf(customers[position].customerId);
+            if (shards[shard].dirty) {
+                members[shard].push_back(position);
+            }
+        }
+        vector<size_t> dirty;
+        for (size_t shard = 0; shard < shards.size(); ++shard) {
+            if (shards[shard].dirty) {
+                dirty.push_back(shard);
+            }
+        }
+
+        shardGeneration++;
+        string stem = filesystem::path(dataFile).stem().string();
+        vector<string> files(shards.size());
+        vector<vector<pair<uint64_t, uint32_t>>> sources(shards.size());
+        vector<char> written(shards.size(), 0);
+        unsigned threads = workerCount(dirty.size(), 1);
+        runParallel(threads, [&](unsigned t) {
+            for (size_t i = t; i < dirty.size(); i += threads) {
+                size_t shard = dirty[i];
+                files[shard] = stem + ".shard" + to_string(shard) + "." + to_string(shardGeneration) + ".csv";
+                string path = shardPath(files[shard]);
+                written[shard] = writeCsv(path + ".tmp", &sources[shard], &members[shard]) &&
+                    durableRename(path + ".tmp", path);
+            }
+        });
+        // the new files are not part of the book until the manifest names them
+        auto discardNewFiles = [&]() {
+            for (size_t shard : dirty) {
+                string path = shardPath(files[shard]);
+                remove((path + ".tmp").c_str());
+                remove(path.c_str());
+            }
+        };
+        for (size_t shard : dirty) {
+            if (!written[shard]) {
+                cout << "Error writing " << shardPath(files[shard]) << ", the shards are unchanged." << endl;
+                discardNewFiles();
+                return false;
+            }
+        }
+
+        string manifest = "#shards\t" + to_string(shardWidth) + "\t" + to_string(shardGeneration) + "\t" +
+            to_string(nextCustomerId) + "\n";
+        for (size_t shard = 0; shard < shards.size(); ++shard) {
+            manifest += (shards[shard].dirty ? files[shard] : shards[shard].file) + "\n";
+        }
+        bool manifestWritten;
+        {
+            ofstream file(shardManifest + ".tmp", ios::binary | ios::trunc);
+            file << manifest;
+            file.close();
+            manifestWritten = file.good();
+        }
+        Stats::add(Stats::BYTES_WRITTEN, manifest.size());
+        if (!manifestWritten || !durableRename(shardManifest + ".tmp", shardManifest)) {
+            cout << "Error writing " << shardManifest << ", the shards are unchanged." << endl;
+            remove((shardManifest + ".tmp").c_str());
+            discardNewFiles();
+            return false;  // the old manifest and its files are still the book
+        }
+        shardsFingerprint = fingerprint(manifest.data(), manifest.size());
+
+        for (size_t shard : dirty) {
+            string replaced = shards[shard].file;
+            shards[shard].file = files[shard];
+            shards[shard].source.reset(new MappedFile(shardPath(files[shard])));
+            shards[shard].dirty = false;
+            rebaseHistories(*shards[shard].source, sources[shard], &members[shard]);
+            if (!replaced.empty()) {
+                filesystem::remove(shardPath(replaced));
+            }
+        }
+        return true;
+    }
+
+    // Write all customers (or, with positions, the customers at these
+    // positions) to a CSV file in the customers.csv format. With
+    // historySources, the offset and length of each customer's history in
+    // the file are recorded there (length 0 for an empty one). Changes nothing once the tombstones are
+    // dropped, so that the shards can be written in parallel. Returns false
+    // if the file could not be written completely (e.g. a full disk).
+    bool writeCsv(const string& fileName, vector<pair<uint64_t, uint32_t>>* historySources = nullptr,
+                  const vector<uint32_t>* positions = nullptr) {
+        compactCustomers();
+        ofstream file(fileName, ios::binary);
+        string buffer;
+        uint64_t written = 0;
+
+        // write the header
+        buffer += csvHeader();
+        buffer += '\n';
+
+        size_t count = positions ? positions->size() : customers.size();
+        for (size_t i = 0; i < count; ++i) {
+            const Customer& customer = customers[positions ? (*positions)[i] : i];
+            appendCsvColumns(buffer, customer);
+
+            // manage interactions, an empty history is written as the "No Interaction" placeholder
+            size_t historyStart = buffer.size();
+            appendHistory(buffer, customer);
+            size_t historyLength = buffer.size() - historyStart;
+            if (historyLength == 0) {
+                buffer += NO_INTERACTION;
+            }
+            if (historySources) {
+                historySources->emplace_back(written + historyStart, historyLength);
+            }
+            buffer += '\n';
+
+            if (buffer.size() >= (1 << 20)) {
+                file.write(buffer.data(), buffer.size());
+                written += buffer.size();
+                buffer.clear();
+            }
+        }
+        file.write(buffer.data(), buffer.size());
+        written += buffer.size();
+        Stats::add(Stats::BYTES_WRITTEN, written);
+        file.close();
+        return file.good();
+    }
+
+    // Write all customers as JSON: one array of customer objects (see
+    // parseCustomerObject), or with ndjson one object per line. Histories
+    // are read from their source, not loaded.
+    void writeJson(const string& fileName, bool ndjson) {
+        compactCustomers();
+        ofstream file(fileName, ios::binary);
+        JsonWriter json(file);
+        json.raw(ndjson ? "" : "[");
+        for (size_t c = 0; c < customers.size(); ++c) {
+            const Customer& customer = customers[c];
+            json.raw(ndjson ? "{\"id\":" : c > 0 ? ",\n{\"id\":" : "\n{\"id\":");
+            json.number(customer.customerId);
+            forEachField([&](auto f) {
+                json.raw(",\"");
+                json.raw(CUSTOMER_FIELDS[f].jsonKey);
+                json.raw("\":");
+                json.quoted(fieldValue(customer, f));
+            });
+            json.raw(",\"interactions\":[");
+            bool first = true;
+            visitInteractions(customer, [&json, &first](string_view type, string_view date) {
+                json.raw(first ? "{" : ",{");
+                first = false;
+                string_view values[INTERACTION_FIELD_COUNT] = {type, date};
+                for (size_t f = 0; f < INTERACTION_FIELD_COUNT; ++f) {
+                    json.raw(f > 0 ? ",\"" : "\"");
+                    json.raw(INTERACTION_FIELDS[f].jsonKey);
+                    json.raw("\":");
+                    json.quoted(values[f]);
+                }
+                json.raw("}");
+            });
+            json.raw(ndjson ? "]}\n" : "]}");
+            json.endRecord();
+        }
+        json.raw(ndjson ? "" : "\n]\n");
+        json.flush();
+        Stats::add(Stats::BYTES_WRITTEN, json.size());
+    }
+
+    // Fold the journal into customers.csv and start a new, empty journal.
+    // The binary snapshot is rewritten too once it has been created (a
+    // background compaction leaves it to this). A background compaction
+    // still running is stopped first.
+    // If the save fails, the journal is kept: it still holds the changes.
+    bool compact(bool writeSnapshot = false) {
+        if (compaction) {
+            finishCompaction(true);  // this one writes everything anyway
+        }
+        Stats::Timer timer(Stats::COMPACT);
+        if (!saveToFile()) {
+            return false;
+        }
+        if (isSharded()) {
+            startJournal(shardsFingerprint);  // the binary snapshot only stands for customers.csv
+            return true;
+        }
+        string csvFingerprint = fileFingerprint(dataFile);
+        if (writeSnapshot || filesystem::exists(snapshotFile)) {
+            saveSnapshot(csvFingerprint);
+        }
+        snapshotOutdated = false;
+        startJournal(csvFingerprint);
+        return true;
+    }
+
+    // Rebuild customers.csv from the binary snapshot (plus its journal).
+    // A sharded book has no snapshot.
+    bool restoreFromSnapshot() {
+        if (isSharded()) {
+            return false;
+        }
+        if (compaction) {
+            finishCompaction(true);
+        }
+        customers.clear();
+        names.clear();
+        strings.clear();
+        stringGarbage = 0;
+        customerSlots.clear();
+        freeCustomerSlots.clear();
+        customerTombstones = 0;
+        idIndex.clear();
+        nameIndex.clear();
+        fullNameIndex.clear();
+        emailIndex.clear();
+        phoneIndex.clear();
+        searchIndex.clear();
+        searchIndexReady = false;
+        analyticsColumnsReady = false;
+        timeIndex.clear();
+        timeIndexReady = false;
+        frozenBlocks.clear();
+        interactionArena.clear();
+        unusedArenaSlots = 0;
+        interactionTypes.clear();
+        interactionTypeIds.clear();
+        freeformDates.clear();
+        freeformDateIds.clear();
+        historyFile.reset();
+        historyCache.clear();
+        historyCacheEntries.clear();
+        historyCacheBytes = 0;
+        historiesToCache.clear();
+        nextCustomerId = 1;
+        journal.close();
+        journalEntries = 0;
+
+        string baseFingerprint;
+        if (!loadSnapshot(false, baseFingerprint)) {
+            return false;
+        }
+        replayJournal(baseFingerprint);
+        return compact(true);
+    }
+
+    // Store the book in shards of width customer IDs each (see Shard), or
+    // with width 0 in customers.csv again, and remove the files of the old
+    // layout. The journal is folded in first, so that a crash leaves one
+    // layout or the other complete. A new width goes through customers.csv.
+    bool reshard(int width) {
+        if (!compact()) {
+            return false;
+        }
+        if (isSharded()) {
+            vector<pair<uint64_t, uint32_t>> historySources;
+            if (!writeCsv(dataFile + ".tmp", &historySources)) {
+                remove((dataFile + ".tmp").c_str());
+                return false;
+            }
+            if (!durableRename(dataFile + ".tmp", dataFile)) {
+                return false;
+            }
+            filesystem::remove(shardManifest);
+            vector<Shard> previous;
+            previous.swap(shards);
+            shardWidth = 0;
+            historyFile.reset(new MappedFile(dataFile));
+            historyFileIsSnapshot = false;
+            rebaseHistories(*historyFile, historySources);
+            for (Shard& shard : previous) {
+                shard.source.reset();
+                if (!shard.file.empty()) {
+                    filesystem::remove(shardPath(shard.file));
+                }
+            }
+            startJournal(fileFingerprint(dataFile));
+        }
+        if (width > 0) {
+            // every shard starts dirty, reading its histories from customers.csv until written
+            int lastId = 0;
+            for (const Customer& customer : customers) {
+                lastId = max(lastId, customer.customerId);
+            }
+            shardWidth = width;
+            shards.resize(shardOf(lastId) + 1);
+            if (!saveShards()) {
+                shards.clear();
+                shardWidth = 0;
+                return false;
+            }
+            historyFile.reset();
+            startJournal(shardsFingerprint);
+            filesystem::remove(dataFile);
+            filesystem::remove(snapshotFile);
+        }
+        return true;
+    }
+
+    // True when the book is stored in shards rather than in customers.csv
+    bool isSharded() const {
+        return shardWidth > 0;
+    }
+
+    // Number of shards of a sharded book
+    size_t shardCount() const {
+        return shards.size();
+    }
+
+    // Whether some mutations are not yet folded into customers.csv, or the
+    // binary snapshot is behind it
+    bool needsCompaction() const {
+        return journalEntries > 0 || snapshotOutdated || compaction;
+    }
+
+    // Import customers from a file in the customers.csv format, or from a
+    // .json/.ndjson file of customer objects (read with the pull parser). All
+    // rows are validated first, column by column; duplicates (same first and
+    // last name, in the book or earlier in the file) are found through hash
+    // lookups. The accepted rows get new customer IDs and are applied
+    // together, then saved with a single rewrite of customers.csv. Rejected
+    // rows are listed with their reason in <file>.rejected. Returns the rows
+    // imported. With quiet, nothing is printed (benchmarks).
+    size_t importFile(const string& fileName, bool quiet = false) {
+        Stats::Timer timer(Stats::IMPORT);
+        auto start = chrono::steady_clock::now();
+
+        // parse every row, remembering its line number
+        LoadedChunk chunk;
+        vector<size_t> lineNumbers;
+        vector<pair<size_t, string>> rejected;
+        size_t rows = 0;
+        unique_ptr<MappedFile> csvFile;  // CSV rows view their interaction types and dates in it
+        FileFormat format = fileFormat(fileName);
+        if (format == CSV_FORMAT) {
+            csvFile.reset(new MappedFile(fileName));
+            const char* line = csvFile->data();
+            const char* end = line + csvFile->size();
+            if (line != end) {
+                line = find(line, end, '\n');  // skip the header
+                line = line == end ? end : line + 1;
+            }
+            size_t lineNumber = 1;
+            while (line < end) {
+                const char* lineEnd = find(line, end, '\n');
+                string_view row(line, lineEnd - line);
+                line = lineEnd == end ? end : lineEnd + 1;
+                lineNumber++;
+                if (row.empty() || row == "\r") {
+                    continue;
+                }
+                rows++;
+                if (parseCustomerRow(row, chunk)) {
+                    lineNumbers.push_back(lineNumber);
+                } else {
+                    rejected.emplace_back(lineNumber, "malformed row");
+                }
+            }
+            Stats::add(Stats::BYTES_READ, csvFile->size());
+        } else {
+            // a top-level array of customers, or customers one after the
+            // other; NDJSON resumes on the next line after a malformed one
+            ifstream in(fileName, ios::binary);
+            JsonReader reader(in, format == NDJSON_FORMAT);
+            string reason;
+            bool inArray = false;
+            JsonReader::Token token;
+            while ((token = reader.next()) != JsonReader::END) {
+                size_t recordLine = reader.line();
+                if (token == JsonReader::BEGIN_ARRAY && rows == 0 && !inArray) {
+                    inArray = true;
+                    continue;
+                }
+                if (token == JsonReader::END_ARRAY && inArray) {
+                    inArray = false;
+                    continue;
+                }
+                rows++;
+                if (token == JsonReader::BEGIN_OBJECT && parseCustomerObject(reader, chunk, reason)) {
+                    lineNumbers.push_back(recordLine);
+                    continue;
+                }
+                if (token == JsonReader::ERROR) {
+                    reason = "malformed JSON: " + reader.error();
+                } else if (token != JsonReader::BEGIN_OBJECT) {
+                    reason = "not a customer object";
+                    reader.skip(token);
+                }
+                rejected.emplace_back(recordLine, reason);
+                if (!reader.error().empty() && !(format == NDJSON_FORMAT && reader.skipLine())) {
+                    break;
+                }
+            }
+            Stats::add(Stats::BYTES_READ, reader.offset());
+        }
+        Stats::add(Stats::ROWS_PARSED, rows);
+
+        // bulk validation, one column at a time
+        vector<uint8_t> valid[CUSTOMER_FIELD_COUNT];
+        for (size_t f = 0; f < CUSTOMER_FIELD_COUNT; ++f) {
+            vector<string_view> column;
+            column.reserve(chunk.customers.size());
+            for (auto& customer : chunk.customers) {
+                column.emplace_back(customer.*CUSTOMER_FIELDS[f].member);
+            }
+            Validator::validateColumn(CUSTOMER_FIELDS[f].validator, column, valid[f]);
+        }
+
+        // reject invalid rows and duplicates, give new IDs to the others
+        unordered_map<string, size_t> importedNames;
+        ContactIndex importedEmails, importedPhones;
+        vector<Customer> accepted;
+        auto importedRow = [&](int id) {
+            size_t row = (size_t)(id - nextCustomerId);
+            return id >= nextCustomerId && row < accepted.size() ? &accepted[row] : nullptr;
+        };
+        size_t droppedInteractions = 0;
+        for (size_t i = 0; i < chunk.customers.size(); ++i) {
+            Customer& customer = chunk.customers[i];
+            string reason;
+            for (size_t f = 0; f < CUSTOMER_FIELD_COUNT && reason.empty(); ++f) {
+                if (!valid[f][i]) {
+                    reason = "invalid " + fieldLabel(f);
+                }
+            }
+            Customer* existing = reason.empty() ? findDuplicate(customer.firstName, customer.lastName) : nullptr;
+            if (existing) {
+                reason = "duplicate of customer " + to_string(existing->customerId);
+            }
+            if (reason.empty()) {
+                auto previous = importedNames.try_emplace(string(customer.firstName) + '\t' + string(customer.lastName), lineNumbers[i]);
+                if (!previous.second) {
+                    reason = "duplicate of line " + to_string(previous.first->second);
+                }
+            }
+            if (reason.empty()) {
+                reason = contactConflict(customer.email, customer.phone);
+            }
+            if (reason.empty()) {
+                if (contactTaken(importedEmails, &Customer::email, customer.email, nullptr, importedRow)) {
+                    reason = "email already used on an earlier line";
+                } else if (contactTaken(importedPhones, &Customer::phone, customer.phone, nullptr, importedRow)) {
+                    reason = "phone already used on an earlier line";
+                }
+            }
+
+            if (!reason.empty()) {
+                rejected.emplace_back(lineNumbers[i], reason);
+                droppedInteractions += customer.interactionCount;
+                continue;
+            }
+            customer.customerId = nextCustomerId + (int)accepted.size();
+            importedEmails.add(ContactIndex::emailKey(customer.email), customer.customerId);
+            importedPhones.add(ContactIndex::phoneKey(customer.phone), customer.customerId);
+            accepted.push_back(move(customer));
+        }
+
+        // apply every accepted row at once, then persist them with one save
+        size_t imported = accepted.size();
+        for (const Customer& customer : accepted) {
+            markShardDirty(customer.customerId);
+        }
+        chunk.customers.swap(accepted);
+        vector<LoadedChunk> chunks(1);
+        chunks[0] = move(chunk);
+        mergeLoaded(chunks);
+        unusedArenaSlots += droppedInteractions;
+        if (imported > 0) {
+            compact();
+        }
+
+        // report the rejected rows, the first ones on screen too
+        sort(rejected.begin(), rejected.end());
+        if (!rejected.empty()) {
+            ofstream report(fileName + ".rejected");
+            for (size_t i = 0; i < rejected.size(); ++i) {
+                report << "Line " << rejected[i].first << ": " << rejected[i].second << '\n';
+                if (i < 10 && !quiet) {
+                    cout << "Rejected line " << rejected[i].first << ": " << rejected[i].second << endl;
+                }
+            }
+            if (!quiet) {
+                cout << rejected.size() << " rejected rows listed in " << fileName << ".rejected" << endl;
+            }
+        }
+        if (quiet) {
+            return imported;
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Imported " << imported << " of " << rows << " rows (" << rows - imported << " rejected) in "
+            << fixed << setprecision(2) << seconds << " s, " << setprecision(0) << rows / max(seconds, 1e-9)
+            << " rows/s" << endl;
+        return imported;
+    }
+
+    // Export all customers to a file in the customers.csv format, or as JSON
+    // (.json) or NDJSON (.ndjson, .jsonl). Returns false if the file could
+    // not be written. With quiet, the throughput is not printed (benchmarks).
+    bool exportFile(const string& fileName, bool quiet = false) {
+        Stats::Timer timer(Stats::EXPORT);
+        auto start = chrono::steady_clock::now();
+        FileFormat format = fileFormat(fileName);
+        if (format == CSV_FORMAT) {
+            if (!writeCsv(fileName)) {
+                cout << "Error writing " << fileName << "." << endl;
+                return false;
+            }
+        } else {
+            writeJson(fileName, format == NDJSON_FORMAT);
+        }
+        if (quiet) {
+            return true;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Exported " << customerCount() << " customers to " << fileName << " in "
+            << fixed << setprecision(2) << seconds << " s, " << setprecision(0)
+            << customerCount() / max(seconds, 1e-9) << " rows/s" << endl;
+        return true;
+    }
+
+    // Number of customers in the book
+    size_t customerCount() const {
+        return customers.size() - customerTombstones;
+    }
+
+    // Number of changes applied to the book so far
+    uint64_t version() const {
+        return changes;
+    }
+
+    // Consistent copy of the book for scans that run while the CRM changes
+    // (see ReadView). Only the blocks changed since the last view are copied.
+    // It changes nothing that the readers of a shared CRM use, so they may
+    // take views concurrently, but not while the CRM changes.
+    ReadView readView() {
+        Stats::Timer timer(Stats::READ_VIEW);
+        lock_guard<mutex> guard(frozenBlocksLock);
+        ReadView view;
+        size_t blockCount = (customers.size() + ReadView::BLOCK_CUSTOMERS - 1) / ReadView::BLOCK_CUSTOMERS;
+        frozenBlocks.resize(blockCount);
+        for (size_t b = 0; b < blockCount; ++b) {
+            size_t begin = b * ReadView::BLOCK_CUSTOMERS;
+            size_t end = min(customers.size(), begin + ReadView::BLOCK_CUSTOMERS);
+            if (!frozenBlocks[b] || frozenBlocks[b]->positions != end - begin) {
+                frozenBlocks[b] = freezeBlock(begin, end);  // changed, or customers were added to it
+            }
+            view.count += frozenBlocks[b]->records.size();
+            view.ends.push_back(view.count);
+        }
+        view.blocks = frozenBlocks;
+        view.viewVersion = changes;
+        return view;
+    }
+
+    // Non-interactive operations, used by the menu, the command line and the
+    // benchmarks: each one applies the change and records it in the journal.
+
+    // Add a customer with already validated fields. Returns the new customer ID,
+    // or 0 when a customer with the same first and last name, e-mail or phone
+    // already exists.
+    int insertCustomer(const CustomerValues& values) {
+        Stats::Timer timer(Stats::INSERT_CUSTOMER);
+        if (findDuplicate(values[FIRST_NAME_FIELD], values[LAST_NAME_FIELD]) ||
+            !contactConflict(values[EMAIL_FIELD], values[PHONE_FIELD]).empty()) {
+            return 0;
+        }
+        int customerId = nextCustomerId;
+        applyAddCustomer(customerId, values);
+        logRecordMutation("A", customerId, values);
+        return customerId;
+    }
+
+    // Returns false when the customer does not exist or another customer has
+    // the e-mail or phone
+    bool updateCustomer(int customerId, const CustomerValues& values) {
+        Stats::Timer timer(Stats::UPDATE_CUSTOMER);
+        if (!contactConflict(values[EMAIL_FIELD], values[PHONE_FIELD], customerId).empty() ||
+            !applyModifyCustomer(customerId, values)) {
+            return false;
+        }
+        logRecordMutation("M", customerId, values);
+        return true;
+    }
+
+    bool removeCustomer(int customerId) {
+        Stats::Timer timer(Stats::REMOVE_CUSTOMER);
+        if (!applyDeleteCustomer(customerId)) {
+            return false;
+        }
+        logMutation({"D", to_string(customerId)});
+        return true;
+    }
+
+    bool recordInteraction(int customerId, const string& type, const string& date) {
+        Stats::Timer timer(Stats::RECORD_INTERACTION);
+        if (!applyAddInteraction(customerId, type, date)) {
+            return false;
+        }
+        logMutation({"I", to_string(customerId), type, date});
+        return true;
+    }
+
+    // Wait until the mutations made so far are on disk. Mutations return as
+    // soon as they are queued for the journal writer; callers that report
+    // success to someone else (the server) commit first.
+    void commit() {
+        journal.commit();
+    }
+
+    // Add a new customer with input validation
+    void addCustomer() {
+        string firstName, lastName, email, phone;
+        bool valid;
+
+        // Loop until valid first name is provided
+        do {
+            cout << "Enter First Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
+            cin >> firstName;
+            valid = isValidFirstName(firstName);
+            if (!valid) {
+                cout << "Invalid first name format!" << endl;
+            }
+        } while (!valid);  // Continue until the first name is valid
+
+        // Loop until valid last name is provided
+        do {
+            cout << "Enter Last Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
+            cin >> lastName;
+            valid = isValidLastName(lastName);
+            if (!valid) {
+                cout << "Invalid last name format!" << endl;
+            }
+        } while (!valid);  // Continue until the last name is valid
+
+        // Loop until valid email is provided
+        do {
+            cout << "Enter Email: ";
+            cin >> email;
+            valid = isValidEmail(email);
+            if (!valid) {
+                cout << "Invalid email format!" << endl;
+            }
+        } while (!valid);  // Continue until the email is valid
+
+        // Loop until valid phone number is provided
+        do {
+            cout << "Enter Phone: ";
+            cin >> phone;
+            valid = isValidPhone(phone);
+            if (!valid) {
+                cout << "Invalid phone number format! It should be 10-15 digits." << endl;
+            }
+        } while (!valid);  // Continue until the phone number is valid
+
+        // Add the new customer, unless it is a duplicate
+        string conflict = contactConflict(email, phone);
+        if (!conflict.empty()) {
+            cout << "Customer not added: " << conflict << "!" << endl;
+            return;
+        }
+        if (insertCustomer({firstName, lastName, email, phone}) == 0) {
+            cout << "Customer already exists!" << endl;
+            return;
+        }
+        cout << "Customer added successfully!" << endl;
+    }
+
+    // Display all customers with their interactions, a page at a time
+    void displayCustomers() {
+        compactCustomers();
+        TableRenderer table(cout);
+        for (size_t offset = 0; offset < customers.size(); offset += PAGE_SIZE) {
+            renderCustomerHeader(table);
+            size_t end = min(customers.size(), offset + PAGE_SIZE);
+            for (size_t slot = offset; slot < end; ++slot) {
+                renderCustomer(table, customers[slot], "No Interaction, Date: N/A");
+            }
+            table.flush();
+
+            if (end < customers.size()) {
+                string answer;
+                cout << "Customers " << offset + 1 << "-" << end << " of " << customers.size()
+                    << ". Enter n for the next page, q to return to the menu: ";
+                cin >> answer;
+                if (answer != "n") {
+                    break;
+                }
+            }
+        }
+        if (customers.empty()) {
+            renderCustomerHeader(table);
+        }
+    }
+
+    // Write limit customers starting at offset (in book order) to out, as the
+    // customer table; the rows are streamed, so any book size fits in memory
+    void listCustomers(ostream& out, size_t offset, size_t limit) {
+        Stats::Timer timer(Stats::LIST);
+        compactCustomers();
+        TableRenderer table(out);
+        renderCustomerHeader(table);
+        size_t end = offset + min(limit, customers.size() - min(offset, customers.size()));
+        for (size_t slot = offset; slot < end; ++slot) {
+            renderCustomer(table, customers[slot], "No Interaction, Date: N/A");
+        }
+    }
+
+    // Search customers by (partial or misspelled) name or e-mail and display
+    // their details and interactions, best match first
+    void searchCustomers(string name) {
+        TableRenderer table(cout);
+        renderCustomerHeader(table);
+
+        vector<Customer*> matchingCustomers = searchCustomersRanked(name, SEARCH_RESULT_LIMIT);
+        for (Customer* customer : matchingCustomers) {
+            renderCustomer(table, *customer, "Type: No Interaction, Date: N/A");
+        }
+        table.flush();
+
+        if (matchingCustomers.empty()) {
+            cout << "No customers found!" << endl;
+        }
+    }
+
+    // Modify a customer's details
+    void modifyCustomer() {
+    string name;
+    cout << "Enter first name or last name of the customer to modify (blanks not allowed, use instead  ',  .,  - or  _ ): ";
+    cin >> name;  // user input for the name to search ( first or last name)
+
+    vector<Customer*> matchingCustomers = searchCustomersRanked(name, PICK_RESULT_LIMIT);
+
+    if (matchingCustomers.empty()) {
+        cout << "No customer found with that name." << endl;
+        return;
+    }
+
+    cout << "Found the following customers:\n";
+    for (int i = 0; i < matchingCustomers.size(); ++i) {
+        cout << i + 1 << ". " << matchingCustomers[i]->firstName << " " << matchingCustomers[i]->lastName << endl;
+    }
+
+    int choice;
+    cout << "Choose the correct index to modify the customer (1 of " << matchingCustomers.size() << "): ";
+    cin >> choice;
+
+    if (choice < 1 || choice > matchingCustomers.size()) {
+        cout << "Invalid choice!" << endl;
+        return;
+    }
+
+    Customer* customer = matchingCustomers[choice - 1];
+
+    // Ask if the user wants to modify all or just specific fields
+    string modifyAll;
+    cout << "Do you want to modify all fields (First Name, Last Name, Email, Phone)? (yes/no): ";
+    cin >> modifyAll;
+
+    // collect the new values, starting from the current ones
+    string newFirstName(customer->firstName);
+    string newLastName(customer->lastName);
+    string newEmail(customer->email);
+    string newPhone(customer->phone);
+
+    if (modifyAll == "yes") {
+        // Modify all details
+        cout << "Enter new First Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
+        cin >> newFirstName;
+        cout << "Enter new Last Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
+        cin >> newLastName;
+        cout << "Enter new Email: ";
+        cin >> newEmail;
+        cout << "Enter new Phone: ";
+        cin >> newPhone;
+    } else {
+        // Modify only specific fields
+        char choice;
+        cout << "Do you want to modify First Name? (y/n): ";
+        cin >> choice;
+        if (choice == 'y') {
+            cout << "Enter new First Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
+            cin >> newFirstName;
+        }
+
+        cout << "Do you want to modify Last Name? (y/n): ";
+        cin >> choice;
+        if (choice == 'y') {
+            cout << "Enter new Last Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
+            cin >> newLastName;
+        }
+
+        cout << "Do you want to modify Email? (y/n): ";
+        cin >> choice;
+        if (choice == 'y') {
+            cout << "Enter new Email: ";
+            cin >> newEmail;
+        }
+
+        cout << "Do you want to modify Phone? (y/n): ";
+        cin >> choice;
+        if (choice == 'y') {
+            cout << "Enter new Phone: ";
+            cin >> newPhone;
+            }
+        }
+
+        // validate the new details like a new customer's
+        if (!isValidFirstName(newFirstName) || !isValidLastName(newLastName) || !isValidEmail(newEmail) ||
+            !isValidPhone(newPhone)) {
+            cout << "Invalid customer details, nothing changed." << endl;
+            return;
+        }
+        Customer* duplicate = findDuplicate(newFirstName, newLastName);
+        if (duplicate && duplicate != customer) {
+            cout << "Another customer has the same name, nothing changed." << endl;
+            return;
+        }
+        string conflict = contactConflict(newEmail, newPhone, customer->customerId);
+        if (!conflict.empty()) {
+            cout << "Customer not updated: " << conflict << "!" << endl;
+            return;
+        }
+
+        updateCustomer(customer->customerId, {newFirstName, newLastName, newEmail, newPhone});
+        cout << "Customer details updated!" << endl;
+    } 
+
+    
+    // Delete a customer
+    void deleteCustomer() {
+        string firstName, lastName;
+        cout << "Enter first name or last name of the customer to delete: ";
+        cin >> firstName;
+
+        vector<Customer*> matchingCustomers = searchCustomersRanked(firstName, PICK_RESULT_LIMIT);
+
+        if (matchingCustomers.empty()) {
+            cout << "No customer found with that name." << endl;
+            return;
+        }
+
+        cout << "Found the following customers:\n";
+        for (int i = 0; i < matchingCustomers.size(); ++i) {
+            cout << i + 1 << ". " << matchingCustomers[i]->firstName << " " << matchingCustomers[i]->lastName << endl;
+        }
+
+        int choice;
+        cout << "Choose the index of the customer to delete (1 of " << matchingCustomers.size() << "): ";
+        cin >> choice;
+
+        if (choice < 1 || choice > matchingCustomers.size()) {
+            cout << "Invalid choice!" << endl;
+            return;
+        }
+
+        // Remove the customer
+        removeCustomer(matchingCustomers[choice - 1]->customerId);
+        cout << "Customer deleted!" << endl;
+    }
+
+    // Add interaction to customer
+    void addInteraction(int customerId, string type, string date) {
+        if (const char* invalid = invalidInteractionReason(type, date)) {
+            cout << "Interaction not added: " << invalid << "!" << endl;
+            return;
+        }
+        if (recordInteraction(customerId, type, date)) {
+            cout << "Interaction added!" << endl;
+        } else {
+            cout << "Customer not found!" << endl;
+        }
+    }
+
+    // Display interactions of a customer
+    void displayInteractions(int customerId) {
+        Customer* customer = findCustomerById(customerId);
+        if (!customer) {
+            cout << "Customer not found!" << endl;
+            return;
+        }
+        loadHistory(*customer);
+
+        TableRenderer table(cout);
+        if (customer->interactionCount == 0) {
+            // an empty history is shown as the default interaction
+            table.append("Type: No Interaction, Date: N/A");
+            table.endRow();
+        }
+        for (uint32_t i = 0; i < customer->interactionCount; ++i) {
+            const Interaction& interaction = interactionArena[customer->firstInteraction + i];
+            appendInteractionLabels(table, interactionTypes[interaction.type], dateText(interaction.date));
+            table.endRow();
+        }
+    }
+
+    // Report: interactions of a type (or "all") per week, month, quarter or year
+    void reportCountsByPeriod(const string& type, Analytics::Period period) {
+        uint32_t typeId;
+        if (!reportType(type, typeId)) {
+            return;
+        }
+        map<int32_t, uint64_t> counts = Analytics::countByPeriod(interactionColumns(), typeId, period);
+        cout << setw(20) << "Period" << setw(14) << "Interactions" << endl;
+        for (auto& count : counts) {
+            cout << setw(20) << Analytics::periodLabel(count.first, period) << setw(14) << count.second << '\n';
+        }
+        if (counts.empty()) {
+            cout << "No dated interactions of type " << type << "." << endl;
+        }
+    }
+
+    // Report: interactions of each type dated from "from" up to "to" (both dd/mm/yyyy, inclusive)
+    void reportCountsByType(const string& from, const string& to) {
+        int32_t first, last;
+        if (!parseDayNumber(from, first) || !parseDayNumber(to, last)) {
+            cout << "Invalid date, use dd/mm/yyyy." << endl;
+            return;
+        }
+        const InteractionColumns& columns = interactionColumns();  // interns the types of unloaded histories first
+        vector<uint64_t> counts = Analytics::countByType(columns, interactionTypes.size(), first, last + 1);
+        cout << setw(20) << "Type" << setw(14) << "Interactions" << endl;
+        for (size_t type = 0; type < counts.size(); ++type) {
+            if (counts[type] > 0) {
+                cout << setw(20) << interactionTypes[type] << setw(14) << counts[type] << '\n';
+            }
+        }
+    }
+
+    // Report: customers without an interaction of a type (or "all") in the last months
+    void reportInactive(int months, const string& type) {
+        uint32_t typeId;
+        if (!reportType(type, typeId)) {
+            typeId = interactionTypes.size();  // a type nobody has: every customer is inactive
+        }
+
+        // same day of the month, months ago (or the last day of that month)
+        int y, m, d;
+        civilFromDayNumber(todayDayNumber(), y, m, d);
+        int month = y * 12 + (m - 1) - months;
+        int32_t since;
+        char text[32];
+        do {
+            snprintf(text, sizeof(text), "%02d/%02d/%04d", d--, month % 12 + 1, month / 12);
+        } while (!parseDayNumber(text, since));
+
+        vector<uint32_t> inactive = Analytics::inactiveSince(interactionColumns(), typeId, since);
+        cout << inactive.size() << " of " << customers.size() << " customers have no "
+            << (type == "all" ? "interaction" : type) << " since " << formatDayNumber(since) << "." << endl;
+
+        TableRenderer table(cout);
+        renderCustomerHeader(table);
+        for (size_t i = 0; i < inactive.size() && i < REPORT_ROW_LIMIT; ++i) {
+            renderCustomer(table, customers[inactive[i]], "No Interaction, Date: N/A");
+        }
+        if (inactive.size() > REPORT_ROW_LIMIT) {
+            table.append("...");
+            table.endRow();
+        }
+    }
+
+    // Report: interactions of a type (or "all") dated from "from" up to "to"
+    // (both dd/mm/yyyy, inclusive), by date, through the time index
+    void reportAgenda(const string& from, const string& to, const string& type) {
+        int32_t first, last;
+        if (!parseDayNumber(from, first) || !parseDayNumber(to, last)) {
+            cout << "Invalid date, use dd/mm/yyyy." << endl;
+            return;
+        }
+        uint32_t typeId;
+        if (!reportType(type, typeId, true)) {
+            return;
+        }
+
+        Stats::Timer timer(Stats::TIME_QUERY);
+        TableRenderer table(cout);
+        table.cell("Date", 12);
+        table.cell("Type", 15);
+        renderCustomerColumnsHeader(table);
+        size_t found = 0;
+        timeIndex.forEachBetween(first, last, [&](int32_t day, const TimeIndex::Entry& entry) {
+            if (typeId != Analytics::ANY_TYPE && entry.type != typeId) {
+                return;
+            }
+            if (found++ < REPORT_ROW_LIMIT) {
+                table.cell(formatDayNumber(day), 12);
+                table.cell(interactionTypes[entry.type], 15);
+                renderCustomerColumns(table, *findCustomerById(entry.customerId));
+            }
+        });
+        if (found > REPORT_ROW_LIMIT) {
+            table.append("...");
+            table.endRow();
+        }
+        table.flush();
+        cout << found << " " << (type == "all" ? "interaction" : type) << (found == 1 ? "" : "s") << " from "
+            << from << " to " << to << "." << endl;
+    }
+
+    // Report: the agenda of the next days, today included
+    void reportUpcoming(int days, const string& type) {
+        int32_t today = todayDayNumber();
+        reportAgenda(formatDayNumber(today), formatDayNumber(today + max(days, 1) - 1), type);
+    }
+
+    // Report: customers whose last dated interaction is more than days old
+    // (or who have none), least recently touched first, through the time index
+    void reportLastTouch(int days) {
+        const TimeIndex& index = interactionTimeIndex();
+        int32_t since = todayDayNumber() - days;
+
+        Stats::Timer timer(Stats::TIME_QUERY);
+        TableRenderer table(cout);
+        table.cell("Last Touch", 12);
+        renderCustomerColumnsHeader(table);
+        size_t found = 0;
+        index.forEachTouchedBefore(since, [&](int customerId, int32_t lastTouch) {
+            if (found++ < REPORT_ROW_LIMIT) {
+                table.cell(lastTouch == TimeIndex::NEVER ? "Never" : formatDayNumber(lastTouch), 12);
+                renderCustomerColumns(table, *findCustomerById(customerId));
+            }
+        });
+        if (found > REPORT_ROW_LIMIT) {
+            table.append("...");
+            table.endRow();
+        }
+        table.flush();
+        cout << found << " of " << customerCount() << " customers have no dated interaction since "
+            << formatDayNumber(since) << "." << endl;
+    }
+
+    // Look for customers recorded more than once (see Deduplicator) and write
+    // the merge candidates to outFile, one pair per line. Customers linked by
+    // candidate pairs form a group; groups are numbered in book order and
+    // their pairs listed best first. Returns the number of pairs.
+    size_t findDuplicates(const string& outFile, double threshold) {
+        Stats::Timer timer(Stats::DEDUPE);
+        auto start = chrono::steady_clock::now();
+        Deduplicator::Result result = Deduplicator::findCandidates(customers, threshold);
+
+        // union-find over the pairs; a group's root is its smallest customer ID
+        unordered_map<int, int> parent;
+        auto root = [&parent](int id) {
+            auto it = parent.find(id);
+            while (it != parent.end() && it->second != id) {
+                id = it->second;
+                it = parent.find(id);
+            }
+            return id;
+        };
+        for (const auto& candidate : result.candidates) {
+            int a = root(candidate.customerId);
+            int b = root(candidate.duplicateId);
+            parent[max(a, b)] = min(a, b);
+            parent.emplace(min(a, b), min(a, b));
+        }
+        vector<pair<int, const Deduplicator::Candidate*>> ordered;
+        for (const auto& candidate : result.candidates) {
+            ordered.emplace_back(root(candidate.customerId), &candidate);
+        }
+        sort(ordered.begin(), ordered.end(), [](const auto& a, const auto& b) {
+            return a.first != b.first ? a.first < b.first : a.second->score > b.second->score;
+        });
+
+        string buffer = "Group,Score,Customer ID";
+        for (const FieldSchema& field : CUSTOMER_FIELDS) {
+            buffer += string(",") + field.name;
+        }
+        buffer += ",Duplicate ID";
+        for (const FieldSchema& field : CUSTOMER_FIELDS) {
+            buffer += string(",Duplicate ") + field.name;
+        }
+        buffer += '\n';
+        auto appendCustomer = [&buffer](const Customer& customer) {
+            buffer += to_string(customer.customerId);
+            forEachField([&](auto f) {
+                buffer += ',';
+                buffer += fieldValue(customer, f);
+            });
+        };
+        ofstream file(outFile, ios::binary | ios::trunc);
+        size_t groups = 0;
+        uint64_t written = 0;
+        char score[16];
+        for (size_t i = 0; i < ordered.size(); ++i) {
+            groups += i == 0 || ordered[i].first != ordered[i - 1].first;
+            const Customer& customer = *findCustomerById(ordered[i].second->customerId);
+            const Customer& duplicate = *findCustomerById(ordered[i].second->duplicateId);
+            snprintf(score, sizeof(score), "%.3f", ordered[i].second->score);
+            buffer += to_string(groups) + ',' + score + ',';
+            appendCustomer(customer);
+            buffer += ',';
+            appendCustomer(duplicate);
+            buffer += '\n';
+            if (i < 10) {
+                cout << "Group " << groups << ": " << customer.customerId << " " << customer.firstName << " "
+                    << customer.lastName << " <-> " << duplicate.customerId << " " << duplicate.firstName << " "
+                    << duplicate.lastName << " (" << score << ")" << endl;
+            }
+            if (buffer.size() > (1 << 20)) {
+                file.write(buffer.data(), buffer.size());
+                written += buffer.size();
+                buffer.clear();
+            }
+        }
+        file.write(buffer.data(), buffer.size());
+        written += buffer.size();
+        Stats::add(Stats::BYTES_WRITTEN, written);
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Compared " << result.comparisons << " pairs in " << result.blocks << " blocks of "
+            << customerCount() << " customers: " << ordered.size() << " merge candidates in " << groups
+            << " groups, written to " << outFile << " (" << fixed << setprecision(2) << seconds << " s)" << endl;
+        return ordered.size();
+    }
+
+    // Benchmark suite: for each book size, generate a synthetic customers.csv
+    // and time loading, saving, lookups, name searches and every mutation on it.
+    // Results go to the console and, as JSON, to outFile.
+    static void benchmarkSuite(const vector<size_t>& sizes, const string& outFile) {
+        string directory = (filesystem::temp_directory_path() / "insurance_crm_bench").string();
+        filesystem::create_directories(directory);
+        string dataFile = directory + "/customers.csv";
+
+        struct Result {
+            size_t customers;
+            string operation;
+            size_t ops;
+            double seconds;
+        };
+        vector<Result> results;
+        auto record = [&results](size_t customers, const char* operation, size_t ops,
+                                 chrono::steady_clock::time_point start) {
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            results.push_back({customers, operation, ops, seconds});
+            cout << setw(10) << customers << setw(20) << operation << setw(10) << ops
+                << setw(16) << fixed << setprecision(1) << seconds * 1e9 / ops << " ns/op" << endl;
+        };
+        cout << setw(10) << "Customers" << setw(20) << "Operation" << setw(10) << "Ops" << setw(22) << "Time" << endl;
+        for (size_t count : sizes) {
+            for (const char* extension : {".journal", ".snap"}) {
+                filesystem::remove(directory + "/customers" + extension);
+            }
+            generateCustomersFile(dataFile, count, 2.0, 42);
+
+            auto start = chrono::steady_clock::now();
+            unique_ptr<CRM> crm(new CRM(dataFile));
+            record(count, "load_csv", 1, start);
+
+            start = chrono::steady_clock::now();
+            crm->saveToFile();
+            record(count, "save_csv", 1, start);
+
+            // random existing IDs, the same sequence for every size
+            uint64_t seed = 7;
+            auto randomId = [&seed, count]() {
+                seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                return (int)((seed >> 33) % count) + 1;
+            };
+
+            size_t sink = 0;
+            const size_t lookups = 100000;
+            start = chrono::steady_clock::now();
+            for (size_t i = 0; i < lookups; ++i) {
+                Customer* customer = crm->findCustomerById(randomId());
+                sink += customer ? customer->interactionCount : 0;
+            }
+            record(count, "lookup_id", lookups, start);
+
+            const size_t searches = 1000;
+            vector<string> names;
+            for (size_t i = 0; i < searches; ++i) {
+                names.emplace_back(crm->findCustomerById(randomId())->lastName);
+            }
+            start = chrono::steady_clock::now();
+            for (auto& name : names) {
+                sink += crm->findCustomersByName(name).size();
+            }
+            record(count, "search_name", searches, start);
+
+            start = chrono::steady_clock::now();
+            sink += crm->searchCustomersRanked("", 1).size();
+            record(count, "build_search_index", 1, start);
+
+            start = chrono::steady_clock::now();
+            for (auto& name : names) {
+                sink += crm->searchCustomersRanked(name.substr(0, 3), SEARCH_RESULT_LIMIT).size();
+            }
+            record(count, "search_prefix", searches, start);
+
+            // misspell every name by swapping two letters
+            for (auto& name : names) {
+                if (name.size() > 3) {
+                    swap(name[1], name[2]);
+                }
+            }
+            start = chrono::steady_clock::now();
+            for (auto& name : names) {
+                sink += crm->searchCustomersRanked(name, SEARCH_RESULT_LIMIT).size();
+            }
+            record(count, "search_fuzzy", searches, start);
+
+            start = chrono::steady_clock::now();
+            {
+                ofstream listing(directory + "/listing.txt", ios::binary);
+                crm->listCustomers(listing, 0, count);
+            }
+            record(count, "list_customers", 1, start);
+
+            const size_t mutations = 1000;
+            start = chrono::steady_clock::now();
+            for (size_t i = 0; i < mutations; ++i) {
+                sink += crm->insertCustomer({"Bench", "Customer_" + string(1, 'a' + i % 26) + string(1, 'a' + i / 26 % 26),
+                                             "bench" + to_string(i) + "@mail.com", to_string(3900000000ULL + i)});
+            }
+            record(count, "add_customer", mutations, start);
+
+            start = chrono::steady_clock::now();
+            for (size_t i = 0; i < mutations; ++i) {
+                int id = randomId();
+                Customer* customer = crm->findCustomerById(id);
+                if (customer) {
+                    CustomerValues values = customerValues(*customer);
+                    string email = "changed" + to_string(i) + "@mail.com";
+                    values[EMAIL_FIELD] = email;
+                    sink += crm->updateCustomer(id, values);
+                }
+            }
+            record(count, "modify_customer", mutations, start);
+
+            start = chrono::steady_clock::now();
+            for (size_t i = 0; i < mutations; ++i) {
+                sink += crm->recordInteraction(randomId(), "Contact", "17/10/2026");
+            }
+            record(count, "add_interaction", mutations, start);
+
+            size_t deletes = mutations;
+            start = chrono::steady_clock::now();
+            for (size_t i = 0; i < deletes; ++i) {
+                sink += crm->removeCustomer(randomId());
+            }
+            record(count, "delete_customer", deletes, start);
+
+            crm->compact(true);
+            crm.reset();
+            start = chrono::steady_clock::now();
+            crm.reset(new CRM(dataFile));
+            record(count, "load_snapshot", 1, start);
+
+            if (sink == 0) {
+                cout << "(nothing found)" << endl;
+            }
+        }
+        filesystem::remove_all(directory);
+
+        ofstream json(outFile);
+        json << "{\n  \"benchmark\": \"insurance_crm\",\n  \"format_version\": 1,\n"
+            << "  \"hardware_threads\": " << thread::hardware_concurrency() << ",\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            json << "    {\"customers\": " << results[i].customers << ", \"operation\": \"" << results[i].operation
+                << "\", \"ops\": " << results[i].ops << ", \"seconds\": " << setprecision(9) << results[i].seconds
+                << ", \"ns_per_op\": " << setprecision(1) << fixed << results[i].seconds * 1e9 / results[i].ops
+                << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+            json.unsetf(ios::fixed);
+        }
+        json << "  ]\n}\n";
+        cout << "Results written to " << outFile << endl;
+    }
+
+    // Import into an empty book in directory JSON records whose interaction
+    // types and dates carry customers.csv and journal delimiters, next to a
+    // valid one, then reload the saved customers.csv. Only the valid record
+    // may come back, with its history intact. Returns false otherwise.
+    static bool checkHostileImport(const string& directory) {
+        string dataFile = directory + "/hostile.csv";
+        string importFile = directory + "/hostile.ndjson";
+        const string history = "Type:Meeting,Date:01/01/2024|Type:Call,Date:next week";
+        {
+            ofstream records(importFile, ios::binary);
+            records << R"({"firstName":"Anna","lastName":"Rossi","email":"anna@example.com","phone":"3331000001",)"
+                    << R"("interactions":[{"type":"Call\nMario,Rossi,x@example.com,3331000009,7,","date":"01/01/2024"}]})" << '\n'
+                    << R"({"firstName":"Bruno","lastName":"Verdi","email":"bruno@example.com","phone":"3331000002",)"
+                    << R"("interactions":[{"type":"Call","date":"01/01/2024|Type:Meeting,Date:02/01/2024"}]})" << '\n'
+                    << R"({"firstName":"Carla","lastName":"Neri","email":"carla@example.com","phone":"3331000003",)"
+                    << R"("interactions":[{"type":"Call\tI\t1","date":"01/01/2024"},{"type":" ","date":"01/01/2024"}]})" << '\n'
+                    << R"({"firstName":"Dario","lastName":"Blu","email":"dario@example.com","phone":"3331000004",)"
+                    << R"("interactions":[{"type":"Meeting","date":"01/01/2024"},{"type":"Call","date":"next week"}]})" << '\n';
+        }
+        size_t imported = CRM(dataFile).importFile(importFile, true);
+        CRM reloaded(dataFile);
+        const Customer* customer = reloaded.customerCount() == 1 ? &reloaded.customers.front() : nullptr;
+        string reloadedHistory;
+        if (customer) {
+            reloaded.appendHistory(reloadedHistory, *customer);
+        }
+        if (imported != 1 || !customer || customer->firstName != "Dario" || reloadedHistory != history) {
+            cerr << "hostile import: " << imported << " records imported, " << reloaded.customerCount()
+                << " customers reloaded from " << dataFile << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Export and import throughput of each file format on a generated book.
+    // Imports go into an empty book, so they include validation and the
+    // save of the imported customers; their rows/s count the accepted rows.
+    // Returns the number of rows rejected by the imports, plus one if the
+    // hostile record check (see checkHostileImport) fails; 0 when all is well.
+    static size_t benchmarkFormats(size_t count) {
+        string directory = (filesystem::temp_directory_path() / "insurance_crm_formats").string();
+        filesystem::remove_all(directory);
+        filesystem::create_directories(directory);
+        size_t failures = checkHostileImport(directory) ? 0 : 1;
+        generateCustomersFile(directory + "/book.csv", count, 2.0, 42);
+
+        unique_ptr<CRM> book(new CRM(directory + "/book.csv"));
+
+        cout << setw(20) << "Operation" << setw(14) << "Time (ms)" << setw(12) << "MB/s" << setw(14) << "Rows/s" << endl;
+        auto timed = [&](const string& name, const string& fileName, const function<size_t()>& run) {
+            auto start = chrono::steady_clock::now();
+            size_t rows = run();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            double megabytes = filesystem::file_size(fileName) / 1e6;
+            cout << setw(20) << name << setw(14) << fixed << setprecision(1) << seconds * 1e3
+                << setw(12) << megabytes / seconds << setw(14) << setprecision(0) << rows / seconds << endl;
+        };
+
+        const char* extensions[3] = {".csv", ".ndjson", ".json"};
+        for (const char* extension : extensions) {
+            string fileName = directory + "/export" + extension;
+            timed(string("export ") + (extension + 1), fileName, [&]() {
+                book->exportFile(fileName, true);
+                return book->customerCount();
+            });
+        }
+        book.reset();
+        size_t rejected = 0;
+        for (const char* extension : extensions) {
+            string fileName = directory + "/export" + extension;
+            for (const char* stale : {"/import.csv", "/import.journal"}) {
+                filesystem::remove(directory + stale);
+            }
+            timed(string("import ") + (extension + 1), fileName, [&]() {
+                CRM imported(directory + "/import.csv");
+                size_t accepted = imported.importFile(fileName, true);
+                if (accepted != count) {
+                    cerr << "import " << (extension + 1) << ": " << count - accepted << " of " << count
+                        << " rows rejected" << endl;
+                    rejected += count - accepted;
+                }
+                return accepted;
+            });
+        }
+        filesystem::remove_all(directory);
+        return rejected + failures;
+    }
+
+    // Load and save times of a generated book kept in customers.csv, then
+    // sharded by ranges of width customer IDs: a full load, and a save after
+    // adding one customer and after modifying one in the first shard.
+    static void benchmarkShards(size_t count, int width) {
+        string directory = (filesystem::temp_directory_path() / "insurance_crm_shards").string();
+        filesystem::remove_all(directory);
+        filesystem::create_directories(directory);
+        string dataFile = directory + "/customers.csv";
+        generateCustomersFile(dataFile, count, 2.0, 42);
+
+        unique_ptr<CRM> crm;
+        cout << setw(26) << "Operation" << setw(14) << "Time (ms)" << setw(14) << "MB written" << endl;
+        auto timed = [&](const string& name, const function<void()>& run) {
+            uint64_t written = Stats::total(Stats::BYTES_WRITTEN);
+            auto start = chrono::steady_clock::now();
+            run();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << setw(26) << name << setw(14) << fixed << setprecision(1) << seconds * 1e3
+                << setw(14) << (Stats::total(Stats::BYTES_WRITTEN) - written) / 1e6 << endl;
+        };
+        size_t serial = 0;
+        auto addOne = [&]() {
+            serial++;
+            crm->insertCustomer({"Mario", "Shard" + string(serial, 'x'), "shard" + to_string(serial) + "@example.com",
+                                 to_string(5000000000ULL + serial)});
+            crm->compact();
+        };
+        auto modifyFirst = [&]() {
+            const Customer& customer = crm->customers.front();
+            CustomerValues values = customerValues(customer);
+            string phone = to_string(6000000000ULL + ++serial);
+            values[PHONE_FIELD] = phone;
+            crm->updateCustomer(customer.customerId, values);
+            crm->compact();
+        };
+
+        for (const char* layout : {"csv", "shards"}) {
+            timed(string("load ") + layout, [&]() {
+                crm.reset();
+                crm.reset(new CRM(dataFile));
+            });
+            timed(string("save after 1 add ") + layout, addOne);
+            timed(string("save after 1 modify ") + layout, modifyFirst);
+            if (string(layout) == "csv") {
+                timed("shard " + to_string(width), [&]() { crm->reshard(width); });
+            }
+        }
+        cout << crm->shardCount() << " shards of " << width << " customer IDs" << endl;
+        crm.reset();
+        filesystem::remove_all(directory);
+    }
+
+    // Stress test of the read views: one writer thread adds, modifies and
+    // deletes customers and records interactions (journaled, so the book is
+    // also compacted and saved meanwhile), while the reader threads take
+    // views and scan them. Each scan must match the book as it was when the
+    // view was taken (a digest of every customer, kept up to date by the
+    // writer) and a second scan, while the writer goes on, must find the view
+    // unchanged. Returns 1 when a view was inconsistent.
+    static int stressReadViews(size_t count, double seconds, int readers) {
+        string directory = (filesystem::temp_directory_path() / "insurance_crm_stress").string();
+        filesystem::remove_all(directory);
+        filesystem::create_directories(directory);
+        generateCustomersFile(directory + "/customers.csv", count, 2.0, 42);
+        unique_ptr<CRM> crm(new CRM(directory + "/customers.csv"));
+
+        // sum of the digests of the customers, which does not depend on their order
+        struct Summary {
+            size_t customers = 0;
+            uint64_t digest = 0;
+            uint64_t version = 0;
+        };
+        auto digestOf = [](const auto& customer, const auto& book) {
+            string text = to_string(customer.customerId);
+            forEachField([&](auto f) {
+                text += '\t';
+                text += fieldValue(customer, f);
+            });
+            book.visitInteractions(customer, [&text](string_view type, string_view date) {
+                text += '\n';
+                text += type;
+                text += '\t';
+                text += date;
+            });
+            return fnv1a(text.data(), text.size());
+        };
+
+        shared_mutex bookLock;  // shared while a view is taken, exclusive for the writer
+        Summary current;
+        for (const Customer& customer : crm->customers) {
+            if (!customer.deleted) {
+                current.digest += digestOf(customer, *crm);
+            }
+        }
+        current.customers = crm->customerCount();
+        current.version = crm->version();
+
+        atomic<bool> done(false);
+        size_t writes = 0;
+        thread writer([&]() {
+            uint64_t seed = 42;
+            size_t serial = 0;
+            while (!done) {
+                unique_lock<shared_mutex> writeLock(bookLock);
+                for (int op = 0; op < 16; ++op) {
+                    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                    uint32_t random = (uint32_t)(seed >> 33);
+                    int id = 1 + random / 100 % (crm->nextCustomerId - 1);
+                    Customer* customer = crm->findCustomerById(id);
+                    uint32_t kind = random % 100;
+                    if (kind >= 85) {
+                        // a new customer, with a name made unique by a serial number in letters
+                        string lastName = "Stress";
+                        for (size_t n = ++serial; n > 0; n /= 26) {
+                            lastName += (char)('a' + n % 26);
+                        }
+                        id = crm->insertCustomer({"Mario", lastName, "stress" + to_string(serial) + "@example.com",
+                                                  to_string(4000000000ULL + serial)});
+                        customer = crm->findCustomerById(id);
+                        current.customers++;
+                    } else if (!customer) {
+                        continue;
+                    } else if (kind >= 75) {
+                        current.digest -= digestOf(*customer, *crm);
+                        crm->removeCustomer(id);
+                        current.customers--;
+                        customer = nullptr;
+                    } else if (kind >= 55) {
+                        current.digest -= digestOf(*customer, *crm);
+                        ++serial;
+                        CustomerValues values = customerValues(*customer);
+                        string email = "stress" + to_string(serial) + "@example.com";
+                        string phone = to_string(4000000000ULL + serial);
+                        values[EMAIL_FIELD] = email;
+                        values[PHONE_FIELD] = phone;
+                        crm->updateCustomer(id, values);
+                        customer = crm->findCustomerById(id);
+                    } else {
+                        current.digest -= digestOf(*customer, *crm);
+                        crm->recordInteraction(id, "Contact", formatDayNumber(738000 + random % 1000));
+                        customer = crm->findCustomerById(id);
+                    }
+                    if (customer) {
+                        current.digest += digestOf(*customer, *crm);
+                    }
+                    writes++;
+                }
+                current.version = crm->version();
+            }
+        });
+
+        atomic<size_t> views(0), scanned(0), inconsistent(0);
+        atomic<uint64_t> viewNanoseconds(0);
+        vector<thread> scanners;
+        auto deadline = chrono::steady_clock::now() + chrono::duration<double>(seconds);
+        for (int r = 0; r < readers; ++r) {
+            scanners.emplace_back([&]() {
+                while (chrono::steady_clock::now() < deadline) {
+                    ReadView view;
+                    Summary expected;
+                    {
+                        auto start = chrono::steady_clock::now();
+                        shared_lock<shared_mutex> readLock(bookLock);
+                        view = crm->readView();
+                        expected = current;
+                        viewNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+                    }
+                    Summary seen[2];
+                    for (Summary& scan : seen) {
+                        view.forEach([&](const ReadView::Record& record) {
+                            scan.customers++;
+                            scan.digest += digestOf(record, view);
+                        });
+                    }
+                    if (view.version() != expected.version || view.size() != expected.customers ||
+                        seen[0].customers != expected.customers || seen[0].digest != expected.digest ||
+                        seen[1].customers != seen[0].customers || seen[1].digest != seen[0].digest) {
+                        inconsistent++;
+                    }
+                    views++;
+                    scanned += seen[0].customers;
+                }
+            });
+        }
+        this_thread::sleep_until(deadline);
+        for (thread& scanner : scanners) {
+            scanner.join();
+        }
+        done = true;
+        writer.join();
+        crm->commit();
+
+        cout << "Writes: " << writes << " (" << fixed << setprecision(0) << writes / seconds << "/s)" << endl;
+        cout << "Views: " << views << " taken by " << readers << " readers, " << setprecision(2)
+            << viewNanoseconds / 1e6 / max<size_t>(views, 1) << " ms each (lock wait included), "
+            << setprecision(0) << scanned / seconds << " customers/s scanned (twice each)" << endl;
+        cout << "Inconsistent views: " << inconsistent << endl;
+        crm.reset();
+        filesystem::remove_all(directory);
+        return inconsistent > 0 ? 1 : 0;
+    }
+
+    // Micro-benchmark of the ID and name indexes against the linear scans they replaced
+    static void benchmarkLookups() {
+        const char* firstNames[] = {"Mario", "Franco", "Luca", "Giulia", "Anna", "Marco", "Sara", "Paolo",
+                                    "Elena", "Andrea", "Chiara", "Davide", "Laura", "Matteo", "Silvia", "Stefano"};
+        const int scanQueries = 200;
+        const int indexQueries = 200000;
+
+        cout << setw(10) << "Customers" << setw(12) << "Lookup" << setw(16) << "Scan (ns/op)"
+            << setw(18) << "Indexed (ns/op)" << setw(10) << "Speedup" << endl;
+
+        for (int count : {10000, 100000, 1000000}) {
+            CRM crm("");
+            uint64_t seed = 42;
+            vector<string> lastNames;
+            for (int i = 0; i < count; ++i) {
+                // pseudo-random surname, mostly unique
+                string lastName(1, 'A' + (seed >> 33) % 26);
+                for (int c = 0; c < 7; ++c) {
+                    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                    lastName += (char)('a' + (seed >> 33) % 26);
+                }
+                lastNames.push_back(lastName);
+                crm.applyAddCustomer(i + 1, {firstNames[i % 16], lastName, "customer" + to_string(i) + "@mail.com",
+                                             "3400000000"});
+            }
+
+            size_t sink = 0;
+            auto nsPerOp = [](chrono::steady_clock::time_point start, int ops) {
+                return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops;
+            };
+
+            // lookup by ID
+            auto start = chrono::steady_clock::now();
+            for (int q = 0; q < scanQueries; ++q) {
+                int id = (int)((q * 7919ULL) % count) + 1;
+                for (auto& customer : crm.customers) {
+                    if (customer.customerId == id) {
+                        sink += customer.phone.size();
+                        break;
+                    }
+                }
+            }
+            double scanId = nsPerOp(start, scanQueries);
+
+            start = chrono::steady_clock::now();
+            for (int q = 0; q < indexQueries; ++q) {
+                sink += crm.findCustomerById((int)((q * 7919ULL) % count) + 1)->phone.size();
+            }
+            double indexedId = nsPerOp(start, indexQueries);
+
+            // lookup by last name
+            start = chrono::steady_clock::now();
+            for (int q = 0; q < scanQueries; ++q) {
+                const string& name = lastNames[(q * 7919ULL) % count];
+                for (auto& customer : crm.customers) {
+                    if (customer.firstName == name || customer.lastName == name) {
+                        sink += customer.phone.size();
+                    }
+                }
+            }
+            double scanName = nsPerOp(start, scanQueries);
+
+            start = chrono::steady_clock::now();
+            for (int q = 0; q < indexQueries; ++q) {
+                sink += crm.findCustomersByName(lastNames[(q * 7919ULL) % count]).size();
+            }
+            double indexedName = nsPerOp(start, indexQueries);
+
+            cout << fixed << setprecision(1)
+                << setw(10) << count << setw(12) << "id" << setw(16) << scanId
+                << setw(18) << indexedId << setw(9) << scanId / indexedId << "x" << endl
+                << setw(10) << count << setw(12) << "name" << setw(16) << scanName
+                << setw(18) << indexedName << setw(9) << scanName / indexedName << "x" << endl;
+            if (sink == 0) {
+                cout << "(no matches)" << endl;
+            }
+        }
+    }
+};
+
+// Main function to provide user interface
+#ifndef _WIN32
+// Lines read from a socket, buffered
+struct LineReader {
+    int fd;
+    string buffer;
+    size_t position = 0;
+
+    explicit LineReader(int fd) : fd(fd) {}
+
+    bool readLine(string& line) {
+        while (true) {
+            size_t end = buffer.find('\n', position);
+            if (end != string::npos) {
+                line.assign(buffer, position, end - position);
+                position = end + 1;
+                return true;
+            }
+            buffer.erase(0, position);
+            position = 0;
+            char chunk[64 << 10];
+            ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+            if (received <= 0) {
+                return false;
+            }
+            buffer.append(chunk, received);
+        }
+    }
+};
+
+bool sendAll(int fd, const string& data) {
+    for (size_t sent = 0; sent < data.size();) {
+        ssize_t count = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (count <= 0) {
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+// Socket for an address: a port number means TCP on localhost, anything else
+// is the path of a Unix socket. Returns -1 if it can't be opened.
+int openSocket(const string& address, bool listening) {
+    bool tcp = !address.empty() && all_of(address.begin(), address.end(), ::isdigit);
+    int port = 0;
+    if (tcp && (!parseInt(address, port) || port < 1 || port > 65535)) {
+        cerr << "Invalid port " << address << ": it must be between 1 and 65535" << endl;
+        return -1;
+    }
+    int fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int result;
+    if (tcp) {
+        sockaddr_in socketAddress{};
+        socketAddress.sin_family = AF_INET;
+        socketAddress.sin_port = htons((uint16_t)port);
+        socketAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (listening) {
+            int reuse = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            result = ::bind(fd, (sockaddr*)&socketAddress, sizeof(socketAddress));
+        } else {
+            int noDelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            result = connect(fd, (sockaddr*)&socketAddress, sizeof(socketAddress));
+        }
+    } else {
+        sockaddr_un socketAddress{};
+        socketAddress.sun_family = AF_UNIX;
+        strncpy(socketAddress.sun_path, address.c_str(), sizeof(socketAddress.sun_path) - 1);
+        if (listening) {
+            unlink(address.c_str());  // left behind by a previous server
+            result = ::bind(fd, (sockaddr*)&socketAddress, sizeof(socketAddress));
+        } else {
+            result = connect(fd, (sockaddr*)&socketAddress, sizeof(socketAddress));
+        }
+    }
+    if (result < 0 || (listening && listen(fd, 128) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Server mode: one CRM shared by any number of clients over a socket (see
+// openSocket). The protocol is one request per line, fields separated by tabs:
+//
+//   PING                          -> OK
+//   INFO                          -> OK <customers> <next customer ID>
+//   GET <id>                      -> OK 1, then the customer
+//   SEARCH <query> [limit]        -> OK <n>, then n customers, best match first
+//   LIST <offset> <limit>         -> OK <n>, then up to limit customers from offset, in book order
+//   STATS                         -> OK <n>, then n lines of JSON statistics (see Stats)
+//   ADD <first> <last> <email> <phone>       -> OK <new id>
+//   MOD <id> <first> <last> <email> <phone>  -> OK
+//   DEL <id>                      -> OK
+//   INT <id> <type> <date>        -> OK
+//   SHUTDOWN                      -> OK, then the server stops
+//
+// Errors are answered with ERR <reason>. A customer is sent as one line:
+// id, first name, last name, email, phone and the interactions as in the CSV.
+//
+// Each client has its own thread. Reads share the CRM under a reader lock;
+// writes are queued to a single writer thread, which applies every queued
+// write under one exclusive lock and flushes the journal once per batch.
+class CRMServer {
+public:
+    explicit CRMServer(CRM& crm) : crm(crm), stopping(false), writerDone(false) {}
+
+    // Serve until a client sends SHUTDOWN; false if the socket can't be opened
+    bool run(const string& address) {
+        listener = openSocket(address, true);
+        if (listener < 0) {
+            cout << "Error: could not listen on " << address << endl;
+            return false;
+        }
+        signal(SIGPIPE, SIG_IGN);  // a client that went away is a failed send, not a crash
+
+        crm.searchCustomersRanked("", 1);  // build the search index before the readers share it
+        thread writer(&CRMServer::writeLoop, this);
+        cout << "Serving " << crm.customerCount() << " customers on " << address << endl;
+
+        vector<thread> clients;
+        while (true) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) {
+                if (stopping) {
+                    break;
+                }
+                continue;
+            }
+            lock_guard<mutex> guard(clientsLock);
+            if (stopping) {
+                close(client);
+                break;
+            }
+            clientSockets.push_back(client);
+            clients.emplace_back(&CRMServer::serveClient, this, client);
+        }
+
+        {
+            // wake up the clients still connected
+            lock_guard<mutex> guard(clientsLock);
+            for (int client : clientSockets) {
+                shutdown(client, SHUT_RDWR);
+            }
+        }
+        for (thread& client : clients) {
+            client.join();
+        }
+        {
+            lock_guard<mutex> guard(queueLock);
+            writerDone = true;
+            queueChanged.notify_all();
+        }
+        writer.join();
+        close(listener);
+        if (!isdigit((unsigned char)address[0])) {
+            unlink(address.c_str());
+        }
+        return true;
+    }
 
-            // read the rest of the line as interactions data
-            getline(ss, interactionsData);
-            interactionsData = interactionsData.substr(interactionsData.find_first_not_of(", ")); // remove leading spaces and commas
+    // Load generator: for each number of concurrent clients, run a mix of
+    // lookups, searches and (writePercent %) interaction writes against a
+    // server for the given time, and report requests/s and latency percentiles
+    static void loadGenerator(const string& address, const vector<int>& clientCounts,
+                              double seconds, int writePercent) {
+        int probe = openSocket(address, false);
+        if (probe < 0) {
+            cout << "Error: no server on " << address << endl;
+            return;
+        }
+        LineReader probeReader(probe);
+        string reply;
+        sendAll(probe, "INFO\n");
+        probeReader.readLine(reply);
+        vector<string> info = splitFields(reply);
+        if (info.size() < 3 || info[0] != "OK" || stoi(info[2]) <= 1) {
+            cout << "Error: the server has no customers" << endl;
+            close(probe);
+            return;
+        }
+        int maxId = stoi(info[2]) - 1;
 
-            // Create a new customer object
-            Customer customer(firstName, lastName, email, phone, customerId);
+        // search prefixes taken from real last names
+        vector<string> prefixes;
+        for (int i = 0; i < 100; ++i) {
+            sendAll(probe, "GET\t" + to_string(1 + (i * 7919) % maxId) + "\n");
+            probeReader.readLine(reply);
+            if (reply == "OK\t1" && probeReader.readLine(reply)) {
+                vector<string> fields = splitFields(reply);
+                prefixes.push_back(fields[2].substr(0, 3));
+            }
+        }
+        close(probe);
+        if (prefixes.empty()) {
+            prefixes.push_back("a");
+        }
 
-            // Parse interactions data
-            stringstream interactionStream(interactionsData);
-            string interactionItem;
+        cout << setw(10) << "Clients" << setw(12) << "Requests" << setw(14) << "Requests/s"
+            << setw(14) << "p50 (us)" << setw(14) << "p99 (us)" << setw(10) << "Errors" << endl;
+        for (int clients : clientCounts) {
+            vector<vector<double>> latencies(clients);
+            vector<size_t> errors(clients, 0);
+            auto deadline = chrono::steady_clock::now() + chrono::duration<double>(seconds);
 
-            while (getline(interactionStream, interactionItem, '|')) {
-                string type, date;
-                size_t typePos = interactionItem.find("Type:");
-                size_t datePos = interactionItem.find("Date:");
+            auto start = chrono::steady_clock::now();
+            vector<thread> threads;
+            for (int c = 0; c < clients; ++c) {
+                threads.emplace_back([&, c]() {
+                    int fd = openSocket(address, false);
+                    if (fd < 0) {
+                        ++errors[c];
+                        return;
+                    }
+                    LineReader reader(fd);
+                    uint64_t seed = 1 + c;
+                    string line;
+                    while (chrono::steady_clock::now() < deadline) {
+                        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+                        uint32_t random = (uint32_t)(seed >> 33);
+                        int id = 1 + random % maxId;
+                        string request;
+                        if ((int)(random % 100) < writePercent) {
+                            request = "INT\t" + to_string(id) + "\tContact\t17/10/2026\n";
+                        } else if (random % 2) {
+                            request = "GET\t" + to_string(id) + "\n";
+                        } else {
+                            request = "SEARCH\t" + prefixes[random / 100 % prefixes.size()] + "\t10\n";
+                        }
 
-                if (typePos != string::npos && datePos != string::npos) {
-                    type = interactionItem.substr(typePos + 5, datePos - typePos - 6); // Estract the type
-                    date = interactionItem.substr(datePos + 5);                        // Estract the date
-                    customer.interactions.push_back(Interaction(type, date));
-                }
+                        auto sent = chrono::steady_clock::now();
+                        if (!sendAll(fd, request) || !reader.readLine(line)) {
+                            ++errors[c];
+                            break;
+                        }
+                        // GET and SEARCH send the customers after OK <n>
+                        vector<string> fields = splitFields(line);
+                        if (fields[0] != "OK") {
+                            ++errors[c];
+                        }
+                        size_t rows = request[0] != 'I' && fields.size() > 1 ? stoul(fields[1]) : 0;
+                        for (size_t r = 0; r < rows; ++r) {
+                            reader.readLine(line);
+                        }
+                        latencies[c].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - sent).count());
+                    }
+                    close(fd);
+                });
+            }
+            for (thread& t : threads) {
+                t.join();
             }
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-            customers.push_back(customer);
-            nextCustomerId = max(nextCustomerId, customerId + 1);
+            vector<double> all;
+            size_t errorCount = 0;
+            for (int c = 0; c < clients; ++c) {
+                all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+                errorCount += errors[c];
+            }
+            sort(all.begin(), all.end());
+            auto percentile = [&all](double p) {
+                return all.empty() ? 0.0 : all[min(all.size() - 1, (size_t)(p * all.size()))];
+            };
+            cout << setw(10) << clients << setw(12) << all.size()
+                << setw(14) << fixed << setprecision(0) << all.size() / elapsed
+                << setw(14) << setprecision(1) << percentile(0.50) << setw(14) << percentile(0.99)
+                << setw(10) << errorCount << endl;
         }
     }
 
-    // Function to save customers to CSV file
-    void saveToFile() {
-        ofstream file("customers.csv");
+private:
+    CRM& crm;
+    shared_mutex crmLock;  // shared by the readers, exclusive for the writer
+    int listener;
+    atomic<bool> stopping;
 
-        // write the header
-        file << "First Name,Last Name,Email,Phone,Customer ID,Interactions" << endl;
+    mutex clientsLock;
+    vector<int> clientSockets;
 
-        for (auto& customer : customers) {
-            file << customer.firstName << "," 
-                << customer.lastName << "," 
-                << customer.email << "," 
-                << customer.phone << "," 
-                << customer.customerId << ",";
-
-            // manage interactions
-            bool firstInteraction = true;
-            for (size_t i = 0; i < customer.interactions.size(); ++i) {
-                // ignore the default interaction if there are other interactions
-                if (customer.interactions[i].type == "No Interaction" &&
-                    customer.interactions[i].date == "N/A" &&
-                    customer.interactions.size() > 1) {
-                    continue;
-                }
+    // A write waiting for the writer thread
+    struct PendingWrite {
+        vector<string> fields;
+        string reply;
+        bool done = false;
+    };
+    mutex queueLock;
+    condition_variable queueChanged;  // a write was queued, or a batch was applied
+    vector<PendingWrite*> queue;
+    bool writerDone;  // set once every client thread has finished
 
-                if (!firstInteraction) {
-                    file << "|"; // Add separator between interactions
-                }
-                file << "Type:" << customer.interactions[i].type 
-                    << ",Date:" << customer.interactions[i].date;
-                firstInteraction = false;
+    static vector<string> splitFields(const string& line) {
+        vector<string> fields;
+        size_t start = 0;
+        while (true) {
+            size_t end = line.find('\t', start);
+            fields.push_back(line.substr(start, end - start));
+            if (end == string::npos) {
+                return fields;
             }
-
-            file << endl;
+            start = end + 1;
         }
     }
 
-    // Add a new customer with input validation
-    void addCustomer() {
-        string firstName, lastName, email, phone;
-
-        // Loop until valid first name is provided
-        do {
-            cout << "Enter First Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
-            cin >> firstName;
-            if (!isValidFirstName(firstName)) {
-                cout << "Invalid first name format!" << endl;
-            }
-        } while (!isValidFirstName(firstName));  // Continue until the first name is valid
+    static bool parseId(const string& text, int& id) {
+        if (text.empty() || text.size() > 9 || !all_of(text.begin(), text.end(), ::isdigit)) {
+            return false;
+        }
+        id = stoi(text);
+        return true;
+    }
 
-        // Loop until valid last name is provided
-        do {
-            cout << "Enter Last Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
-            cin >> lastName;
-            if (!isValidLastName(lastName)) {
-                cout << "Invalid last name format!" << endl;
+    // A customer of the CRM, or a record of a read view (book is the view)
+    template <class Record, class Book>
+    static void appendCustomer(string& reply, const Record& customer, const Book& book) {
+        reply += to_string(customer.customerId);
+        forEachField([&](auto f) {
+            reply += '\t';
+            reply += fieldValue(customer, f);
+        });
+        reply += '\t';
+        // histories that are not loaded are read from their source: readers
+        // share the CRM and must not load them
+        size_t historyStart = reply.size();
+        size_t count = book.visitInteractions(customer, [&reply, historyStart](string_view type, string_view date) {
+            if (reply.size() > historyStart) {
+                reply += HISTORY_ITEM_SEPARATOR;
             }
-        } while (!isValidLastName(lastName));  // Continue until the last name is valid
+            appendHistoryItem(reply, type, date);
+        });
+        if (count == 0) {
+            reply += NO_INTERACTION;
+        }
+        reply += '\n';
+    }
 
-        // Loop until valid email is provided
-        do {
-            cout << "Enter Email: ";
-            cin >> email;
-            if (!isValidEmail(email)) {
-                cout << "Invalid email format!" << endl;
+    void serveClient(int client) {
+        LineReader reader(client);
+        string line;
+        while (!stopping && reader.readLine(line)) {
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
             }
-        } while (!isValidEmail(email));  // Continue until the email is valid
+            vector<string> fields = splitFields(line);
+            const string& command = fields[0];
 
-        // Loop until valid phone number is provided
-        do {
-            cout << "Enter Phone: ";
-            cin >> phone;
-            if (!isValidPhone(phone)) {
-                cout << "Invalid phone number format! It should be 10-15 digits." << endl;
+            string reply;
+            if (command == "ADD" || command == "MOD" || command == "DEL" || command == "INT") {
+                reply = write(fields);
+            } else if (command == "LIST") {
+                reply = list(fields);
+            } else if (command == "SHUTDOWN") {
+                sendAll(client, "OK\n");
+                stopping = true;
+                shutdown(listener, SHUT_RDWR);  // ends accept()
+                break;
+            } else {
+                shared_lock<shared_mutex> readLock(crmLock);
+                reply = read(fields);
             }
-        } while (!isValidPhone(phone));  // Continue until the phone number is valid
-
-        // Check for duplicates
-        for (auto& customer : customers) {
-            if (customer.firstName == firstName && customer.lastName == lastName) {
-                cout << "Customer already exists!" << endl;
-                return;
+            if (!sendAll(client, reply)) {
+                break;
             }
         }
 
-        // Add the new customer
-        Customer newCustomer(firstName, lastName, email, phone, nextCustomerId++);
-        
-        // add a default interaction if the customer has no interactions
-        if (newCustomer.interactions.empty()) {
-            newCustomer.interactions.push_back(Interaction("No Interaction, Date: N/A", "N/A"));
-        }
-
-        customers.push_back(newCustomer);
-        saveToFile();  // Save the new customer to file
-        cout << "Customer added successfully!" << endl;
+        lock_guard<mutex> guard(clientsLock);
+        clientSockets.erase(find(clientSockets.begin(), clientSockets.end(), client));
+        close(client);
     }
 
-    // Display all customers with their interactions
-    void displayCustomers() {
-        cout << setw(10) << "ID" << setw(20) << "First Name" << setw(20) << "Last Name" 
-            << setw(30) << "Email" << setw(15) << "Phone" << setw(50) << "Interactions" << endl;
-
-        for (auto& customer : customers) {
-            cout << setw(10) << customer.customerId 
-                << setw(20) << customer.firstName 
-                << setw(20) << customer.lastName 
-                << setw(30) << customer.email 
-                << setw(15) << customer.phone;
-
-            // Control if there are interactions different from "No Interaction"
-            bool hasNonDefaultInteraction = false;
-            string interactionsSummary;
-
-            for (auto& interaction : customer.interactions) {
-                if (interaction.type != "No Interaction") {
-                    if (!interactionsSummary.empty()) {
-                        interactionsSummary += " | ";  // separator between interactions
-                    }
-                    interactionsSummary += "Type: " + interaction.type + ", Date: " + interaction.date;
-                    hasNonDefaultInteraction = true;
-                }
+    // Requests that only read the CRM (called under the reader lock)
+    string read(const vector<string>& fields) {
+        const string& command = fields[0];
+        if (command == "PING") {
+            return "OK\n";
+        }
+        if (command == "INFO") {
+            return "OK\t" + to_string(crm.customerCount()) + '\t' + to_string(crm.nextCustomerId) + '\n';
+        }
+        if (command == "GET" && fields.size() == 2) {
+            Stats::Timer timer(Stats::FIND_BY_ID);
+            int id;
+            Customer* customer = parseId(fields[1], id) ? crm.findCustomerById(id) : nullptr;
+            if (!customer) {
+                return "ERR\tcustomer not found\n";
             }
-
-            // if there are valid interactions, display them
-            if (hasNonDefaultInteraction) {
-                cout << setw(50) << interactionsSummary << endl;
-            } else {
-                // else display "No Interaction" only once
-                cout << setw(50) << "No Interaction, Date: N/A" << endl;
+            string reply = "OK\t1\n";
+            appendCustomer(reply, *customer, crm);
+            return reply;
+        }
+        if (command == "STATS") {
+            string json = Stats::json();
+            return "OK\t" + to_string(count(json.begin(), json.end(), '\n')) + '\n' + json;
+        }
+        if (command == "SEARCH" && (fields.size() == 2 || fields.size() == 3)) {
+            int limit = CRM::SEARCH_RESULT_LIMIT;
+            if (fields.size() == 3 && !parseId(fields[2], limit)) {
+                return "ERR\tinvalid limit\n";
             }
+            vector<Customer*> matches = crm.searchCustomersRanked(fields[1], limit);
+            string reply = "OK\t" + to_string(matches.size()) + '\n';
+            for (Customer* customer : matches) {
+                appendCustomer(reply, *customer, crm);
+            }
+            return reply;
         }
+        return "ERR\tunknown request\n";
     }
 
-    // Search customers by name and display their details and interactions
-    void searchCustomers(string name) {
-        bool found = false;
+    // Customers in book order, from a read view: the reader lock is only held
+    // while the view is taken, so a long listing does not hold up the writer
+    string list(const vector<string>& fields) {
+        int offset, limit;
+        if (fields.size() != 3 || !parseId(fields[1], offset) || !parseId(fields[2], limit)) {
+            return "ERR\tinvalid request\n";
+        }
+        ReadView view;
+        {
+            shared_lock<shared_mutex> readLock(crmLock);
+            view = crm.readView();
+        }
+        Stats::Timer timer(Stats::LIST);
+        size_t end = min(view.size(), (size_t)offset + limit);
+        string reply = "OK\t" + to_string(end - min(end, (size_t)offset)) + '\n';
+        for (size_t i = offset; i < end; ++i) {
+            appendCustomer(reply, view[i], view);
+        }
+        return reply;
+    }
 
-        // format the output
-        cout << setw(10) << "ID" << setw(20) << "First Name" << setw(20) << "Last Name" 
-            << setw(30) << "Email" << setw(15) << "Phone" << setw(50) << "Interactions" << endl;
+    // Hand a write to the writer thread and wait for its reply
+    string write(const vector<string>& fields) {
+        PendingWrite pending;
+        pending.fields = fields;
+        unique_lock<mutex> guard(queueLock);
+        queue.push_back(&pending);
+        queueChanged.notify_all();
+        queueChanged.wait(guard, [&pending]() { return pending.done; });
+        return pending.reply;
+    }
 
-        for (auto& customer : customers) {
-            if (customer.firstName == name || customer.lastName == name) {
-                cout << setw(10) << customer.customerId 
-                    << setw(20) << customer.firstName 
-                    << setw(20) << customer.lastName 
-                    << setw(30) << customer.email 
-                    << setw(15) << customer.phone;
-
-                bool hasValidInteraction = false;
-                string interactionsSummary;
-
-                // Verify if there are interactions different from "No Interaction"
-                for (auto& interaction : customer.interactions) {
-                    if (interaction.type != "No Interaction") {
-                        if (!interactionsSummary.empty()) {
-                            interactionsSummary += " | ";  // separator between interactions
-                        }
-                        interactionsSummary += "Type: " + interaction.type + ", Date: " + interaction.date;
-                        hasValidInteraction = true;
-                    }
+    void writeLoop() {
+        vector<PendingWrite*> batch;
+        while (true) {
+            {
+                unique_lock<mutex> guard(queueLock);
+                queueChanged.wait(guard, [this]() { return !queue.empty() || writerDone; });
+                if (queue.empty()) {
+                    return;
                 }
+                batch.swap(queue);
+            }
 
-                // if there are valid interactions, display them
-                if (hasValidInteraction) {
-                    cout << setw(50) << interactionsSummary << endl;
-                } else {
-                    // else display "No Interaction" only once
-                    cout << setw(50) << "Type: No Interaction, Date: N/A" << endl;
+            {
+                unique_lock<shared_mutex> writeLock(crmLock);
+                for (PendingWrite* pending : batch) {
+                    pending->reply = apply(pending->fields);
                 }
+            }
+            // one journal commit per batch, without blocking the readers;
+            // the writes are acknowledged once they are durable
+            crm.commit();
 
-                found = true;
+            lock_guard<mutex> guard(queueLock);
+            for (PendingWrite* pending : batch) {
+                pending->done = true;
             }
+            batch.clear();
+            queueChanged.notify_all();
         }
+    }
 
-        if (!found) {
-            cout << "No customers found!" << endl;
+    // Requests that change the CRM (called by the writer thread only)
+    string apply(const vector<string>& fields) {
+        const string& command = fields[0];
+        int id = 0;
+        if ((command == "ADD" && fields.size() == 1 + CUSTOMER_FIELD_COUNT) ||
+            (command == "MOD" && fields.size() == 2 + CUSTOMER_FIELD_COUNT && parseId(fields[1], id))) {
+            CustomerValues values = valuesAt(fields, fields.size() - CUSTOMER_FIELD_COUNT);
+            string invalid;
+            {
+                Stats::Timer timer(Stats::VALIDATE);
+                invalid = invalidFieldReason(values);
+            }
+            if (!invalid.empty()) {
+                return "ERR\t" + invalid + "\n";
+            }
+            Customer* duplicate = crm.findDuplicate(values[FIRST_NAME_FIELD], values[LAST_NAME_FIELD]);
+            if (duplicate && duplicate->customerId != id) {
+                return "ERR\tduplicate customer\n";
+            }
+            string conflict = crm.contactConflict(values[EMAIL_FIELD], values[PHONE_FIELD], id);
+            if (!conflict.empty() && (command == "ADD" || crm.findCustomerById(id))) {
+                return "ERR\t" + conflict + "\n";
+            }
+            if (command == "ADD") {
+                return "OK\t" + to_string(crm.insertCustomer(values)) + '\n';
+            }
+            return crm.updateCustomer(id, values) ? "OK\n" : "ERR\tcustomer not found\n";
+        }
+        if (command == "DEL" && fields.size() == 2 && parseId(fields[1], id)) {
+            return crm.removeCustomer(id) ? "OK\n" : "ERR\tcustomer not found\n";
         }
+        if (command == "INT" && fields.size() == 4 && parseId(fields[1], id)) {
+            const char* invalid;
+            {
+                Stats::Timer timer(Stats::VALIDATE);
+                invalid = invalidInteractionReason(fields[2], fields[3]);
+            }
+            if (invalid) {
+                return "ERR\t" + string(invalid) + "\n";
+            }
+            return crm.recordInteraction(id, fields[2], fields[3]) ? "OK\n" : "ERR\tcustomer not found\n";
+        }
+        return "ERR\tinvalid request\n";
     }
+};
 
-    // Modify a customer's details
-    void modifyCustomer() {
-    string name;
-    cout << "Enter first name or last name of the customer to modify (blanks not allowed, use instead  ',  .,  - or  _ ): ";
-    cin >> name;  // user input for the name to search ( first or last name)
+// SIGINT, SIGTERM and SIGHUP are blocked in every thread and taken by a
+// watcher thread, which commits the journal of the registered CRM (outside
+// of a signal handler, so it may lock and wait) before the process exits
+mutex shutdownLock;
+CRM* shutdownCrm = nullptr;
 
-    vector<Customer*> matchingCustomers;
-    for (auto& customer : customers) {
-        if (customer.firstName == name || customer.lastName == name) {
-            matchingCustomers.push_back(&customer);
+// Call before any other thread is started: threads inherit the signal mask
+void watchShutdownSignals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    thread([signals]() {
+        int received = SIGTERM;
+        sigwait(&signals, &received);
+        lock_guard<mutex> guard(shutdownLock);
+        if (shutdownCrm) {
+            shutdownCrm->commit();
+            cout << "\nInterrupted: pending changes saved to the journal." << endl;
         }
-    }
+        _exit(128 + received);
+    }).detach();
+}
 
-    if (matchingCustomers.empty()) {
-        cout << "No customer found with that name." << endl;
-        return;
+// Registers a CRM with the signal watcher for the lifetime of the guard
+class ShutdownCommit {
+public:
+    explicit ShutdownCommit(CRM& crm) {
+        lock_guard<mutex> guard(shutdownLock);
+        shutdownCrm = &crm;
     }
 
-    cout << "Found the following customers:\n";
-    for (int i = 0; i < matchingCustomers.size(); ++i) {
-        cout << i + 1 << ". " << matchingCustomers[i]->firstName << " " << matchingCustomers[i]->lastName << endl;
+    ~ShutdownCommit() {
+        lock_guard<mutex> guard(shutdownLock);
+        shutdownCrm = nullptr;
     }
+};
+#endif
 
-    int choice;
-    cout << "Choose the correct index to modify the customer (1 of " << matchingCustomers.size() << "): ";
-    cin >> choice;
+int main(int argc, char* argv[]) {
+#ifndef _WIN32
+    watchShutdownSignals();
+#endif
 
-    if (choice < 1 || choice > matchingCustomers.size()) {
-        cout << "Invalid choice!" << endl;
-        return;
+    // periodic statistics dump, e.g. CRM_STATS_FILE=stats.json CRM_STATS_INTERVAL=10
+    if (const char* statsFile = getenv("CRM_STATS_FILE")) {
+        const char* interval = getenv("CRM_STATS_INTERVAL");
+        Stats::startPeriodicDump(statsFile, interval ? atof(interval) : 60.0);
     }
 
-    Customer* customer = matchingCustomers[choice - 1];
-
-    // Ask if the user wants to modify all or just specific fields
-    string modifyAll;
-    cout << "Do you want to modify all fields (First Name, Last Name, Email, Phone)? (yes/no): ";
-    cin >> modifyAll;
-
-    if (modifyAll == "yes") {
-        // Modify all details
-        string firstName, lastName, email, phone;
-
-        cout << "Enter new First Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
-        cin >> firstName;
-        cout << "Enter new Last Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
-        cin >> lastName;
-        cout << "Enter new Email: ";
-        cin >> email;
-        cout << "Enter new Phone: ";
-        cin >> phone;
-
-        customer->firstName = firstName;
-        customer->lastName = lastName;
-        customer->email = email;
-        customer->phone = phone;
-    } else {
-        // Modify only specific fields
-        char choice;
-        cout << "Do you want to modify First Name? (y/n): ";
-        cin >> choice;
-        if (choice == 'y') {
-            string newFirstName;
-            cout << "Enter new First Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
-            cin >> newFirstName;
-            customer->firstName = newFirstName;
-        }
-
-        cout << "Do you want to modify Last Name? (y/n): ";
-        cin >> choice;
-        if (choice == 'y') {
-            string newLastName;
-            cout << "Enter new Last Name (blanks not allowed, use instead  ',  .,  - or  _ ): ";
-            cin >> newLastName;
-            customer->lastName = newLastName;
-        }
-
-        cout << "Do you want to modify Email? (y/n): ";
-        cin >> choice;
-        if (choice == 'y') {
-            string newEmail;
-            cout << "Enter new Email: ";
-            cin >> newEmail;
-            customer->email = newEmail;
+    if (argc > 1 && string(argv[1]) == "bench-lookup") {
+        CRM::benchmarkLookups();
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "bench-validators") {
+        return benchmarkValidators() == 0 ? 0 : 1;
+    }
+    if (argc > 3 && string(argv[1]) == "generate") {
+        double meanInteractions = argc > 4 ? stod(argv[4]) : 2.0;
+        uint64_t seed = argc > 5 ? stoull(argv[5]) : 42;
+        double duplicatePercent = argc > 6 ? stod(argv[6]) : 0;
+        generateCustomersFile(argv[2], stoull(argv[3]), meanInteractions, seed, duplicatePercent);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "bench") {
+        // sizes as a comma-separated list, e.g. 1000,10000,100000; 10M is
+        // only run when listed (it needs about 16 GB, see README)
+        vector<size_t> sizes;
+        stringstream list(argc > 2 ? argv[2] : "1000,10000,100000,1000000");
+        string size;
+        while (getline(list, size, ',')) {
+            sizes.push_back(stoull(size));
         }
-
-        cout << "Do you want to modify Phone? (y/n): ";
-        cin >> choice;
-        if (choice == 'y') {
-            string newPhone;
-            cout << "Enter new Phone: ";
-            cin >> newPhone;
-            customer->phone = newPhone;
-            }
+        CRM::benchmarkSuite(sizes, argc > 3 ? argv[3] : "bench_results.json");
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "import") {
+        CRM crm;
+        crm.importFile(argv[2]);
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "export") {
+        CRM crm;
+        return crm.exportFile(argv[2]) ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "list") {
+        // list [out file, - for stdout] [offset] [limit]
+        string outFile = argc > 2 ? argv[2] : "-";
+        size_t offset = argc > 3 ? stoull(argv[3]) : 0;
+        size_t limit = argc > 4 ? stoull(argv[4]) : numeric_limits<size_t>::max();
+        CRM crm;
+        if (outFile == "-") {
+            crm.listCustomers(cout, offset, limit);
+            return 0;
         }
-
-        saveToFile();
-        cout << "Customer details updated!" << endl;
-    } 
-
-    
-    // Delete a customer
-    void deleteCustomer() {
-        string firstName, lastName;
-        cout << "Enter first name or last name of the customer to delete: ";
-        cin >> firstName;
-
-        vector<Customer*> matchingCustomers;
-        for (auto& customer : customers) {
-            if (customer.firstName == firstName || customer.lastName == firstName) {
-                matchingCustomers.push_back(&customer);
-            }
+        ofstream out(outFile, ios::binary);
+        if (!out) {
+            cout << "Error: could not open " << outFile << endl;
+            return 1;
         }
-
-        if (matchingCustomers.empty()) {
-            cout << "No customer found with that name." << endl;
-            return;
+        crm.listCustomers(out, offset, limit);
+        return 0;
+    }
+#ifndef _WIN32
+    if (argc > 1 && string(argv[1]) == "serve") {
+        // serve [socket path or TCP port on localhost]
+        CRM crm;
+        ShutdownCommit commitOnSignal(crm);
+        CRMServer server(crm);
+        if (!server.run(argc > 2 ? argv[2] : "customers.sock")) {
+            return 1;
         }
-
-        cout << "Found the following customers:\n";
-        for (int i = 0; i < matchingCustomers.size(); ++i) {
-            cout << i + 1 << ". " << matchingCustomers[i]->firstName << " " << matchingCustomers[i]->lastName << endl;
+        if (crm.needsCompaction() && !crm.compact()) {
+            return 1;
         }
-
-        int choice;
-        cout << "Choose the index of the customer to delete (1 of " << matchingCustomers.size() << "): ";
-        cin >> choice;
-
-        if (choice < 1 || choice > matchingCustomers.size()) {
-            cout << "Invalid choice!" << endl;
-            return;
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "loadgen") {
+        // loadgen [address] [client counts csv] [seconds per step] [write %]
+        vector<int> clientCounts;
+        stringstream list(argc > 3 ? argv[3] : "1,2,4,8,16,32");
+        string count;
+        while (getline(list, count, ',')) {
+            clientCounts.push_back(stoi(count));
         }
-
-        // Remove the customer
-        customers.erase(remove(customers.begin(), customers.end(), *matchingCustomers[choice - 1]), customers.end());
-        saveToFile();
-        cout << "Customer deleted!" << endl;
+        CRMServer::loadGenerator(argc > 2 ? argv[2] : "customers.sock", clientCounts,
+                                 argc > 4 ? stod(argv[4]) : 3.0, argc > 5 ? stoi(argv[5]) : 10);
+        return 0;
     }
-
-    // Add interaction to customer
-    void addInteraction(int customerId, string type, string date) {
-        Customer* customer = findCustomerById(customerId);
-        if (customer) {
-            customer->interactions.push_back(Interaction(type, date));
-            saveToFile();
-            cout << "Interaction added!" << endl;
+#endif
+    if (argc > 1 && string(argv[1]) == "bench-shards") {
+        // bench-shards [customers] [customers per shard]
+        CRM::benchmarkShards(argc > 2 ? stoull(argv[2]) : 1000000, argc > 3 ? stoi(argv[3]) : 100000);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "bench-schema") {
+        // bench-schema [customers]
+        return benchmarkSchema(argc > 2 ? stoull(argv[2]) : 1000000) == 0 ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "bench-formats") {
+        // bench-formats [customers]
+        return CRM::benchmarkFormats(argc > 2 ? stoull(argv[2]) : 1000000) == 0 ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "stress") {
+        // stress [customers] [seconds] [readers]
+        return CRM::stressReadViews(argc > 2 ? stoull(argv[2]) : 100000, argc > 3 ? atof(argv[3]) : 5.0,
+                                    argc > 4 ? stoi(argv[4]) : 4);
+    }
+    if (argc > 1 && string(argv[1]) == "bench-analytics") {
+        Analytics::benchmark(argc > 2 ? stoull(argv[2]) : 100000000);
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "report") {
+        string report = argv[2];
+        CRM crm;
+        if (report == "periods") {
+            // report periods [type|all] [week|month|quarter|year]
+            string period = argc > 4 ? argv[4] : "month";
+            const char* periods[4] = {"week", "month", "quarter", "year"};
+            int p = (int)(find(periods, periods + 4, period) - periods);
+            if (p == 4) {
+                cout << "Unknown period " << period << ", use week, month, quarter or year." << endl;
+                return 1;
+            }
+            crm.reportCountsByPeriod(argc > 3 ? argv[3] : "Contract", (Analytics::Period)p);
+        } else if (report == "types") {
+            // report types [from dd/mm/yyyy] [to dd/mm/yyyy]
+            crm.reportCountsByType(argc > 3 ? argv[3] : "01/01/0001", argc > 4 ? argv[4] : "31/12/9999");
+        } else if (report == "inactive") {
+            // report inactive [months] [type|all]
+            crm.reportInactive(argc > 3 ? stoi(argv[3]) : 12, argc > 4 ? argv[4] : "all");
+        } else if (report == "agenda" && argc > 4) {
+            // report agenda <from dd/mm/yyyy> <to dd/mm/yyyy> [type|all]
+            crm.reportAgenda(argv[3], argv[4], argc > 5 ? argv[5] : "all");
+        } else if (report == "upcoming") {
+            // report upcoming [days] [type|all]
+            crm.reportUpcoming(argc > 3 ? stoi(argv[3]) : 7, argc > 4 ? argv[4] : "all");
+        } else if (report == "last-touch") {
+            // report last-touch [days]
+            crm.reportLastTouch(argc > 3 ? stoi(argv[3]) : 90);
         } else {
-            cout << "Customer not found!" << endl;
+            cout << "Unknown report " << report << ", use periods, types, inactive, agenda <from> <to>, upcoming or last-touch." << endl;
+            return 1;
         }
+        return 0;
     }
-
-    // Display interactions of a customer
-    void displayInteractions(int customerId) {
-        Customer* customer = findCustomerById(customerId);
-        if (customer) {
-            if (customer->interactions.empty()) {
-                cout << "No interactions found for this customer." << endl;
-            } else if (customer->interactions.size() == 1 &&
-                    customer->interactions[0].type == "No Interaction" &&
-                    customer->interactions[0].date == "N/A") {
-                // shows only the default interaction if no other interactions are present
-                cout << "Type: " << customer->interactions[0].type
-                    << ", Date: " << customer->interactions[0].date << endl;
-            } else {
-                // shows all interactions except the default one
-                bool hasDisplayed = false;
-                for (auto& interaction : customer->interactions) {
-                    if (interaction.type == "No Interaction" && interaction.date == "N/A") {
-                        continue; // skip the default interaction
-                    }
-                    cout << "Type: " << interaction.type << ", Date: " << interaction.date << endl;
-                    hasDisplayed = true;
-                }
-                if (!hasDisplayed) {
-                    cout << "No valid interactions found for this customer." << endl;
-                }
+    if (argc > 1 && string(argv[1]) == "dedupe") {
+        // dedupe [out file] [score threshold]
+        CRM crm;
+        crm.findDuplicates(argc > 2 ? argv[2] : "duplicates.csv", argc > 3 ? stod(argv[3]) : 0.8);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "stats") {
+#ifndef _WIN32
+        if (argc > 2) {
+            // statistics of a running server
+            int server = openSocket(argv[2], false);
+            if (server < 0) {
+                cout << "Error: no server on " << argv[2] << endl;
+                return 1;
+            }
+            LineReader reader(server);
+            string line;
+            sendAll(server, "STATS\n");
+            reader.readLine(line);
+            size_t lines = line.rfind("OK\t", 0) == 0 ? stoul(line.substr(3)) : 0;
+            for (size_t i = 0; i < lines && reader.readLine(line); ++i) {
+                cout << line << '\n';
             }
+            close(server);
+            return 0;
+        }
+#endif
+        // cost of loading the book
+        CRM crm;
+        Stats::print();
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "shard") {
+        // shard <customers per shard, 0 to go back to customers.csv>
+        CRM crm;
+        int width = stoi(argv[2]);
+        if (width < 0 || !crm.reshard(width)) {
+            cout << "The book could not be resharded." << endl;
+            return 1;
+        }
+        if (width > 0) {
+            cout << "Book stored in " << crm.shardCount() << (crm.shardCount() == 1 ? " shard" : " shards") << " of " << width
+                << " customer IDs, listed in customers.shards" << endl;
         } else {
-            cout << "Customer not found!" << endl;
+            cout << "Book stored in customers.csv" << endl;
         }
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "snapshot") {
+        CRM crm;
+        if (crm.isSharded()) {
+            cout << "A sharded book has no snapshot (shard 0 moves it back to customers.csv)." << endl;
+            return 1;
+        }
+        if (!crm.compact(true)) {
+            return 1;
+        }
+        cout << "Snapshot written to customers.snap" << endl;
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "restore-csv") {
+        CRM crm;
+        if (crm.isSharded()) {
+            cout << "A sharded book has no snapshot (shard 0 moves it back to customers.csv)." << endl;
+            return 1;
+        }
+        if (!crm.restoreFromSnapshot()) {
+            cout << "No valid snapshot found in customers.snap" << endl;
+            return 1;
+        }
+        cout << "customers.csv rebuilt from customers.snap" << endl;
+        return 0;
     }
-};
 
-// Main function to provide user interface
-int main() {
     CRM crm;
+#ifndef _WIN32
+    ShutdownCommit commitOnSignal(crm);
+#endif
     int choice;
 
     do {
@@ -516,15 +7747,19 @@ int main() {
         cout << "6. Add Interaction\n";
         cout << "7. Display Interactions\n";
         cout << "8. Exit\n";
+        cout << "9. Statistics\n";
+        cout << "10. Find Duplicates\n";
+        cout << "11. Upcoming Interactions\n";
+        cout << "12. Customers Not Contacted Recently\n";
         
-        // Loop to ensure that the input is a valid number between 1 and 8
+        // Loop to ensure that the input is a valid number between 1 and 12
         while (true) {
-            cout << "Enter your choice (from 1 to 8): ";
+            cout << "Enter your choice (from 1 to 12): ";
             cin >> choice;
 
             // Checking whether the input is a valid number
-            if (cin.fail() || choice < 1 || choice > 8) {
-                cout << "Invalid choice! Please enter a number between 1 and 8." << endl;
+            if (cin.fail() || choice < 1 || choice > 12) {
+                cout << "Invalid choice! Please enter a number between 1 and 12." << endl;
                 
                 // Clean the error status of cin and ignore the rest of the input
                 cin.clear();  // Cleans up error status
@@ -543,7 +7778,7 @@ int main() {
                 break;
             case 3: {
                 string name;
-                cout << "Enter name to search (first name or last name): ";
+                cout << "Enter name to search (first name, last name or email, partial or misspelled): ";
                 cin >> name;
                 crm.searchCustomers(name);
                 break;
@@ -576,8 +7811,36 @@ int main() {
                 break;
             }
             case 8:
+                // fold the pending journal entries into customers.csv; the
+                // journal writer is drained either way when the CRM closes
+                if (crm.needsCompaction()) {
+                    crm.compact();
+                }
                 cout << "Exiting CRM system. Goodbye!" << endl;
                 break;
+            case 9:
+                Stats::print();
+                break;
+            case 10:
+                crm.findDuplicates("duplicates.csv", 0.8);
+                break;
+            case 11: {
+                int days;
+                string type;
+                cout << "Enter the number of days to show, today included: ";
+                cin >> days;
+                cout << "Enter Interaction Type (Meeting/Contact/Contract) or all: ";
+                cin >> type;
+                crm.reportUpcoming(days, type);
+                break;
+            }
+            case 12: {
+                int days;
+                cout << "Enter the number of days without contact: ";
+                cin >> days;
+                crm.reportLastTouch(days);
+                break;
+            }
             default:
                 cout << "Invalid choice, please try again!" << endl;
                 break;